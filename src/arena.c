@@ -0,0 +1,198 @@
+#include "arena.h"
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// the first chunk is allocated along with the arena, most requests fit into it
+#define ARENA_CHUNK_SIZE 4096
+
+// larger allocations get a chunk of their own
+#define ARENA_LARGE_SIZE (ARENA_CHUNK_SIZE / 4)
+
+// max_align_t is C11
+typedef union {
+        long double d;
+        long long l;
+        void *p;
+} ArenaAlign;
+
+#define ARENA_ALIGN __alignof__(ArenaAlign)
+
+typedef struct ArenaChunk ArenaChunk;
+
+struct ArenaChunk {
+        ArenaChunk *next;
+        size_t size;
+        size_t used;
+        ArenaAlign data[];
+};
+
+struct Arena {
+        ArenaChunk *chunks;     // the one allocated from first
+        ArenaChunk *first;      // shares the allocation of the arena
+        ArenaChunk *last_chunk;
+        void *last;             // the most recent allocation, which may grow in place
+};
+
+static size_t align_size(size_t size) {
+        return (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+Arena * arena_new(void) {
+        Arena *arena;
+
+        arena = malloc(align_size(sizeof(Arena)) + sizeof(ArenaChunk) + ARENA_CHUNK_SIZE);
+        if (!arena)
+                return NULL;
+
+        arena->first = (ArenaChunk *)((char *)arena + align_size(sizeof(Arena)));
+        arena->first->next = NULL;
+        arena->first->size = ARENA_CHUNK_SIZE;
+        arena->first->used = 0;
+        arena->chunks = arena->first;
+        arena->last_chunk = NULL;
+        arena->last = NULL;
+
+        return arena;
+}
+
+Arena * arena_free(Arena *arena) {
+        ArenaChunk *chunk = arena->chunks;
+
+        while (chunk) {
+                ArenaChunk *next = chunk->next;
+
+                if (chunk != arena->first)
+                        free(chunk);
+                chunk = next;
+        }
+
+        free(arena);
+        return NULL;
+}
+
+void arena_freep(Arena **arenap) {
+        if (*arenap)
+                arena_free(*arenap);
+}
+
+static ArenaChunk * arena_add_chunk(Arena *arena, size_t size) {
+        ArenaChunk *chunk;
+
+        chunk = malloc(sizeof(ArenaChunk) + size);
+        if (!chunk)
+                return NULL;
+
+        chunk->size = size;
+        chunk->used = 0;
+
+        if (size > ARENA_CHUNK_SIZE) {
+                // keep allocating from the current chunk afterwards
+                chunk->next = arena->chunks->next;
+                arena->chunks->next = chunk;
+        } else {
+                chunk->next = arena->chunks;
+                arena->chunks = chunk;
+        }
+
+        return chunk;
+}
+
+void * arena_alloc(Arena *arena, size_t size) {
+        ArenaChunk *chunk = arena->chunks;
+        void *p;
+
+        size = align_size(size ? size : 1);
+
+        if (chunk->size - chunk->used < size) {
+                chunk = arena_add_chunk(arena, size >= ARENA_LARGE_SIZE ? size : ARENA_CHUNK_SIZE);
+                if (!chunk)
+                        return NULL;
+        }
+
+        p = (char *)chunk->data + chunk->used;
+        chunk->used += size;
+        arena->last_chunk = chunk;
+        arena->last = p;
+
+        return p;
+}
+
+void * arena_alloc0(Arena *arena, size_t size) {
+        void *p;
+
+        p = arena_alloc(arena, size);
+        if (p)
+                memset(p, 0, size);
+
+        return p;
+}
+
+void * arena_realloc(Arena *arena, void *p, size_t old_size, size_t size) {
+        ArenaChunk *chunk = arena->last_chunk;
+        void *q;
+
+        if (!p)
+                return arena_alloc(arena, size);
+
+        if (p == arena->last) {
+                size_t offset = (char *)p - (char *)chunk->data;
+
+                if (chunk->size - offset >= align_size(size)) {
+                        chunk->used = offset + align_size(size);
+                        return p;
+                }
+        }
+
+        if (size <= old_size)
+                return p;
+
+        q = arena_alloc(arena, size);
+        if (q)
+                memcpy(q, p, old_size);
+
+        return q;
+}
+
+char * arena_strndup(Arena *arena, const char *string, size_t n) {
+        char *copy;
+
+        n = strnlen(string, n);
+
+        copy = arena_alloc(arena, n + 1);
+        if (!copy)
+                return NULL;
+
+        memcpy(copy, string, n);
+        copy[n] = '\0';
+
+        return copy;
+}
+
+char * arena_strdup(Arena *arena, const char *string) {
+        return arena_strndup(arena, string, SIZE_MAX);
+}
+
+char * arena_printf(Arena *arena, const char *format, ...) {
+        va_list ap;
+        char *string;
+        int n;
+
+        va_start(ap, format);
+        n = vsnprintf(NULL, 0, format, ap);
+        va_end(ap);
+        if (n < 0)
+                return NULL;
+
+        string = arena_alloc(arena, n + 1);
+        if (!string)
+                return NULL;
+
+        va_start(ap, format);
+        vsnprintf(string, n + 1, format, ap);
+        va_end(ap);
+
+        return string;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdlib.h>
+
+/* A bump allocator for data that lives exactly as long as one HTTP request.
+ * Nothing is freed individually, arena_free() releases everything at once.
+ * All allocations are aligned for any type. */
+typedef struct Arena Arena;
+
+Arena * arena_new(void);
+Arena * arena_free(Arena *arena);
+void arena_freep(Arena **arenap);
+
+void * arena_alloc(Arena *arena, size_t size);
+void * arena_alloc0(Arena *arena, size_t size);
+// grows the last allocation in place when possible, copies otherwise
+void * arena_realloc(Arena *arena, void *p, size_t old_size, size_t size);
+
+char * arena_strdup(Arena *arena, const char *string);
+char * arena_strndup(Arena *arena, const char *string, size_t n);
+char * arena_printf(Arena *arena, const char *format, ...) __attribute__((format(printf, 2, 3)));
@@ -0,0 +1,446 @@
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include "assets.h"
+#include "http-server.h"
+#include "log.h"
+
+#define _cleanup_(fn) __attribute__((__cleanup__(fn)))
+
+// a content hash is at least this long and mixes digits with a-f
+#define ASSET_HASH_MIN_LENGTH 8
+// guards against symlink loops
+#define ASSET_MAX_DEPTH 32
+
+#define ASSET_INOTIFY_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB | IN_ONLYDIR)
+
+struct AssetIndex {
+        char *www_dir;
+        int dir_fd;                     // of www_dir as last indexed
+        Asset **assets;
+        size_t n_assets;
+        size_t n_alloced_assets;
+        uint32_t *index;                // hash of path -> 1 + asset
+        size_t n_index;
+        int inotify_fd;
+        sd_event_source *inotify_event;
+};
+
+typedef struct {
+        const char *extension;
+        const char *content_type;
+} AssetType;
+
+static const AssetType asset_types[] = {
+        { "html",  "text/html; charset=utf-8" },
+        { "css",   "text/css; charset=utf-8" },
+        { "js",    "application/javascript" },
+        { "json",  "application/json" },
+        { "map",   "application/octet-stream" },
+        { "ico",   "image/x-icon" },
+        { "png",   "image/png" },
+        { "jpg",   "image/jpg" },
+        { "gif",   "image/gif" },
+        { "svg",   "image/svg+xml" },
+        { "ttf",   "application/x-font-ttf" },
+        { "woff2", "font/woff2" },
+};
+
+static const char * const asset_encoding_table[_ASSET_ENCODING_MAX] = {
+        [ASSET_ENCODING_IDENTITY] = "identity",
+        [ASSET_ENCODING_GZIP] = "gzip",
+        [ASSET_ENCODING_BROTLI] = "br",
+};
+
+static const char * const asset_encoding_suffix[_ASSET_ENCODING_MAX] = {
+        [ASSET_ENCODING_GZIP] = ".gz",
+        [ASSET_ENCODING_BROTLI] = ".br",
+};
+
+static inline void freep(void *p) {
+        free(*(void **)p);
+}
+
+static void closedirp(DIR **dirp) {
+        if (*dirp)
+                closedir(*dirp);
+}
+
+static const char * asset_content_type(const char *name) {
+        const char *dot = strrchr(name, '.');
+
+        if (!dot)
+                return NULL;
+
+        for (size_t i = 0; i < sizeof(asset_types) / sizeof(asset_types[0]); i++)
+                if (strcmp(dot + 1, asset_types[i].extension) == 0)
+                        return asset_types[i].content_type;
+
+        return NULL;
+}
+
+/* Bundlers name their output like "app.3f2a9c1b.js" or "chunk-5d41402a.css".
+ * Such a file never changes, a new build gets a new name. Segments of only
+ * digits are dates or versions, as in "bundle-20241018.js", which a deploy
+ * may well overwrite. */
+static bool asset_name_is_hashed(const char *name) {
+        const char *extension = strrchr(name, '.');
+
+        for (const char *p = name; p < extension;) {
+                size_t len = strcspn(p, ".-_");
+                bool hex = len >= ASSET_HASH_MIN_LENGTH;
+                bool digit = false, letter = false;
+
+                for (size_t i = 0; hex && i < len; i++) {
+                        hex = isxdigit((unsigned char)p[i]);
+                        if (isdigit((unsigned char)p[i]))
+                                digit = true;
+                        else
+                                letter = true;
+                }
+                if (hex && digit && letter && p > name && p + len <= extension)
+                        return true;
+
+                p += len + 1;
+        }
+
+        return false;
+}
+
+static uint32_t asset_hash(const char *path) {
+        uint32_t hash = 2166136261u;    // FNV-1a
+
+        for (; *path; path++)
+                hash = (hash ^ (unsigned char)*path) * 16777619u;
+
+        return hash;
+}
+
+static void asset_free(Asset *asset) {
+        free(asset->path);
+        free(asset);
+}
+
+static void asset_index_clear(AssetIndex *index) {
+        for (size_t i = 0; i < index->n_assets; i++)
+                asset_free(index->assets[i]);
+
+        free(index->assets);
+        index->assets = NULL;
+        index->n_assets = 0;
+        index->n_alloced_assets = 0;
+
+        free(index->index);
+        index->index = NULL;
+        index->n_index = 0;
+
+        if (index->dir_fd >= 0)
+                close(index->dir_fd);
+        index->dir_fd = -1;
+}
+
+static int asset_variant_set(AssetVariant *variant, const struct stat *st) {
+        if (!S_ISREG(st->st_mode))
+                return -EINVAL;
+
+        variant->exists = true;
+        variant->size = st->st_size;
+        variant->mtime = st->st_mtim;
+
+        return 0;
+}
+
+static int asset_variant_stat(int dir_fd, const char *name, AssetVariant *variant) {
+        struct stat st;
+
+        if (fstatat(dir_fd, name, &st, 0) < 0)
+                return -errno;
+
+        return asset_variant_set(variant, &st);
+}
+
+static int asset_index_add(AssetIndex *index, int dir_fd, const char *prefix, const char *name, const char *content_type) {
+        Asset *asset;
+        int r;
+
+        asset = calloc(1, sizeof(Asset));
+
+        r = asset_variant_stat(dir_fd, name, &asset->variants[ASSET_ENCODING_IDENTITY]);
+        if (r < 0) {
+                asset_free(asset);
+                return r;
+        }
+
+        for (size_t i = 1; i < _ASSET_ENCODING_MAX; i++) {
+                _cleanup_(freep) char *sibling = NULL;
+
+                if (asprintf(&sibling, "%s%s", name, asset_encoding_suffix[i]) < 0) {
+                        asset_free(asset);
+                        return -ENOMEM;
+                }
+                asset_variant_stat(dir_fd, sibling, &asset->variants[i]);
+        }
+
+        if (asprintf(&asset->path, "%s/%s", prefix, name) < 0) {
+                asset->path = NULL;
+                asset_free(asset);
+                return -ENOMEM;
+        }
+        asset->content_type = content_type;
+        asset->immutable = asset_name_is_hashed(name);
+
+        if (index->n_assets == index->n_alloced_assets) {
+                index->n_alloced_assets = index->n_alloced_assets ? index->n_alloced_assets * 2 : 32;
+                index->assets = realloc(index->assets, index->n_alloced_assets * sizeof(Asset *));
+        }
+        index->assets[index->n_assets++] = asset;
+
+        return 0;
+}
+
+// prefix is the request path of the directory, "" for www_dir itself
+static int asset_index_scan(AssetIndex *index, int dir_fd, const char *prefix, unsigned depth) {
+        _cleanup_(closedirp) DIR *dir = NULL;
+        struct dirent *entry;
+
+        if (index->inotify_fd >= 0) {
+                _cleanup_(freep) char *path = NULL;
+
+                if (asprintf(&path, "%s%s", index->www_dir, prefix) >= 0 &&
+                    inotify_add_watch(index->inotify_fd, path, ASSET_INOTIFY_MASK) < 0)
+                        log_warning("Cannot watch %s for changes: %s", path, strerror(errno));
+        }
+
+        dir = fdopendir(dir_fd);
+        if (!dir) {
+                int r = -errno;
+
+                close(dir_fd);
+                return r;
+        }
+
+        while ((entry = readdir(dir))) {
+                struct stat st;
+                const char *content_type;
+
+                if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+                        continue;
+
+                if (fstatat(dirfd(dir), entry->d_name, &st, 0) < 0)
+                        continue;
+
+                if (S_ISDIR(st.st_mode)) {
+                        _cleanup_(freep) char *sub_prefix = NULL;
+                        int sub_fd;
+
+                        if (depth == ASSET_MAX_DEPTH)
+                                continue;
+
+                        sub_fd = openat(dirfd(dir), entry->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                        if (sub_fd < 0 || asprintf(&sub_prefix, "%s/%s", prefix, entry->d_name) < 0) {
+                                if (sub_fd >= 0)
+                                        close(sub_fd);
+                                continue;
+                        }
+
+                        asset_index_scan(index, sub_fd, sub_prefix, depth + 1);
+                        continue;
+                }
+
+                // compressed siblings are picked up along with their file
+                content_type = asset_content_type(entry->d_name);
+                if (!S_ISREG(st.st_mode) || !content_type)
+                        continue;
+
+                asset_index_add(index, dirfd(dir), prefix, entry->d_name, content_type);
+        }
+
+        return 0;
+}
+
+static void asset_index_build(AssetIndex *index) {
+        int dir_fd;
+
+        asset_index_clear(index);
+
+        index->dir_fd = open(index->www_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (index->dir_fd < 0) {
+                log_warning("Cannot read www directory %s: %s", index->www_dir, strerror(errno));
+                return;
+        }
+
+        // the scan consumes its descriptor, files are opened through the index's own
+        dir_fd = fcntl(index->dir_fd, F_DUPFD_CLOEXEC, 3);
+        if (dir_fd >= 0)
+                asset_index_scan(index, dir_fd, "", 0);
+
+        // at most half full
+        index->n_index = 16;
+        while (index->n_index < 2 * index->n_assets)
+                index->n_index *= 2;
+        index->index = calloc(index->n_index, sizeof(uint32_t));
+
+        for (size_t i = 0; i < index->n_assets; i++) {
+                size_t mask = index->n_index - 1;
+                size_t slot = asset_hash(index->assets[i]->path) & mask;
+
+                while (index->index[slot])
+                        slot = (slot + 1) & mask;
+                index->index[slot] = 1 + i;
+        }
+
+        log_info("Indexed %zu files in %s", index->n_assets, index->www_dir);
+}
+
+// any change below www_dir rebuilds the whole index, deployments change many files at once
+static int asset_index_handle_inotify(sd_event_source *event, int fd, uint32_t revents, void *userdata) {
+        AssetIndex *index = userdata;
+        char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+        while (read(fd, buffer, sizeof(buffer)) > 0)
+                ;
+
+        asset_index_build(index);
+
+        return 0;
+}
+
+int asset_index_new(AssetIndex **indexp, const char *www_dir, sd_event *loop) {
+        _cleanup_(asset_index_freep) AssetIndex *index = NULL;
+        int r;
+
+        index = calloc(1, sizeof(AssetIndex));
+        index->www_dir = strdup(www_dir);
+        index->dir_fd = -1;
+
+        // without inotify the index stays as it was at startup
+        index->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (index->inotify_fd < 0) {
+                log_warning("Cannot watch %s for changes, serving the files found at startup: %s",
+                            www_dir, strerror(errno));
+        } else {
+                r = sd_event_add_io(loop, &index->inotify_event, index->inotify_fd, EPOLLIN,
+                                    asset_index_handle_inotify, index);
+                if (r < 0)
+                        return r;
+        }
+
+        asset_index_build(index);
+
+        *indexp = index;
+        index = NULL;
+
+        return 0;
+}
+
+AssetIndex * asset_index_free(AssetIndex *index) {
+        asset_index_clear(index);
+
+        if (index->inotify_event)
+                sd_event_source_unref(index->inotify_event);
+        if (index->inotify_fd >= 0)
+                close(index->inotify_fd);
+
+        free(index->www_dir);
+        free(index);
+
+        return NULL;
+}
+
+void asset_index_freep(AssetIndex **indexp) {
+        if (*indexp)
+                asset_index_free(*indexp);
+}
+
+static const Asset * asset_index_find(AssetIndex *index, const char *path) {
+        size_t mask = index->n_index - 1;
+
+        if (index->n_index == 0)
+                return NULL;
+
+        for (size_t slot = asset_hash(path) & mask; index->index[slot]; slot = (slot + 1) & mask) {
+                Asset *asset = index->assets[index->index[slot] - 1];
+
+                if (strcmp(asset->path, path) == 0)
+                        return asset;
+        }
+
+        return NULL;
+}
+
+const Asset * asset_index_lookup(AssetIndex *index, const char *path) {
+        const Asset *asset;
+        size_t len;
+
+        asset = asset_index_find(index, path);
+        if (asset)
+                return asset;
+
+        len = strlen(path);
+        while (len > 0 && path[len - 1] == '/')
+                len -= 1;
+
+        {
+                char index_path[len + sizeof("/index.html")];
+
+                memcpy(index_path, path, len);
+                strcpy(index_path + len, "/index.html");
+
+                return asset_index_find(index, index_path);
+        }
+}
+
+int asset_open(AssetIndex *index, const Asset *asset, AssetEncoding encoding, AssetVariant *variant) {
+        _cleanup_(freep) char *name = NULL;
+        struct stat st;
+        int fd, r;
+
+        // asset paths start with a slash
+        if (asprintf(&name, "%s%s", asset->path + 1, encoding ? asset_encoding_suffix[encoding] : "") < 0)
+                return -ENOMEM;
+
+        fd = openat(index->dir_fd, name, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+        if (fd < 0)
+                return -errno;
+
+        if (fstat(fd, &st) < 0) {
+                r = -errno;
+                close(fd);
+                return r;
+        }
+
+        *variant = (AssetVariant){};
+        r = asset_variant_set(variant, &st);
+        if (r < 0) {
+                close(fd);
+                return r;
+        }
+
+        return fd;
+}
+
+bool accept_encoding_allows(const char *accept_encoding, const char *encoding) {
+        return http_header_quality(accept_encoding, encoding) > 0;
+}
+
+AssetEncoding asset_choose_encoding(const Asset *asset, const char *accept_encoding) {
+        if (asset->variants[ASSET_ENCODING_BROTLI].exists && accept_encoding_allows(accept_encoding, "br"))
+                return ASSET_ENCODING_BROTLI;
+
+        if (asset->variants[ASSET_ENCODING_GZIP].exists && accept_encoding_allows(accept_encoding, "gzip"))
+                return ASSET_ENCODING_GZIP;
+
+        return ASSET_ENCODING_IDENTITY;
+}
+
+const char * asset_encoding_to_string(AssetEncoding encoding) {
+        return asset_encoding_table[encoding];
+}
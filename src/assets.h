@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <systemd/sd-event.h>
+
+typedef struct AssetIndex AssetIndex;
+
+typedef enum {
+        ASSET_ENCODING_IDENTITY,
+        ASSET_ENCODING_GZIP,            // from a "<name>.gz" sibling
+        ASSET_ENCODING_BROTLI,          // from a "<name>.br" sibling
+        _ASSET_ENCODING_MAX
+} AssetEncoding;
+
+typedef struct {
+        bool exists;
+        uint64_t size;
+        struct timespec mtime;
+} AssetVariant;
+
+/* A file below the www directory, as found when the index was built. Only
+ * the metadata is kept, files are opened per request. Files whose type is
+ * not known are not indexed and so never served. */
+typedef struct {
+        char *path;                     // as requested, e.g. "/js/app.js"
+        const char *content_type;
+        bool immutable;                 // the name carries a content hash
+        AssetVariant variants[_ASSET_ENCODING_MAX];
+} Asset;
+
+/* Indexes www_dir at startup and keeps the index current with inotify, if
+ * it is available. A www_dir that cannot be read results in an empty index.
+ * Assets returned by asset_index_lookup() are valid until control returns
+ * to the loop. */
+int asset_index_new(AssetIndex **indexp, const char *www_dir, sd_event *loop);
+AssetIndex * asset_index_free(AssetIndex *index);
+void asset_index_freep(AssetIndex **indexp);
+
+// a directory resolves to its index.html
+const Asset * asset_index_lookup(AssetIndex *index, const char *path);
+
+// the best variant allowed by an Accept-Encoding header, which may be NULL
+AssetEncoding asset_choose_encoding(const Asset *asset, const char *accept_encoding);
+const char * asset_encoding_to_string(AssetEncoding encoding);
+/* Opens a variant for reading and returns its descriptor, which the caller
+ * closes, or a negative errno. variant is set from the file that was
+ * actually opened, which may have changed since it was indexed. */
+int asset_open(AssetIndex *index, const Asset *asset, AssetEncoding encoding, AssetVariant *variant);
+
+// true if an Accept-Encoding header lists encoding with a non-zero quality
+bool accept_encoding_allows(const char *accept_encoding, const char *encoding);
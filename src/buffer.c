@@ -0,0 +1,161 @@
+#include "buffer.h"
+
+#include <errno.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// size classes from 1 KiB to 1 MiB, larger buffers go back to the allocator
+#define BUFFER_POOL_MIN_SHIFT 10
+#define BUFFER_POOL_N_CLASSES 11
+#define BUFFER_POOL_CLASS_MAX 8
+
+typedef struct {
+        void *data[BUFFER_POOL_CLASS_MAX];
+        size_t n_data;
+} BufferPoolClass;
+
+static BufferPoolClass buffer_pool[BUFFER_POOL_N_CLASSES];
+
+// makes room for n more bytes and the terminating NUL
+int buffer_reserve(Buffer *buffer, size_t n) {
+        size_t alloced = buffer->alloced ? buffer->alloced : 256;
+        char *data;
+
+        if (buffer->alloced - buffer->size > n)
+                return 0;
+        if (n > SIZE_MAX / 2 - buffer->size)
+                return -ENOMEM;
+
+        while (alloced - buffer->size <= n)
+                alloced *= 2;
+
+        data = realloc(buffer->data, alloced);
+        if (!data)
+                return -ENOMEM;
+
+        buffer->data = data;
+        buffer->data[buffer->size] = '\0';
+        buffer->alloced = alloced;
+
+        return 0;
+}
+
+int buffer_printf(Buffer *buffer, const char *format, ...) {
+        va_list ap;
+        int n, r;
+
+        va_start(ap, format);
+        n = vsnprintf(buffer->data + buffer->size, buffer->alloced - buffer->size, format, ap);
+        va_end(ap);
+        if (n < 0)
+                return -EINVAL;
+
+        if ((size_t)n >= buffer->alloced - buffer->size) {
+                r = buffer_reserve(buffer, n);
+                if (r < 0)
+                        return r;
+
+                va_start(ap, format);
+                vsnprintf(buffer->data + buffer->size, buffer->alloced - buffer->size, format, ap);
+                va_end(ap);
+        }
+
+        buffer->size += n;
+
+        return 0;
+}
+
+/* Hands out the data, which the caller has to free(). The buffer is empty
+ * afterwards. Never returns NULL. */
+char * buffer_steal(Buffer *buffer, size_t *sizep) {
+        char *data;
+
+        if (!buffer->data)
+                buffer_reserve(buffer, 0);
+
+        data = buffer->data;
+        if (sizep)
+                *sizep = buffer->size;
+
+        buffer->data = NULL;
+        buffer->size = 0;
+        buffer->alloced = 0;
+
+        return data;
+}
+
+void buffer_clear(Buffer *buffer) {
+        free(buffer->data);
+        buffer->data = NULL;
+        buffer->size = 0;
+        buffer->alloced = 0;
+}
+
+static size_t buffer_pool_size(unsigned class) {
+        return (size_t)1 << (class + BUFFER_POOL_MIN_SHIFT);
+}
+
+int buffer_pool_reserve(Buffer *buffer, size_t n) {
+        BufferPoolClass *pool;
+        unsigned class = 0;
+
+        if (buffer->data || n >= buffer_pool_size(BUFFER_POOL_N_CLASSES - 1))
+                return buffer_reserve(buffer, n);
+
+        // the smallest class that holds n bytes and the terminating NUL
+        while (buffer_pool_size(class) <= n)
+                class += 1;
+
+        pool = &buffer_pool[class];
+        if (pool->n_data > 0) {
+                pool->n_data -= 1;
+                buffer->data = pool->data[pool->n_data];
+        } else {
+                buffer->data = malloc(buffer_pool_size(class));
+                if (!buffer->data)
+                        return -ENOMEM;
+        }
+
+        buffer->data[0] = '\0';
+        buffer->size = 0;
+        buffer->alloced = buffer_pool_size(class);
+
+        return 0;
+}
+
+/* Takes back data of any size, which may have grown past the class it came
+ * from or never have been pooled at all. It is filed under the largest class
+ * it fills completely. */
+void buffer_pool_release(void *data) {
+        BufferPoolClass *pool;
+        unsigned class = 0;
+        size_t size;
+
+        if (!data)
+                return;
+
+        size = malloc_usable_size(data);
+        if (size < buffer_pool_size(0) || size >= 2 * buffer_pool_size(BUFFER_POOL_N_CLASSES - 1)) {
+                free(data);
+                return;
+        }
+
+        while (class + 1 < BUFFER_POOL_N_CLASSES && buffer_pool_size(class + 1) <= size)
+                class += 1;
+
+        pool = &buffer_pool[class];
+        if (pool->n_data == BUFFER_POOL_CLASS_MAX) {
+                free(data);
+                return;
+        }
+
+        pool->data[pool->n_data++] = data;
+}
+
+void buffer_pool_flush(void) {
+        for (unsigned class = 0; class < BUFFER_POOL_N_CLASSES; class++) {
+                while (buffer_pool[class].n_data > 0)
+                        free(buffer_pool[class].data[--buffer_pool[class].n_data]);
+        }
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A growable byte buffer. data is always NUL terminated once anything has
+ * been appended, so it can be handed to string functions directly. */
+typedef struct {
+        char *data;
+        size_t size;
+        size_t alloced;
+} Buffer;
+
+int buffer_reserve(Buffer *buffer, size_t n);
+int buffer_printf(Buffer *buffer, const char *format, ...) __attribute__((format(printf, 2, 3)));
+char * buffer_steal(Buffer *buffer, size_t *sizep);
+void buffer_clear(Buffer *buffer);
+
+/* Buffers for request and response bodies come from a pool of recycled allocations in
+ * power of two size classes, so a busy server does not go back to the
+ * allocator for every reply. buffer_pool_reserve() makes room for n bytes
+ * in an empty buffer, buffer_pool_release() takes back data stolen from any
+ * buffer and matches the free callback of MHD. The pool is not thread safe. */
+int buffer_pool_reserve(Buffer *buffer, size_t n);
+void buffer_pool_release(void *data);
+void buffer_pool_flush(void);
+
+static inline int buffer_append(Buffer *buffer, const void *data, size_t n) {
+        if (buffer->alloced - buffer->size <= n) {
+                int r = buffer_reserve(buffer, n);
+                if (r < 0)
+                        return r;
+        }
+
+        memcpy(buffer->data + buffer->size, data, n);
+        buffer->size += n;
+        buffer->data[buffer->size] = '\0';
+
+        return 0;
+}
+
+static inline int buffer_append_char(Buffer *buffer, char c) {
+        return buffer_append(buffer, &c, 1);
+}
+
+static inline int buffer_append_string(Buffer *buffer, const char *string) {
+        return buffer_append(buffer, string, strlen(string));
+}
@@ -0,0 +1,464 @@
+#include "cbor.h"
+
+#include <errno.h>
+#include <string.h>
+
+enum {
+        CBOR_MAJOR_UNSIGNED,
+        CBOR_MAJOR_NEGATIVE,
+        CBOR_MAJOR_BYTES,
+        CBOR_MAJOR_TEXT,
+        CBOR_MAJOR_ARRAY,
+        CBOR_MAJOR_MAP,
+        CBOR_MAJOR_TAG,
+        CBOR_MAJOR_SIMPLE,
+};
+
+enum {
+        CBOR_FALSE = 20,
+        CBOR_TRUE = 21,
+        CBOR_NULL = 22,
+        CBOR_HALF = 25,
+        CBOR_SINGLE = 26,
+        CBOR_DOUBLE = 27,
+        CBOR_INDEFINITE = 31,
+};
+
+#define CBOR_BREAK 0xff
+
+void cbor_writer_init(CborWriter *writer, Buffer *buffer) {
+        writer->buffer = buffer;
+}
+
+// writes n big endian bytes of value after the initial byte
+static void cbor_write(CborWriter *writer, uint8_t initial, uint64_t value, size_t n) {
+        uint8_t head[9];
+
+        head[0] = initial;
+        for (size_t i = 0; i < n; i++)
+                head[1 + i] = value >> (8 * (n - 1 - i));
+
+        buffer_append(writer->buffer, head, 1 + n);
+}
+
+// the shortest head for a major type and its argument
+static void cbor_write_head(CborWriter *writer, unsigned major, uint64_t arg) {
+        if (arg < 24)
+                cbor_write(writer, major << 5 | arg, 0, 0);
+        else if (arg <= UINT8_MAX)
+                cbor_write(writer, major << 5 | 24, arg, 1);
+        else if (arg <= UINT16_MAX)
+                cbor_write(writer, major << 5 | 25, arg, 2);
+        else if (arg <= UINT32_MAX)
+                cbor_write(writer, major << 5 | 26, arg, 4);
+        else
+                cbor_write(writer, major << 5 | 27, arg, 8);
+}
+
+void cbor_writer_begin_map(CborWriter *writer) {
+        cbor_write(writer, CBOR_MAJOR_MAP << 5 | CBOR_INDEFINITE, 0, 0);
+}
+
+void cbor_writer_end_map(CborWriter *writer) {
+        cbor_write(writer, CBOR_BREAK, 0, 0);
+}
+
+void cbor_writer_begin_array(CborWriter *writer) {
+        cbor_write(writer, CBOR_MAJOR_ARRAY << 5 | CBOR_INDEFINITE, 0, 0);
+}
+
+void cbor_writer_end_array(CborWriter *writer) {
+        cbor_write(writer, CBOR_BREAK, 0, 0);
+}
+
+void cbor_writer_text(CborWriter *writer, const char *string) {
+        size_t len = strlen(string);
+
+        cbor_write_head(writer, CBOR_MAJOR_TEXT, len);
+        buffer_append(writer->buffer, string, len);
+}
+
+void cbor_writer_bytes(CborWriter *writer, const void *data, size_t size) {
+        cbor_write_head(writer, CBOR_MAJOR_BYTES, size);
+        buffer_append(writer->buffer, data, size);
+}
+
+void cbor_writer_integer(CborWriter *writer, int64_t integer) {
+        if (integer < 0)
+                cbor_write_head(writer, CBOR_MAJOR_NEGATIVE, -1 - integer);
+        else
+                cbor_write_head(writer, CBOR_MAJOR_UNSIGNED, integer);
+}
+
+void cbor_writer_unsigned(CborWriter *writer, uint64_t integer) {
+        cbor_write_head(writer, CBOR_MAJOR_UNSIGNED, integer);
+}
+
+void cbor_writer_double(CborWriter *writer, double number) {
+        float single = number;
+        double back = single;
+        uint64_t bits;
+        uint32_t single_bits;
+
+        // compared bitwise, -ffast-math makes == unreliable for NaN and -0
+        if (memcmp(&back, &number, sizeof(number)) == 0) {
+                memcpy(&single_bits, &single, sizeof(single_bits));
+                cbor_write(writer, CBOR_MAJOR_SIMPLE << 5 | CBOR_SINGLE, single_bits, 4);
+                return;
+        }
+
+        memcpy(&bits, &number, sizeof(bits));
+        cbor_write(writer, CBOR_MAJOR_SIMPLE << 5 | CBOR_DOUBLE, bits, 8);
+}
+
+void cbor_writer_boolean(CborWriter *writer, bool b) {
+        cbor_write(writer, CBOR_MAJOR_SIMPLE << 5 | (b ? CBOR_TRUE : CBOR_FALSE), 0, 0);
+}
+
+void cbor_writer_null(CborWriter *writer) {
+        cbor_write(writer, CBOR_MAJOR_SIMPLE << 5 | CBOR_NULL, 0, 0);
+}
+
+
+void cbor_reader_init(CborReader *reader, void *data, size_t size) {
+        reader->p = data;
+        reader->end = reader->p + size;
+}
+
+/* Decodes the head of the next item without consuming it. Returns its size,
+ * or 0 if it is truncated or malformed. Lengths that cannot fit into the
+ * rest of the input are rejected here, so a definite length never equals
+ * CBOR_LENGTH_INDEFINITE. */
+static size_t cbor_peek_head(CborReader *reader, unsigned *majorp, uint64_t *argp) {
+        const uint8_t *p = reader->p;
+        unsigned major, info;
+        uint64_t arg = 0;
+        size_t n;
+
+        if (p >= reader->end)
+                return 0;
+
+        major = *p >> 5;
+        info = *p & 0x1f;
+
+        if (info < 24) {
+                arg = info;
+                n = 0;
+        } else if (info <= 27) {
+                n = 1 << (info - 24);
+                if ((size_t)(reader->end - p - 1) < n)
+                        return 0;
+                for (size_t i = 1; i <= n; i++)
+                        arg = arg << 8 | p[i];
+        } else if (info == CBOR_INDEFINITE) {
+                if (major <= CBOR_MAJOR_NEGATIVE || major == CBOR_MAJOR_TAG)
+                        return 0;
+                *majorp = major;
+                *argp = CBOR_LENGTH_INDEFINITE;
+                return 1;
+        } else
+                return 0;
+
+        // strings need that many bytes, maps and arrays at least that many
+        if (major >= CBOR_MAJOR_BYTES && major <= CBOR_MAJOR_MAP &&
+            arg > (uint64_t)(reader->end - p - 1 - n))
+                return 0;
+
+        *majorp = major;
+        *argp = arg;
+        return 1 + n;
+}
+
+static void cbor_skip_tags(CborReader *reader) {
+        unsigned major;
+        uint64_t arg;
+        size_t n;
+
+        while ((n = cbor_peek_head(reader, &major, &arg)) > 0 && major == CBOR_MAJOR_TAG)
+                reader->p += n;
+}
+
+// consumes the head of an item of the given major type
+static bool cbor_read_head(CborReader *reader, unsigned major, uint64_t *argp) {
+        unsigned m;
+        size_t n;
+
+        cbor_skip_tags(reader);
+
+        n = cbor_peek_head(reader, &m, argp);
+        if (n == 0 || m != major)
+                return false;
+
+        reader->p += n;
+        return true;
+}
+
+CborType cbor_reader_peek(CborReader *reader) {
+        unsigned major;
+        uint64_t arg;
+
+        cbor_skip_tags(reader);
+
+        if (cbor_peek_head(reader, &major, &arg) == 0)
+                return 0;
+
+        switch (major) {
+                case CBOR_MAJOR_UNSIGNED:
+                case CBOR_MAJOR_NEGATIVE:
+                        return CBOR_TYPE_NUMBER;
+                case CBOR_MAJOR_BYTES:
+                        return CBOR_TYPE_BYTES;
+                case CBOR_MAJOR_TEXT:
+                        return CBOR_TYPE_TEXT;
+                case CBOR_MAJOR_ARRAY:
+                        return CBOR_TYPE_ARRAY;
+                case CBOR_MAJOR_MAP:
+                        return CBOR_TYPE_MAP;
+                case CBOR_MAJOR_SIMPLE:
+                        switch (*reader->p & 0x1f) {
+                                case CBOR_FALSE:
+                                        return CBOR_TYPE_FALSE;
+                                case CBOR_TRUE:
+                                        return CBOR_TYPE_TRUE;
+                                case CBOR_NULL:
+                                        return CBOR_TYPE_NULL;
+                                case CBOR_HALF:
+                                case CBOR_SINGLE:
+                                case CBOR_DOUBLE:
+                                        return CBOR_TYPE_NUMBER;
+                        }
+                        return 0;
+        }
+
+        return 0;
+}
+
+bool cbor_reader_begin_map(CborReader *reader, size_t *remainingp) {
+        uint64_t arg;
+
+        if (!cbor_read_head(reader, CBOR_MAJOR_MAP, &arg))
+                return false;
+
+        *remainingp = arg;
+        return true;
+}
+
+bool cbor_reader_begin_array(CborReader *reader, size_t *remainingp) {
+        uint64_t arg;
+
+        if (!cbor_read_head(reader, CBOR_MAJOR_ARRAY, &arg))
+                return false;
+
+        *remainingp = arg;
+        return true;
+}
+
+int cbor_reader_next(CborReader *reader, size_t *remainingp) {
+        if (*remainingp == CBOR_LENGTH_INDEFINITE) {
+                if (reader->p >= reader->end)
+                        return -EINVAL;
+
+                if (*reader->p == CBOR_BREAK) {
+                        reader->p += 1;
+                        return 0;
+                }
+
+                return 1;
+        }
+
+        if (*remainingp == 0)
+                return 0;
+
+        *remainingp -= 1;
+        return 1;
+}
+
+bool cbor_reader_read_text(CborReader *reader, const char **stringp) {
+        uint8_t *start = reader->p;
+        uint64_t len;
+
+        if (!cbor_read_head(reader, CBOR_MAJOR_TEXT, &len) || len == CBOR_LENGTH_INDEFINITE)
+                return false;
+
+        // D-Bus strings cannot contain NUL
+        if (memchr(reader->p, '\0', len))
+                return false;
+
+        // the head is at least one byte, which leaves room for the terminator
+        memmove(start, reader->p, len);
+        start[len] = '\0';
+
+        reader->p += len;
+        *stringp = (const char *)start;
+        return true;
+}
+
+bool cbor_reader_read_bytes(CborReader *reader, const void **datap, size_t *sizep) {
+        uint64_t size;
+
+        if (!cbor_read_head(reader, CBOR_MAJOR_BYTES, &size) || size == CBOR_LENGTH_INDEFINITE)
+                return false;
+
+        *datap = reader->p;
+        *sizep = size;
+
+        reader->p += size;
+        return true;
+}
+
+// IEEE 754 binary16, built bit by bit to avoid pulling in libm for ldexp()
+static double cbor_half_to_double(uint16_t half) {
+        uint64_t sign = (uint64_t)(half >> 15) << 63;
+        unsigned exponent = (half >> 10) & 0x1f;
+        uint64_t mantissa = half & 0x3ff;
+        uint64_t bits;
+        double number;
+
+        if (exponent == 0) {
+                // subnormal, mantissa * 2^-24 is exact
+                number = mantissa / 16777216.0;
+                return sign ? -number : number;
+        }
+
+        if (exponent == 31)
+                bits = sign | 0x7ff0000000000000ULL | mantissa << 42;
+        else
+                bits = sign | (uint64_t)(exponent - 15 + 1023) << 52 | mantissa << 42;
+
+        memcpy(&number, &bits, sizeof(number));
+        return number;
+}
+
+bool cbor_reader_read_number(CborReader *reader, JsonNumber *numberp) {
+        unsigned major;
+        uint64_t arg;
+        size_t n;
+
+        cbor_skip_tags(reader);
+
+        n = cbor_peek_head(reader, &major, &arg);
+        if (n == 0)
+                return false;
+
+        switch (major) {
+                case CBOR_MAJOR_UNSIGNED:
+                        if (arg <= INT64_MAX) {
+                                numberp->type = JSON_NUMBER_INTEGER;
+                                numberp->integer = arg;
+                        } else {
+                                numberp->type = JSON_NUMBER_UNSIGNED;
+                                numberp->unsigned_integer = arg;
+                        }
+                        break;
+
+                case CBOR_MAJOR_NEGATIVE:
+                        if (arg <= INT64_MAX) {
+                                numberp->type = JSON_NUMBER_INTEGER;
+                                numberp->integer = -1 - (int64_t)arg;
+                        } else {
+                                // below INT64_MIN, no D-Bus integer can hold it
+                                numberp->type = JSON_NUMBER_REAL;
+                                numberp->real = -1.0 - (double)arg;
+                        }
+                        break;
+
+                case CBOR_MAJOR_SIMPLE:
+                        numberp->type = JSON_NUMBER_REAL;
+                        switch (*reader->p & 0x1f) {
+                                case CBOR_HALF:
+                                        numberp->real = cbor_half_to_double(arg);
+                                        break;
+                                case CBOR_SINGLE: {
+                                        uint32_t bits = arg;
+                                        float single;
+
+                                        memcpy(&single, &bits, sizeof(single));
+                                        numberp->real = single;
+                                        break;
+                                }
+                                case CBOR_DOUBLE:
+                                        memcpy(&numberp->real, &arg, sizeof(numberp->real));
+                                        break;
+                                default:
+                                        return false;
+                        }
+                        break;
+
+                default:
+                        return false;
+        }
+
+        reader->p += n;
+        return true;
+}
+
+bool cbor_reader_read_boolean(CborReader *reader, bool *bp) {
+        switch (cbor_reader_peek(reader)) {
+                case CBOR_TYPE_TRUE:
+                        *bp = true;
+                        break;
+                case CBOR_TYPE_FALSE:
+                        *bp = false;
+                        break;
+                default:
+                        return false;
+        }
+
+        reader->p += 1;
+        return true;
+}
+
+bool cbor_reader_skip(CborReader *reader) {
+        unsigned major;
+        uint64_t arg;
+        size_t n, remaining;
+        int r;
+
+        cbor_skip_tags(reader);
+
+        n = cbor_peek_head(reader, &major, &arg);
+        if (n == 0)
+                return false;
+
+        reader->p += n;
+
+        switch (major) {
+                case CBOR_MAJOR_BYTES:
+                case CBOR_MAJOR_TEXT:
+                        if (arg != CBOR_LENGTH_INDEFINITE) {
+                                reader->p += arg;
+                                return true;
+                        }
+
+                        // definite length chunks of the same type up to the break
+                        remaining = CBOR_LENGTH_INDEFINITE;
+                        while ((r = cbor_reader_next(reader, &remaining)) > 0) {
+                                if (*reader->p >> 5 != major || (*reader->p & 0x1f) == CBOR_INDEFINITE ||
+                                    !cbor_reader_skip(reader))
+                                        return false;
+                        }
+                        return r == 0;
+
+                case CBOR_MAJOR_ARRAY:
+                case CBOR_MAJOR_MAP:
+                        remaining = arg;
+                        while ((r = cbor_reader_next(reader, &remaining)) > 0) {
+                                if (major == CBOR_MAJOR_MAP && !cbor_reader_skip(reader))
+                                        return false;
+                                if (!cbor_reader_skip(reader))
+                                        return false;
+                        }
+                        return r == 0;
+
+                case CBOR_MAJOR_SIMPLE:
+                        // a break outside of an indefinite length item
+                        return arg != CBOR_LENGTH_INDEFINITE;
+
+                default:
+                        return true;
+        }
+}
+
+bool cbor_reader_at_end(CborReader *reader) {
+        return reader->p == reader->end;
+}
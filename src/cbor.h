@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "buffer.h"
+#include "json.h"
+
+/* CBOR (RFC 8949), the binary alternative to JSON for clients that send or
+ * accept application/cbor. Integers, doubles and byte strings keep their
+ * exact value. Numbers are read into a JsonNumber, so the D-Bus marshaller
+ * range checks both encodings the same way. */
+
+typedef enum CborType CborType;
+typedef struct CborReader CborReader;
+
+enum CborType {
+        CBOR_TYPE_MAP = 1,
+        CBOR_TYPE_ARRAY,
+        CBOR_TYPE_TEXT,
+        CBOR_TYPE_BYTES,
+        CBOR_TYPE_NUMBER,
+        CBOR_TYPE_TRUE,
+        CBOR_TYPE_FALSE,
+        CBOR_TYPE_NULL
+};
+
+#define CBOR_LENGTH_INDEFINITE SIZE_MAX
+
+/* Maps and arrays are written with indefinite length, because D-Bus
+ * messages do not tell the number of elements up front. Map keys are
+ * written like any other value. */
+typedef struct {
+        Buffer *buffer;
+} CborWriter;
+
+void cbor_writer_init(CborWriter *writer, Buffer *buffer);
+
+void cbor_writer_begin_map(CborWriter *writer);
+void cbor_writer_end_map(CborWriter *writer);
+void cbor_writer_begin_array(CborWriter *writer);
+void cbor_writer_end_array(CborWriter *writer);
+
+void cbor_writer_text(CborWriter *writer, const char *string);
+void cbor_writer_bytes(CborWriter *writer, const void *data, size_t size);
+void cbor_writer_integer(CborWriter *writer, int64_t integer);
+void cbor_writer_unsigned(CborWriter *writer, uint64_t integer);
+// written as a single precision float when that is exact
+void cbor_writer_double(CborWriter *writer, double number);
+void cbor_writer_boolean(CborWriter *writer, bool b);
+void cbor_writer_null(CborWriter *writer);
+
+/* A pull reader like JsonReader. Text strings are terminated in place by
+ * moving them over their header, so the input has to outlive them and is
+ * modified; cbor_reader_skip() leaves it untouched. The caller keeps the
+ * number of remaining elements of each open map or array, which
+ * cbor_reader_next() counts down. Tags are ignored and text strings must
+ * have a definite length. */
+struct CborReader {
+        uint8_t *p;
+        uint8_t *end;
+};
+
+void cbor_reader_init(CborReader *reader, void *data, size_t size);
+// returns 0 at the end of the input or for unsupported items
+CborType cbor_reader_peek(CborReader *reader);
+bool cbor_reader_begin_map(CborReader *reader, size_t *remainingp);
+bool cbor_reader_begin_array(CborReader *reader, size_t *remainingp);
+// returns 1 if another element or, in a map, key follows, 0 after the last one
+int cbor_reader_next(CborReader *reader, size_t *remainingp);
+bool cbor_reader_read_text(CborReader *reader, const char **stringp);
+bool cbor_reader_read_bytes(CborReader *reader, const void **datap, size_t *sizep);
+bool cbor_reader_read_number(CborReader *reader, JsonNumber *numberp);
+bool cbor_reader_read_boolean(CborReader *reader, bool *bp);
+bool cbor_reader_skip(CborReader *reader);
+bool cbor_reader_at_end(CborReader *reader);
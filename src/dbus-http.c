@@ -10,61 +10,51 @@
 #include <unistd.h>
 
 #include "systemd-compat.h"
+#include "cbor.h"
 #include "dbus-http.h"
 #include "dbus.h"
 #include "json.h"
+#include "json-writer.h"
 #include "log.h"
 #include "environment.h"
 
 #define _cleanup_(fn) __attribute__((__cleanup__(fn)))
 
 
+// allocated from the request's arena, along with everything it references
 typedef struct {
         char *destination;
         char *object;
-        JsonValue *json;
+        const char *interface;          // these point into the request body
+        const char *method_name;
+        bool cbor;                      // the body is application/cbor, not JSON
+        JsonReader arguments;
+        CborReader cbor_arguments;
         DBusNode *node;
         DBusMethod *method;
 } MethodCallRequest;
 
-
-static int bus_message_element_to_json(sd_bus_message *message, JsonValue **jsonp);
-
 static inline void freep(void *p) {
         free(*(void **)p);
 }
 
-static void method_call_request_free(MethodCallRequest *request) {
-        free(request->destination);
-        free(request->object);
-        if (request->json)
-                json_value_free(request->json);
-        if (request->node)
-                dbus_node_free(request->node);
-        free(request);
-}
-
-static void http_response_end_json(HttpResponse *response, int status, JsonValue *reply) {
-        FILE *f;
-
-        f = http_response_get_stream(response, "application/json");
-        json_print(reply, f);
-        http_response_end(response, status);
-}
-
 static void http_response_end_error(HttpResponse *response, int status, const char *name, const char *message) {
-        _cleanup_(json_value_freep) JsonValue *reply;
-
-        reply = json_object_new();
-        json_object_insert_string(reply, "error", name);
-
-        if (message)
-                json_object_insert_string(reply, "message", message);
+        JsonWriter writer;
+
+        json_writer_init(&writer, http_response_get_buffer(response, "application/json"));
+        json_writer_begin_object(&writer);
+        json_writer_key(&writer, "error");
+        json_writer_string(&writer, name);
+        if (message) {
+                json_writer_key(&writer, "message");
+                json_writer_string(&writer, message);
+        }
+        json_writer_end_object(&writer);
 
-        http_response_end_json(response, status, reply);
+        http_response_end(response, status);
 }
 
-static void http_response_end_dbus_error(HttpResponse *response, const sd_bus_error *error) {
+void http_response_end_dbus_error(HttpResponse *response, const sd_bus_error *error) {
         int status;
 
         if (strcmp(error->name, "org.freedesktop.DBus.Error.UnknownMethod") == 0 ||
@@ -209,7 +199,167 @@ static int bus_message_dict_entry_to_json(sd_bus_message *message, char **keyp,
         return 0;
 }
 
-static int bus_message_element_to_json(sd_bus_message *message, JsonValue **jsonp) {
+/* Arrays of fixed size types ("ai", "ad", "ab", ...) are read with one
+ * sd_bus_message_read_array() call that points into the message, instead
+ * of a peek and a read per element. */
+
+static size_t bus_type_fixed_size(char type) {
+        switch (type) {
+                case SD_BUS_TYPE_BYTE:
+                        return 1;
+                case SD_BUS_TYPE_INT16:
+                case SD_BUS_TYPE_UINT16:
+                        return 2;
+                case SD_BUS_TYPE_INT32:
+                case SD_BUS_TYPE_UINT32:
+                case SD_BUS_TYPE_BOOLEAN:
+                        return 4;
+                default:
+                        return 8;
+        }
+}
+
+static bool bus_message_at_fixed_array(char type, const char *contents) {
+        return type == SD_BUS_TYPE_ARRAY && bus_type_is_fixed(contents[0]) && contents[1] == '\0';
+}
+
+// element i of a fixed size array, booleans are 0 or 1
+static void bus_fixed_array_get(const void *data, char type, size_t i, JsonNumber *number) {
+        number->type = JSON_NUMBER_INTEGER;
+
+        switch (type) {
+                case SD_BUS_TYPE_BYTE:
+                        number->integer = ((const uint8_t *)data)[i];
+                        break;
+                case SD_BUS_TYPE_INT16:
+                        number->integer = ((const int16_t *)data)[i];
+                        break;
+                case SD_BUS_TYPE_UINT16:
+                        number->integer = ((const uint16_t *)data)[i];
+                        break;
+                case SD_BUS_TYPE_INT32:
+                        number->integer = ((const int32_t *)data)[i];
+                        break;
+                case SD_BUS_TYPE_UINT32:
+                        number->integer = ((const uint32_t *)data)[i];
+                        break;
+                case SD_BUS_TYPE_BOOLEAN:
+                        number->integer = !!((const int32_t *)data)[i];
+                        break;
+                case SD_BUS_TYPE_INT64:
+                        number->integer = ((const int64_t *)data)[i];
+                        break;
+                case SD_BUS_TYPE_UINT64:
+                        if (((const uint64_t *)data)[i] > INT64_MAX) {
+                                number->type = JSON_NUMBER_UNSIGNED;
+                                number->unsigned_integer = ((const uint64_t *)data)[i];
+                        } else
+                                number->integer = ((const uint64_t *)data)[i];
+                        break;
+                case SD_BUS_TYPE_DOUBLE:
+                        number->type = JSON_NUMBER_REAL;
+                        number->real = ((const double *)data)[i];
+                        break;
+        }
+}
+
+static int bus_message_fixed_array_to_json(sd_bus_message *message, char type, JsonValue **jsonp) {
+        _cleanup_(json_value_freep) JsonValue *json = NULL;
+        const void *data;
+        size_t size;
+        int r;
+
+        r = sd_bus_message_read_array(message, type, &data, &size);
+        if (r < 0)
+                return r;
+
+        json = json_array_new();
+        for (size_t i = 0; i < size / bus_type_fixed_size(type); i++) {
+                JsonNumber number;
+
+                bus_fixed_array_get(data, type, i, &number);
+                if (type == SD_BUS_TYPE_BOOLEAN)
+                        json_array_append(json, json_boolean_new(number.integer));
+                else if (number.type == JSON_NUMBER_REAL)
+                        json_array_append(json, json_number_new(number.real));
+                else if (number.type == JSON_NUMBER_UNSIGNED)
+                        json_array_append(json, json_unsigned_new(number.unsigned_integer));
+                else
+                        json_array_append(json, json_integer_new(number.integer));
+        }
+
+        *jsonp = json;
+        json = NULL;
+
+        return 0;
+}
+
+static int bus_message_fixed_array_write_json(sd_bus_message *message, char type, JsonWriter *writer) {
+        const void *data;
+        size_t size, n;
+        int r;
+
+        r = sd_bus_message_read_array(message, type, &data, &size);
+        if (r < 0)
+                return r;
+
+        n = size / bus_type_fixed_size(type);
+
+        if (type != SD_BUS_TYPE_BOOLEAN && type != SD_BUS_TYPE_DOUBLE) {
+                json_writer_integer_array(writer, data, n, bus_type_fixed_size(type),
+                                          type == SD_BUS_TYPE_INT16 || type == SD_BUS_TYPE_INT32 || type == SD_BUS_TYPE_INT64);
+                return 0;
+        }
+
+        json_writer_begin_array(writer);
+        for (size_t i = 0; i < n; i++) {
+                JsonNumber number;
+
+                bus_fixed_array_get(data, type, i, &number);
+                if (type == SD_BUS_TYPE_BOOLEAN)
+                        json_writer_boolean(writer, number.integer);
+                else
+                        json_writer_number(writer, number.real);
+        }
+        json_writer_end_array(writer);
+
+        return 0;
+}
+
+static int bus_message_fixed_array_write_cbor(sd_bus_message *message, char type, CborWriter *writer) {
+        const void *data;
+        size_t size;
+        int r;
+
+        r = sd_bus_message_read_array(message, type, &data, &size);
+        if (r < 0)
+                return r;
+
+        if (type == SD_BUS_TYPE_BYTE) {
+                cbor_writer_bytes(writer, data, size);
+                return 0;
+        }
+
+        cbor_writer_begin_array(writer);
+        for (size_t i = 0; i < size / bus_type_fixed_size(type); i++) {
+                JsonNumber number;
+
+                bus_fixed_array_get(data, type, i, &number);
+                if (type == SD_BUS_TYPE_BOOLEAN)
+                        cbor_writer_boolean(writer, number.integer);
+                else if (number.type == JSON_NUMBER_REAL)
+                        cbor_writer_double(writer, number.real);
+                else if (number.type == JSON_NUMBER_UNSIGNED)
+                        cbor_writer_unsigned(writer, number.unsigned_integer);
+                else
+                        cbor_writer_integer(writer, number.integer);
+        }
+        cbor_writer_end_array(writer);
+
+        return 0;
+}
+
+int bus_message_element_to_json(sd_bus_message *message, JsonValue **jsonp) {
         _cleanup_(json_value_freep) JsonValue *json = NULL;
         const char *contents = NULL;
         char type;
@@ -227,7 +377,7 @@ static int bus_message_element_to_json(sd_bus_message *message, JsonValue **json
 
         switch (type) {
                 case SD_BUS_TYPE_BOOLEAN: {
-                        uint8_t b;
+                        int b;
                         r = sd_bus_message_read_basic(message, type, &b);
                         if (r < 0)
                                 return r;
@@ -240,7 +390,7 @@ static int bus_message_element_to_json(sd_bus_message *message, JsonValue **json
                         r = sd_bus_message_read_basic(message, type, &num);
                         if (r < 0)
                                 return r;
-                        json = json_number_new(num);
+                        json = json_integer_new(num);
                         break;
                 }
 
@@ -249,7 +399,7 @@ static int bus_message_element_to_json(sd_bus_message *message, JsonValue **json
                         r = sd_bus_message_read_basic(message, type, &num);
                         if (r < 0)
                                 return r;
-                        json = json_number_new(num);
+                        json = json_integer_new(num);
                         break;
                 }
 
@@ -258,7 +408,7 @@ static int bus_message_element_to_json(sd_bus_message *message, JsonValue **json
                         r = sd_bus_message_read_basic(message, type, &num);
                         if (r < 0)
                                 return r;
-                        json = json_number_new(num);
+                        json = json_integer_new(num);
                         break;
                 }
 
@@ -267,7 +417,7 @@ static int bus_message_element_to_json(sd_bus_message *message, JsonValue **json
                         r = sd_bus_message_read_basic(message, type, &num);
                         if (r < 0)
                                 return r;
-                        json = json_number_new(num);
+                        json = json_integer_new(num);
                         break;
                 }
 
@@ -276,7 +426,7 @@ static int bus_message_element_to_json(sd_bus_message *message, JsonValue **json
                         r = sd_bus_message_read_basic(message, type, &num);
                         if (r < 0)
                                 return r;
-                        json = json_number_new(num);
+                        json = json_integer_new(num);
                         break;
                 }
 
@@ -285,7 +435,7 @@ static int bus_message_element_to_json(sd_bus_message *message, JsonValue **json
                         r = sd_bus_message_read_basic(message, type, &num);
                         if (r < 0)
                                 return r;
-                        json = json_number_new(num);
+                        json = json_integer_new(num);
                         break;
                 }
 
@@ -294,7 +444,7 @@ static int bus_message_element_to_json(sd_bus_message *message, JsonValue **json
                         r = sd_bus_message_read_basic(message, type, &num);
                         if (r < 0)
                                 return r;
-                        json = json_number_new(num);
+                        json = json_unsigned_new(num);
                         break;
                 }
 
@@ -320,6 +470,13 @@ static int bus_message_element_to_json(sd_bus_message *message, JsonValue **json
 
                 case SD_BUS_TYPE_ARRAY:
                 case SD_BUS_TYPE_STRUCT:
+                        if (bus_message_at_fixed_array(type, contents)) {
+                                r = bus_message_fixed_array_to_json(message, contents[0], &json);
+                                if (r < 0)
+                                        return r;
+                                break;
+                        }
+
                         r = sd_bus_message_enter_container(message, type, contents);
                         if (r < 0)
                                 return r;
@@ -389,230 +546,1348 @@ static int bus_message_element_to_json(sd_bus_message *message, JsonValue **json
         return 0;
 }
 
-static int bus_message_to_json(sd_bus_message *message, JsonValue **jsonp, DBusMethod *method) {
-        _cleanup_(json_value_freep) JsonValue *json = NULL;
-        int r;
-
-        json = json_object_new();
-
-        for (size_t i = 0; i < method->n_out_args; i++) {
-                _cleanup_(json_value_freep) JsonValue *element = NULL;
-
-                if (sd_bus_message_at_end(message, false)){
-                        log_err("sd_bus_message_at_end failed.");
-                        return -EINVAL;
-                }
+/* The functions below write a message straight into a JsonWriter. They
+ * produce the same output as printing the bus_message_*_to_json() trees,
+ * but strings are escaped directly from the message and nothing is
+ * allocated per element. */
 
-                r = bus_message_element_to_json(message, &element);
-                if (r < 0){
-                        log_err("bus_message_element_to_json failed.");
-                        return r;
-                }
+static int bus_message_dict_key_write_json(sd_bus_message *message, char type, JsonWriter *writer) {
+        char key[32];
+        int r;
 
-                r = json_object_insert(json, method->out_args[i]->name, element);
-                if (r < 0){
-                        log_err("json_object_insert failed.");
-                        return r;
+        switch (type) {
+                case SD_BUS_TYPE_STRING:
+                case SD_BUS_TYPE_OBJECT_PATH:
+                case SD_BUS_TYPE_SIGNATURE: {
+                        const char *string;
+                        r = sd_bus_message_read_basic(message, type, &string);
+                        if (r < 0)
+                                return r;
+                        json_writer_key(writer, string);
+                        return 0;
                 }
-                element = NULL;
-        }
-
-        if (!sd_bus_message_at_end(message, false)){
-                log_err("!sd_bus_message_at_end failed.");
-                return -EINVAL;
-        }
-
-        *jsonp = json;
-        json = NULL;
-
-        return 0;
-}
 
-static int bus_message_append_number(sd_bus_message *message, char type, double number) {
-        switch (type) {
-                case SD_BUS_TYPE_BOOLEAN:
                 case SD_BUS_TYPE_BYTE: {
-                        uint8_t num = number;
-                        sd_bus_message_append_basic(message, type, &num);
+                        uint8_t num;
+                        r = sd_bus_message_read_basic(message, type, &num);
+                        if (r < 0)
+                                return r;
+                        snprintf(key, sizeof(key), "%" PRIu8, num);
                         break;
                 }
+
                 case SD_BUS_TYPE_INT16: {
-                        int16_t num = number;
-                        sd_bus_message_append_basic(message, type, &num);
+                        int16_t num;
+                        r = sd_bus_message_read_basic(message, type, &num);
+                        if (r < 0)
+                                return r;
+                        snprintf(key, sizeof(key), "%" PRId16, num);
                         break;
                 }
+
                 case SD_BUS_TYPE_UINT16: {
-                        uint16_t num = number;
-                        sd_bus_message_append_basic(message, type, &num);
+                        uint16_t num;
+                        r = sd_bus_message_read_basic(message, type, &num);
+                        if (r < 0)
+                                return r;
+                        snprintf(key, sizeof(key), "%" PRIu16, num);
                         break;
                 }
+
                 case SD_BUS_TYPE_INT32: {
-                        int32_t num = number;
-                        sd_bus_message_append_basic(message, type, &num);
+                        int32_t num;
+                        r = sd_bus_message_read_basic(message, type, &num);
+                        if (r < 0)
+                                return r;
+                        snprintf(key, sizeof(key), "%" PRId32, num);
                         break;
                 }
+
                 case SD_BUS_TYPE_UINT32: {
-                        uint32_t num = number;
-                        sd_bus_message_append_basic(message, type, &num);
+                        uint32_t num;
+                        r = sd_bus_message_read_basic(message, type, &num);
+                        if (r < 0)
+                                return r;
+                        snprintf(key, sizeof(key), "%" PRIu32, num);
                         break;
                 }
 
                 case SD_BUS_TYPE_INT64: {
-                        int64_t num = number;
-                        sd_bus_message_append_basic(message, type, &num);
+                        int64_t num;
+                        r = sd_bus_message_read_basic(message, type, &num);
+                        if (r < 0)
+                                return r;
+                        snprintf(key, sizeof(key), "%" PRId64, num);
                         break;
                 }
+
                 case SD_BUS_TYPE_UINT64: {
-                        uint64_t num = number;
-                        sd_bus_message_append_basic(message, type, &num);
+                        uint64_t num;
+                        r = sd_bus_message_read_basic(message, type, &num);
+                        if (r < 0)
+                                return r;
+                        snprintf(key, sizeof(key), "%" PRIu64, num);
                         break;
                 }
+
                 case SD_BUS_TYPE_DOUBLE: {
-                        double num = number;
-                        sd_bus_message_append_basic(message, type, &num);
-                        break;
+                        _cleanup_(freep) char *formatted = NULL;
+                        double num;
+                        r = sd_bus_message_read_basic(message, type, &num);
+                        if (r < 0)
+                                return r;
+                        // "%f" is unbounded in length
+                        asprintf(&formatted, "%f", num);
+                        json_writer_key(writer, formatted);
+                        return 0;
                 }
+
                 default:
-                        return -EINVAL;
+                        return -ENOTSUP;
         }
 
+        json_writer_key(writer, key);
         return 0;
 }
 
-static int bus_message_append_from_json(sd_bus_message *message, JsonValue *json, const char *type, unsigned int* type_inc) {
-        if (bus_type_is_number(*type)) {
-                if (json_value_get_type(json) != JSON_TYPE_NUMBER)
-                        return -EINVAL;
-                *type_inc = 1;
-                return bus_message_append_number(message, *type, json_value_get_number(json));
+int bus_message_element_write_json(sd_bus_message *message, JsonWriter *writer, unsigned flags) {
+        const char *contents = NULL;
+        char type;
+        int r;
+
+        r = sd_bus_message_peek_type(message, &type, &contents);
+        if (r < 0) {
+                log_err("sd_bus_message_peek_type internal error");
+                return r;
+        }
+        if (r == 0) {
+                log_err("sd_bus_message_peek_type unknown dbus type");
+                return -EINVAL;
         }
 
-        switch (*type) {
-                case SD_BUS_TYPE_ARRAY: {
-                        int r;
-                        JsonValue *j_a_element;
-                        size_t signature_len;
-                        unsigned int sub_type_inc = 0;
-
-                        // array
-                        if(json_value_get_type(json) != JSON_TYPE_ARRAY && json_value_get_type(json) != JSON_TYPE_OBJECT){
-                                log_err("DBUS interface expected array");
-                                return -EINVAL;
-                        }
+        switch (type) {
+                case SD_BUS_TYPE_BOOLEAN: {
+                        int b;
+                        r = sd_bus_message_read_basic(message, type, &b);
+                        if (r < 0)
+                                return r;
+                        json_writer_boolean(writer, b);
+                        break;
+                }
 
-                        r = signature_element_length(type+1, &signature_len);
-                        if (r < 0) {
-                                log_err("Invalid array signature.");
+                case SD_BUS_TYPE_BYTE: {
+                        uint8_t num;
+                        r = sd_bus_message_read_basic(message, type, &num);
+                        if (r < 0)
                                 return r;
-                        }
-                        {
-                                size_t ja_len;
-                                char sub_signature[signature_len + 1];
-                                memcpy(sub_signature, type+1, signature_len);
-                                sub_signature[signature_len] = 0;
+                        json_writer_integer(writer, num);
+                        break;
+                }
 
+                case SD_BUS_TYPE_INT16: {
+                        int16_t num;
+                        r = sd_bus_message_read_basic(message, type, &num);
+                        if (r < 0)
+                                return r;
+                        json_writer_integer(writer, num);
+                        break;
+                }
 
-                                r = sd_bus_message_open_container(message, SD_BUS_TYPE_ARRAY, sub_signature);
-                                if (r < 0){
-                                        log_err("Cannot create dbus array container");
-                                        return -EINVAL;
-                                }
+                case SD_BUS_TYPE_UINT16: {
+                        uint16_t num;
+                        r = sd_bus_message_read_basic(message, type, &num);
+                        if (r < 0)
+                                return r;
+                        json_writer_integer(writer, num);
+                        break;
+                }
 
-                                if(json_value_get_type(json) == JSON_TYPE_ARRAY){
-                                        ja_len = json_array_get_length(json);
-                                        log_debug("Parsing array of length %d, %s", ja_len, type);
-                                        for(size_t i=0; i<ja_len; i++) {
-                                                if(json_array_get(json, i, &j_a_element, 0) == false) {  // TODO: validate expected type: use type expected by dbus instead of 0
-                                                        log_err("Fetching value from array failed");
-                                                        return -EINVAL;
-                                                }
-
-                                                r = bus_message_append_from_json(message, j_a_element, sub_signature, &sub_type_inc);
-                                                if ( r < 0) {
-                                                        return r;
-                                                }
-                                        }
-                                }else{  // it's json object to dbus dict a{
-                                        log_debug("Parsing array as dict %s", type);
-                                        r = bus_message_append_from_json(message, json, sub_signature, &sub_type_inc);
-                                        if ( r < 0) {
-                                                return r;
-                                        }
-                                }
-                        }
-                        r = sd_bus_message_close_container(message);
-                        if (r < 0){
-                                log_err("Closing dbus container failed");
+                case SD_BUS_TYPE_INT32: {
+                        int32_t num;
+                        r = sd_bus_message_read_basic(message, type, &num);
+                        if (r < 0)
                                 return r;
-                        }
-                        *type_inc = 1 + signature_len;  // +a
-                        return 0;
+                        json_writer_integer(writer, num);
+                        break;
                 }
 
-                case SD_BUS_TYPE_STRUCT_BEGIN: {
-                        size_t ja_len;
-                        int r;
-                        JsonValue *a_json;
-                        size_t signature_len;
+                case SD_BUS_TYPE_UINT32: {
+                        uint32_t num;
+                        r = sd_bus_message_read_basic(message, type, &num);
+                        if (r < 0)
+                                return r;
+                        json_writer_integer(writer, num);
+                        break;
+                }
 
-                        if(json_value_get_type(json) != JSON_TYPE_ARRAY){
-                                log_err("DBUS interface expected json array or object");
-                                return -EINVAL;
-                        }
-                        ja_len = json_array_get_length(json);
+                case SD_BUS_TYPE_INT64: {
+                        int64_t num;
+                        r = sd_bus_message_read_basic(message, type, &num);
+                        if (r < 0)
+                                return r;
+                        json_writer_integer(writer, num);
+                        break;
+                }
 
-                        // get length of e.g. (i(vy)i) --> 8
-                        r = signature_element_length(type, &signature_len);
-                        if (r < 0) {
-                                log_err("Invalid struct entry signature.");
+                case SD_BUS_TYPE_UINT64: {
+                        uint64_t num;
+                        r = sd_bus_message_read_basic(message, type, &num);
+                        if (r < 0)
                                 return r;
+                        json_writer_unsigned(writer, num);
+                        break;
+                }
+
+                case SD_BUS_TYPE_DOUBLE: {
+                        double num;
+                        r = sd_bus_message_read_basic(message, type, &num);
+                        if (r < 0)
+                                return r;
+                        json_writer_number(writer, num);
+                        break;
+                }
+
+                case SD_BUS_TYPE_STRING:
+                case SD_BUS_TYPE_OBJECT_PATH:
+                case SD_BUS_TYPE_SIGNATURE: {
+                        const char *string;
+                        // points into the message, no copy
+                        r = sd_bus_message_read_basic(message, type, &string);
+                        if (r < 0)
+                                return r;
+                        json_writer_string(writer, string);
+                        break;
+                }
+
+                case SD_BUS_TYPE_ARRAY:
+                case SD_BUS_TYPE_STRUCT:
+                        if ((flags & BUS_JSON_BASE64_BYTES) && type == SD_BUS_TYPE_ARRAY && strcmp(contents, "y") == 0) {
+                                const void *data;
+                                size_t size;
+
+                                r = sd_bus_message_read_array(message, SD_BUS_TYPE_BYTE, &data, &size);
+                                if (r < 0)
+                                        return r;
+                                json_writer_base64(writer, data, size);
+                                break;
+                        }
+
+                        if (bus_message_at_fixed_array(type, contents)) {
+                                r = bus_message_fixed_array_write_json(message, contents[0], writer);
+                                if (r < 0)
+                                        return r;
+                                break;
+                        }
+
+                        r = sd_bus_message_enter_container(message, type, contents);
+                        if (r < 0)
+                                return r;
+
+                        if (contents[0] == SD_BUS_TYPE_DICT_ENTRY_BEGIN) {
+                                json_writer_begin_object(writer);
+                                while (!sd_bus_message_at_end(message, false)) {
+                                        r = sd_bus_message_enter_container(message, SD_BUS_TYPE_DICT_ENTRY, NULL);
+                                        if (r < 0)
+                                                return r;
+
+                                        r = bus_message_dict_key_write_json(message, contents[1], writer);
+                                        if (r < 0)
+                                                return r;
+
+                                        r = bus_message_element_write_json(message, writer, flags);
+                                        if (r < 0)
+                                                return r;
+
+                                        r = sd_bus_message_exit_container(message);
+                                        if (r < 0)
+                                                return r;
+                                }
+                                json_writer_end_object(writer);
+                        } else {
+                                json_writer_begin_array(writer);
+                                while (!sd_bus_message_at_end(message, false)) {
+                                        r = bus_message_element_write_json(message, writer, flags);
+                                        if (r < 0)
+                                                return r;
+                                }
+                                json_writer_end_array(writer);
+                        }
+
+                        r = sd_bus_message_exit_container(message);
+                        if (r < 0)
+                                return r;
+                        break;
+
+                case SD_BUS_TYPE_VARIANT:
+                        r = sd_bus_message_enter_container(message, type, contents);
+                        if (r < 0)
+                                return r;
+
+                        r = bus_message_element_write_json(message, writer, flags);
+                        if (r < 0)
+                                return r;
+
+                        r = sd_bus_message_exit_container(message);
+                        if (r < 0)
+                                return r;
+                        break;
+
+                case SD_BUS_TYPE_UNIX_FD:
+                        log_err("UNIX FD is not supported");
+                        return -ENOTSUP;
+                default:
+                        log_err("Data type %d is not supported.", type);
+                        return -ENOTSUP;
+        }
+
+        return 0;
+}
+
+static int bus_message_write_json(sd_bus_message *message, JsonWriter *writer, DBusMethod *method, unsigned flags) {
+        int r;
+
+        json_writer_begin_object(writer);
+
+        for (size_t i = 0; i < method->n_out_args; i++) {
+                if (sd_bus_message_at_end(message, false)) {
+                        log_err("sd_bus_message_at_end failed.");
+                        return -EINVAL;
+                }
+
+                json_writer_key(writer, method->out_args[i]->name);
+                r = bus_message_element_write_json(message, writer, flags);
+                if (r < 0) {
+                        log_err("bus_message_element_write_json failed.");
+                        return r;
+                }
+        }
+
+        if (!sd_bus_message_at_end(message, false)) {
+                log_err("!sd_bus_message_at_end failed.");
+                return -EINVAL;
+        }
+
+        json_writer_end_object(writer);
+
+        return 0;
+}
+
+/* The same mapping for application/cbor, except that every integer, double
+ * and byte array keeps its native encoding and dict keys keep their D-Bus
+ * type instead of being turned into strings. */
+static int bus_message_element_write_cbor(sd_bus_message *message, CborWriter *writer) {
+        const char *contents = NULL;
+        char type;
+        int r;
+
+        r = sd_bus_message_peek_type(message, &type, &contents);
+        if (r < 0) {
+                log_err("sd_bus_message_peek_type internal error");
+                return r;
+        }
+        if (r == 0) {
+                log_err("sd_bus_message_peek_type unknown dbus type");
+                return -EINVAL;
+        }
+
+        switch (type) {
+                case SD_BUS_TYPE_BOOLEAN: {
+                        int b;
+                        r = sd_bus_message_read_basic(message, type, &b);
+                        if (r < 0)
+                                return r;
+                        cbor_writer_boolean(writer, b);
+                        break;
+                }
+
+                case SD_BUS_TYPE_BYTE: {
+                        uint8_t num;
+                        r = sd_bus_message_read_basic(message, type, &num);
+                        if (r < 0)
+                                return r;
+                        cbor_writer_integer(writer, num);
+                        break;
+                }
+
+                case SD_BUS_TYPE_INT16: {
+                        int16_t num;
+                        r = sd_bus_message_read_basic(message, type, &num);
+                        if (r < 0)
+                                return r;
+                        cbor_writer_integer(writer, num);
+                        break;
+                }
+
+                case SD_BUS_TYPE_UINT16: {
+                        uint16_t num;
+                        r = sd_bus_message_read_basic(message, type, &num);
+                        if (r < 0)
+                                return r;
+                        cbor_writer_integer(writer, num);
+                        break;
+                }
+
+                case SD_BUS_TYPE_INT32: {
+                        int32_t num;
+                        r = sd_bus_message_read_basic(message, type, &num);
+                        if (r < 0)
+                                return r;
+                        cbor_writer_integer(writer, num);
+                        break;
+                }
+
+                case SD_BUS_TYPE_UINT32: {
+                        uint32_t num;
+                        r = sd_bus_message_read_basic(message, type, &num);
+                        if (r < 0)
+                                return r;
+                        cbor_writer_integer(writer, num);
+                        break;
+                }
+
+                case SD_BUS_TYPE_INT64: {
+                        int64_t num;
+                        r = sd_bus_message_read_basic(message, type, &num);
+                        if (r < 0)
+                                return r;
+                        cbor_writer_integer(writer, num);
+                        break;
+                }
+
+                case SD_BUS_TYPE_UINT64: {
+                        uint64_t num;
+                        r = sd_bus_message_read_basic(message, type, &num);
+                        if (r < 0)
+                                return r;
+                        cbor_writer_unsigned(writer, num);
+                        break;
+                }
+
+                case SD_BUS_TYPE_DOUBLE: {
+                        double num;
+                        r = sd_bus_message_read_basic(message, type, &num);
+                        if (r < 0)
+                                return r;
+                        cbor_writer_double(writer, num);
+                        break;
+                }
+
+                case SD_BUS_TYPE_STRING:
+                case SD_BUS_TYPE_OBJECT_PATH:
+                case SD_BUS_TYPE_SIGNATURE: {
+                        const char *string;
+                        r = sd_bus_message_read_basic(message, type, &string);
+                        if (r < 0)
+                                return r;
+                        cbor_writer_text(writer, string);
+                        break;
+                }
+
+                case SD_BUS_TYPE_ARRAY:
+                case SD_BUS_TYPE_STRUCT:
+                        // "ay" becomes a byte string
+                        if (bus_message_at_fixed_array(type, contents)) {
+                                r = bus_message_fixed_array_write_cbor(message, contents[0], writer);
+                                if (r < 0)
+                                        return r;
+                                break;
+                        }
+
+                        r = sd_bus_message_enter_container(message, type, contents);
+                        if (r < 0)
+                                return r;
+
+                        if (contents[0] == SD_BUS_TYPE_DICT_ENTRY_BEGIN) {
+                                cbor_writer_begin_map(writer);
+                                while (!sd_bus_message_at_end(message, false)) {
+                                        r = sd_bus_message_enter_container(message, SD_BUS_TYPE_DICT_ENTRY, NULL);
+                                        if (r < 0)
+                                                return r;
+
+                                        r = bus_message_element_write_cbor(message, writer);
+                                        if (r < 0)
+                                                return r;
+
+                                        r = bus_message_element_write_cbor(message, writer);
+                                        if (r < 0)
+                                                return r;
+
+                                        r = sd_bus_message_exit_container(message);
+                                        if (r < 0)
+                                                return r;
+                                }
+                                cbor_writer_end_map(writer);
+                        } else {
+                                cbor_writer_begin_array(writer);
+                                while (!sd_bus_message_at_end(message, false)) {
+                                        r = bus_message_element_write_cbor(message, writer);
+                                        if (r < 0)
+                                                return r;
+                                }
+                                cbor_writer_end_array(writer);
+                        }
+
+                        r = sd_bus_message_exit_container(message);
+                        if (r < 0)
+                                return r;
+                        break;
+
+                case SD_BUS_TYPE_VARIANT:
+                        r = sd_bus_message_enter_container(message, type, contents);
+                        if (r < 0)
+                                return r;
+
+                        r = bus_message_element_write_cbor(message, writer);
+                        if (r < 0)
+                                return r;
+
+                        r = sd_bus_message_exit_container(message);
+                        if (r < 0)
+                                return r;
+                        break;
+
+                case SD_BUS_TYPE_UNIX_FD:
+                        log_err("UNIX FD is not supported");
+                        return -ENOTSUP;
+                default:
+                        log_err("Data type %d is not supported.", type);
+                        return -ENOTSUP;
+        }
+
+        return 0;
+}
+
+static int bus_message_write_cbor(sd_bus_message *message, CborWriter *writer, DBusMethod *method) {
+        int r;
+
+        cbor_writer_begin_map(writer);
+
+        for (size_t i = 0; i < method->n_out_args; i++) {
+                if (sd_bus_message_at_end(message, false)) {
+                        log_err("sd_bus_message_at_end failed.");
+                        return -EINVAL;
+                }
+
+                cbor_writer_text(writer, method->out_args[i]->name);
+                r = bus_message_element_write_cbor(message, writer);
+                if (r < 0) {
+                        log_err("bus_message_element_write_cbor failed.");
+                        return r;
+                }
+        }
+
+        if (!sd_bus_message_at_end(message, false)) {
+                log_err("!sd_bus_message_at_end failed.");
+                return -EINVAL;
+        }
+
+        cbor_writer_end_map(writer);
+
+        return 0;
+}
+
+/* Integers have to be integral and in range of the D-Bus type, they are
+ * never rounded or truncated. Stores the value in the D-Bus representation
+ * of type at out. */
+static bool bus_number_convert(char type, const JsonNumber *number, void *out) {
+        int64_t i;
+        uint64_t u;
+
+        switch (type) {
+                case SD_BUS_TYPE_BYTE:
+                        if (!json_number_to_uint64(number, &u) || u > UINT8_MAX)
+                                return false;
+                        *(uint8_t *)out = u;
+                        return true;
+                case SD_BUS_TYPE_INT16:
+                        if (!json_number_to_int64(number, &i) || i < INT16_MIN || i > INT16_MAX)
+                                return false;
+                        *(int16_t *)out = i;
+                        return true;
+                case SD_BUS_TYPE_UINT16:
+                        if (!json_number_to_uint64(number, &u) || u > UINT16_MAX)
+                                return false;
+                        *(uint16_t *)out = u;
+                        return true;
+                case SD_BUS_TYPE_INT32:
+                        if (!json_number_to_int64(number, &i) || i < INT32_MIN || i > INT32_MAX)
+                                return false;
+                        *(int32_t *)out = i;
+                        return true;
+                case SD_BUS_TYPE_UINT32:
+                        if (!json_number_to_uint64(number, &u) || u > UINT32_MAX)
+                                return false;
+                        *(uint32_t *)out = u;
+                        return true;
+                case SD_BUS_TYPE_INT64:
+                        return json_number_to_int64(number, (int64_t *)out);
+                case SD_BUS_TYPE_UINT64:
+                        return json_number_to_uint64(number, (uint64_t *)out);
+                case SD_BUS_TYPE_DOUBLE:
+                        *(double *)out = json_number_to_double(number);
+                        return true;
+                default:
+                        return false;
+        }
+}
+
+static int bus_message_append_number(sd_bus_message *message, char type, const JsonNumber *number) {
+        union {
+                uint8_t y;
+                int16_t n;
+                uint16_t q;
+                int32_t i;
+                uint32_t u;
+                int64_t x;
+                uint64_t t;
+                double d;
+        } value;
+
+        if (!bus_number_convert(type, number, &value))
+                return -EINVAL;
+
+        return sd_bus_message_append_basic(message, type, &value);
+}
+
+/* Arrays of fixed size types are collected into one buffer in their D-Bus
+ * representation and appended with a single sd_bus_message_append_array()
+ * call, instead of one sd_bus_message_append_basic() per element. */
+static int bus_fixed_array_add(Buffer *buffer, char type, const JsonNumber *number, bool b) {
+        size_t size = bus_type_fixed_size(type);
+        int r;
+
+        r = buffer_reserve(buffer, size);
+        if (r < 0)
+                return r;
+
+        if (type == SD_BUS_TYPE_BOOLEAN)
+                *(int32_t *)(buffer->data + buffer->size) = b;
+        else if (!bus_number_convert(type, number, buffer->data + buffer->size))
+                return -EINVAL;
+
+        buffer->size += size;
+
+        return 0;
+}
+
+/* The functions below append JSON to a message while reading it, guided by
+ * the signature. No tree is built and the first value that does not match
+ * the signature fails the whole call with -EINVAL. */
+
+static int base64_value(char c) {
+        if (c >= 'A' && c <= 'Z')
+                return c - 'A';
+        if (c >= 'a' && c <= 'z')
+                return c - 'a' + 26;
+        if (c >= '0' && c <= '9')
+                return c - '0' + 52;
+        if (c == '+')
+                return 62;
+        if (c == '/')
+                return 63;
+        return -1;
+}
+
+// decodes base64, with or without padding, straight into the message as "ay"
+static int bus_message_append_base64(sd_bus_message *message, const char *string) {
+        size_t len = strlen(string);
+        uint8_t *out;
+        uint32_t bits = 0;
+        unsigned n_bits = 0;
+        int r;
+
+        if (len % 4 == 0 && len > 0 && string[len - 1] == '=')
+                len -= string[len - 2] == '=' ? 2 : 1;
+        if (len % 4 == 1)
+                return -EINVAL;
+
+        r = sd_bus_message_append_array_space(message, SD_BUS_TYPE_BYTE, len / 4 * 3 + (len % 4 ? len % 4 - 1 : 0),
+                                              (void **)&out);
+        if (r < 0)
+                return r;
+
+        for (size_t i = 0; i < len; i++) {
+                int v = base64_value(string[i]);
+
+                if (v < 0)
+                        return -EINVAL;
+
+                bits = bits << 6 | v;
+                n_bits += 6;
+                if (n_bits >= 8) {
+                        n_bits -= 8;
+                        *out++ = bits >> n_bits;
+                }
+        }
+
+        return 0;
+}
+
+static int bus_message_append_from_reader(sd_bus_message *message, JsonReader *reader, const char *type);
+
+static int bus_message_append_dict_key(sd_bus_message *message, char type, const char *key) {
+        if (bus_type_is_number(type)) {
+                JsonNumber number;
+
+                if (!json_number_parse(key, &number))
+                        return -EINVAL;
+
+                return bus_message_append_number(message, type, &number);
+        }
+
+        switch (type) {
+                case SD_BUS_TYPE_BOOLEAN: {
+                        int b;
+
+                        if (strcmp(key, "true") == 0)
+                                b = true;
+                        else if (strcmp(key, "false") == 0)
+                                b = false;
+                        else
+                                return -EINVAL;
+
+                        return sd_bus_message_append_basic(message, type, &b);
+                }
+
+                case SD_BUS_TYPE_STRING:
+                case SD_BUS_TYPE_OBJECT_PATH:
+                case SD_BUS_TYPE_SIGNATURE:
+                        return sd_bus_message_append_basic(message, type, key);
+
+                default:
+                        return -EINVAL;
+        }
+}
+
+// appends the entries of one JSON object, contents is the signature "{kv}"
+static int bus_message_append_dict_from_reader(sd_bus_message *message, JsonReader *reader, const char *contents) {
+        size_t signature_len;
+        const char *key;
+        int r;
+
+        if (!json_reader_begin_object(reader)) {
+                log_err("DBUS interface expected json object -> dict");
+                return -EINVAL;
+        }
+
+        r = signature_element_length(contents, &signature_len);
+        if (r < 0) {
+                log_err("Invalid dict entry signature.");
+                return r;
+        }
+
+        {
+                // get the signature inside the brackets e.g. {sv} --> sv
+                char sub_signature[signature_len - 1];
+                memcpy(sub_signature, contents + 1, signature_len - 2);
+                sub_signature[signature_len - 2] = 0;
+
+                while ((r = json_reader_next_key(reader, &key)) > 0) {
+                        r = sd_bus_message_open_container(message, SD_BUS_TYPE_DICT_ENTRY, sub_signature);
+                        if (r < 0) {
+                                log_err("Creating dict container failed.");
+                                return -EINVAL;
+                        }
+
+                        r = bus_message_append_dict_key(message, sub_signature[0], key);
+                        if (r < 0) {
+                                log_err("DBUS appending key %s of dict failed", key);
+                                return r;
+                        }
+
+                        r = bus_message_append_from_reader(message, reader, sub_signature + 1);
+                        if (r < 0) {
+                                log_err("DBUS appending value of dict failed");
+                                return r;
+                        }
+
+                        r = sd_bus_message_close_container(message);
+                        if (r < 0) {
+                                log_err("Closing dict entry container failed");
+                                return r;
+                        }
+                }
+        }
+
+        return r;
+}
+
+static int bus_message_append_variant_from_reader(sd_bus_message *message, JsonReader *reader) {
+        const char *signature = NULL;
+        JsonReader data = {};
+        const char *key;
+        int r;
+
+        switch (json_reader_peek(reader)) {
+                case JSON_TYPE_STRING:
+                        signature = "s";
+                        break;
+                case JSON_TYPE_TRUE:
+                case JSON_TYPE_FALSE:
+                        signature = "b";
+                        break;
+                case JSON_TYPE_OBJECT:
+                        break;
+                case JSON_TYPE_ARRAY:
+                        log_err("Variant is expected: Array needs to be passed as an object containing the dbus signature and the data.");
+                        return -EINVAL;
+                case JSON_TYPE_NUMBER:
+                        log_err("Variant is expected: Numbers need to be passed as an object containing the dbus signature and the data.");
+                        return -EINVAL;
+                default:
+                        return -EINVAL;
+        }
+
+        if (!signature) {
+                // { "dbus_variant_sign": "...", "data": ... } in either order
+                json_reader_begin_object(reader);
+                while ((r = json_reader_next_key(reader, &key)) > 0) {
+                        if (strcmp(key, "dbus_variant_sign") == 0 && !signature) {
+                                if (!json_reader_read_string(reader, &signature))
+                                        return -EINVAL;
+                        } else if (strcmp(key, "data") == 0 && !data.p) {
+                                data = *reader;
+                                if (!json_reader_skip(reader))
+                                        return -EINVAL;
+                        } else if (!json_reader_skip(reader))
+                                return -EINVAL;
+                }
+                if (r < 0)
+                        return r;
+
+                if (!signature || !data.p) {
+                        log_err("Variant is expected: object needs dbus_variant_sign and data.");
+                        return -EINVAL;
+                }
+
+                reader = &data;
+        }
+
+        r = sd_bus_message_open_container(message, SD_BUS_TYPE_VARIANT, signature);
+        if (r < 0) {
+                log_err("Opening variant container failed");
+                return -EINVAL;
+        }
+
+        r = bus_message_append_from_reader(message, reader, signature);
+        if (r < 0) {
+                log_err("Appending variant failed");
+                return r;
+        }
+
+        r = sd_bus_message_close_container(message);
+        if (r < 0)
+                log_err("Closing variant container failed.");
+
+        return r;
+}
+
+static int bus_message_append_fixed_array_from_reader(sd_bus_message *message, JsonReader *reader, char type) {
+        _cleanup_(buffer_clear) Buffer buffer = {};
+        int r;
+
+        if (!json_reader_begin_array(reader)) {
+                log_err("DBUS interface expected array");
+                return -EINVAL;
+        }
+
+        while ((r = json_reader_next_element(reader)) > 0) {
+                JsonNumber number;
+                bool b = false;
+
+                if (type == SD_BUS_TYPE_BOOLEAN ? !json_reader_read_boolean(reader, &b)
+                                                : !json_reader_read_number(reader, &number))
+                        return -EINVAL;
+
+                r = bus_fixed_array_add(&buffer, type, &number, b);
+                if (r < 0)
+                        return r;
+        }
+        if (r < 0)
+                return r;
+
+        return sd_bus_message_append_array(message, type, buffer.data, buffer.size);
+}
+
+static int bus_message_append_from_reader(sd_bus_message *message, JsonReader *reader, const char *type) {
+        size_t signature_len;
+        int r;
+
+        if (bus_type_is_number(*type)) {
+                JsonNumber number;
+
+                if (!json_reader_read_number(reader, &number))
+                        return -EINVAL;
+
+                return bus_message_append_number(message, *type, &number);
+        }
+
+        switch (*type) {
+                case SD_BUS_TYPE_BOOLEAN: {
+                        bool b;
+                        int i;
+
+                        if (!json_reader_read_boolean(reader, &b))
+                                return -EINVAL;
+
+                        i = b;
+                        return sd_bus_message_append_basic(message, *type, &i);
+                }
+
+                case SD_BUS_TYPE_STRING:
+                case SD_BUS_TYPE_OBJECT_PATH:
+                case SD_BUS_TYPE_SIGNATURE: {
+                        const char *string;
+
+                        if (!json_reader_read_string(reader, &string))
+                                return -EINVAL;
+
+                        return sd_bus_message_append_basic(message, *type, string);
+                }
+
+                case SD_BUS_TYPE_ARRAY:
+                        // byte arrays may also be passed as a base64 string
+                        if (type[1] == SD_BUS_TYPE_BYTE && json_reader_peek(reader) == JSON_TYPE_STRING) {
+                                const char *string;
+
+                                if (!json_reader_read_string(reader, &string))
+                                        return -EINVAL;
+
+                                return bus_message_append_base64(message, string);
+                        }
+
+                        if (bus_type_is_fixed(type[1]))
+                                return bus_message_append_fixed_array_from_reader(message, reader, type[1]);
+
+                        r = signature_element_length(type, &signature_len);
+                        if (r < 0) {
+                                log_err("Invalid array signature.");
+                                return r;
+                        }
+                        {
+                                char sub_signature[signature_len];
+                                memcpy(sub_signature, type + 1, signature_len - 1);
+                                sub_signature[signature_len - 1] = 0;
+
+                                r = sd_bus_message_open_container(message, SD_BUS_TYPE_ARRAY, sub_signature);
+                                if (r < 0) {
+                                        log_err("Cannot create dbus array container");
+                                        return -EINVAL;
+                                }
+
+                                if (sub_signature[0] == SD_BUS_TYPE_DICT_ENTRY_BEGIN &&
+                                    json_reader_peek(reader) == JSON_TYPE_OBJECT) {
+                                        r = bus_message_append_dict_from_reader(message, reader, sub_signature);
+                                        if (r < 0)
+                                                return r;
+                                } else {
+                                        // a dict may also be passed as an array of objects
+                                        if (!json_reader_begin_array(reader)) {
+                                                log_err("DBUS interface expected array");
+                                                return -EINVAL;
+                                        }
+
+                                        while ((r = json_reader_next_element(reader)) > 0) {
+                                                if (sub_signature[0] == SD_BUS_TYPE_DICT_ENTRY_BEGIN)
+                                                        r = bus_message_append_dict_from_reader(message, reader, sub_signature);
+                                                else
+                                                        r = bus_message_append_from_reader(message, reader, sub_signature);
+                                                if (r < 0)
+                                                        return r;
+                                        }
+                                        if (r < 0)
+                                                return r;
+                                }
+                        }
+
+                        r = sd_bus_message_close_container(message);
+                        if (r < 0)
+                                log_err("Closing dbus container failed");
+                        return r;
+
+                case SD_BUS_TYPE_STRUCT_BEGIN:
+                        if (!json_reader_begin_array(reader)) {
+                                log_err("DBUS interface expected json array for struct");
+                                return -EINVAL;
+                        }
+
+                        // get length of e.g. (i(vy)i) --> 8
+                        r = signature_element_length(type, &signature_len);
+                        if (r < 0) {
+                                log_err("Invalid struct entry signature.");
+                                return r;
+                        }
+                        {
+                                // get the signature inside the brackets e.g. (i(vy)i) --> i(vy)i
+                                char sub_signature[signature_len - 1];
+                                size_t member_len;
+                                memcpy(sub_signature, type + 1, signature_len - 2);
+                                sub_signature[signature_len - 2] = 0;
+
+                                r = sd_bus_message_open_container(message, SD_BUS_TYPE_STRUCT, sub_signature);
+                                if (r < 0) {
+                                        log_err("Creating struct container failed.");
+                                        return -EINVAL;
+                                }
+
+                                for (const char *p = sub_signature; *p; p += member_len) {
+                                        if (json_reader_next_element(reader) <= 0) {
+                                                log_err("Too few struct members, expected %s", sub_signature);
+                                                return -EINVAL;
+                                        }
+
+                                        r = bus_message_append_from_reader(message, reader, p);
+                                        if (r < 0) {
+                                                log_err("Appending value to dbus struct failed");
+                                                return r;
+                                        }
+
+                                        r = signature_element_length(p, &member_len);
+                                        if (r < 0)
+                                                return r;
+                                }
+
+                                if (json_reader_next_element(reader) != 0) {
+                                        log_err("Too many struct members, expected %s", sub_signature);
+                                        return -EINVAL;
+                                }
+                        }
+
+                        r = sd_bus_message_close_container(message);
+                        if (r < 0)
+                                log_err("Closing struct container failed.");
+                        return r;
+
+                case SD_BUS_TYPE_VARIANT:
+                        return bus_message_append_variant_from_reader(message, reader);
+
+                case SD_BUS_TYPE_UNIX_FD:
+                        return -ENOTSUP;
+
+                default:
+                        return -EINVAL;
+        }
+}
+
+static int bus_message_append_args_from_reader(sd_bus_message *message, DBusMethod *method, JsonReader *args) {
+        int r;
+
+        if (!json_reader_begin_array(args))
+                return -EINVAL;
+
+        for (size_t i = 0; i < method->n_in_args; i++) {
+                if (json_reader_next_element(args) <= 0)
+                        return -EINVAL;
+
+                r = bus_message_append_from_reader(message, args, method->in_args[i]->type);
+                if (r < 0)
+                        return r;
+        }
+
+        if (json_reader_next_element(args) != 0)
+                return -EINVAL;
+
+        return 0;
+}
+
+/* Appending from CBOR follows the JSON rules above. Numbers, byte strings
+ * and map keys may also be given in their native encoding: a variant
+ * takes its signature from a scalar, "ay" accepts a byte string, and dict
+ * keys may be numbers as well as strings. */
+
+static int bus_message_append_from_cbor(sd_bus_message *message, CborReader *reader, const char *type);
+
+// appends the entries of one CBOR map, contents is the signature "{kv}"
+static int bus_message_append_dict_from_cbor(sd_bus_message *message, CborReader *reader, const char *contents) {
+        size_t signature_len;
+        size_t remaining;
+        int r;
+
+        if (!cbor_reader_begin_map(reader, &remaining)) {
+                log_err("DBUS interface expected cbor map -> dict");
+                return -EINVAL;
+        }
+
+        r = signature_element_length(contents, &signature_len);
+        if (r < 0) {
+                log_err("Invalid dict entry signature.");
+                return r;
+        }
+
+        {
+                // get the signature inside the brackets e.g. {sv} --> sv
+                char sub_signature[signature_len - 1];
+                memcpy(sub_signature, contents + 1, signature_len - 2);
+                sub_signature[signature_len - 2] = 0;
+
+                while ((r = cbor_reader_next(reader, &remaining)) > 0) {
+                        r = sd_bus_message_open_container(message, SD_BUS_TYPE_DICT_ENTRY, sub_signature);
+                        if (r < 0) {
+                                log_err("Creating dict container failed.");
+                                return -EINVAL;
+                        }
+
+                        if (cbor_reader_peek(reader) == CBOR_TYPE_TEXT) {
+                                const char *key;
+
+                                if (!cbor_reader_read_text(reader, &key))
+                                        return -EINVAL;
+
+                                r = bus_message_append_dict_key(message, sub_signature[0], key);
+                        } else
+                                r = bus_message_append_from_cbor(message, reader, sub_signature);
+                        if (r < 0) {
+                                log_err("DBUS appending key of dict failed");
+                                return r;
+                        }
+
+                        r = bus_message_append_from_cbor(message, reader, sub_signature + 1);
+                        if (r < 0) {
+                                log_err("DBUS appending value of dict failed");
+                                return r;
+                        }
+
+                        r = sd_bus_message_close_container(message);
+                        if (r < 0) {
+                                log_err("Closing dict entry container failed");
+                                return r;
+                        }
+                }
+        }
+
+        return r;
+}
+
+static int bus_message_append_variant_from_cbor(sd_bus_message *message, CborReader *reader) {
+        const char *signature = NULL;
+        CborReader data = {};
+        size_t remaining;
+        int r;
+
+        switch (cbor_reader_peek(reader)) {
+                case CBOR_TYPE_TEXT:
+                        signature = "s";
+                        break;
+                case CBOR_TYPE_TRUE:
+                case CBOR_TYPE_FALSE:
+                        signature = "b";
+                        break;
+                case CBOR_TYPE_BYTES:
+                        signature = "ay";
+                        break;
+                case CBOR_TYPE_NUMBER: {
+                        CborReader peek = *reader;
+                        JsonNumber number;
+
+                        if (!cbor_reader_read_number(&peek, &number))
+                                return -EINVAL;
+
+                        if (number.type == JSON_NUMBER_INTEGER)
+                                signature = "x";
+                        else if (number.type == JSON_NUMBER_UNSIGNED)
+                                signature = "t";
+                        else
+                                signature = "d";
+                        break;
+                }
+                case CBOR_TYPE_MAP:
+                        break;
+                case CBOR_TYPE_ARRAY:
+                        log_err("Variant is expected: Array needs to be passed as a map containing the dbus signature and the data.");
+                        return -EINVAL;
+                default:
+                        return -EINVAL;
+        }
+
+        if (!signature) {
+                // { "dbus_variant_sign": "...", "data": ... } in either order
+                cbor_reader_begin_map(reader, &remaining);
+                while ((r = cbor_reader_next(reader, &remaining)) > 0) {
+                        const char *key = NULL;
+
+                        if (cbor_reader_peek(reader) == CBOR_TYPE_TEXT) {
+                                if (!cbor_reader_read_text(reader, &key))
+                                        return -EINVAL;
+                        } else if (!cbor_reader_skip(reader))
+                                return -EINVAL;
+
+                        if (key && strcmp(key, "dbus_variant_sign") == 0 && !signature) {
+                                if (!cbor_reader_read_text(reader, &signature))
+                                        return -EINVAL;
+                        } else if (key && strcmp(key, "data") == 0 && !data.p) {
+                                data = *reader;
+                                if (!cbor_reader_skip(reader))
+                                        return -EINVAL;
+                        } else if (!cbor_reader_skip(reader))
+                                return -EINVAL;
+                }
+                if (r < 0)
+                        return r;
+
+                if (!signature || !data.p) {
+                        log_err("Variant is expected: map needs dbus_variant_sign and data.");
+                        return -EINVAL;
+                }
+
+                reader = &data;
+        }
+
+        r = sd_bus_message_open_container(message, SD_BUS_TYPE_VARIANT, signature);
+        if (r < 0) {
+                log_err("Opening variant container failed");
+                return -EINVAL;
+        }
+
+        r = bus_message_append_from_cbor(message, reader, signature);
+        if (r < 0) {
+                log_err("Appending variant failed");
+                return r;
+        }
+
+        r = sd_bus_message_close_container(message);
+        if (r < 0)
+                log_err("Closing variant container failed.");
+
+        return r;
+}
+
+static int bus_message_append_fixed_array_from_cbor(sd_bus_message *message, CborReader *reader, char type) {
+        _cleanup_(buffer_clear) Buffer buffer = {};
+        size_t remaining;
+        int r;
+
+        if (!cbor_reader_begin_array(reader, &remaining)) {
+                log_err("DBUS interface expected array");
+                return -EINVAL;
+        }
+
+        // every element takes at least one byte of input
+        if (remaining != CBOR_LENGTH_INDEFINITE) {
+                size_t n = remaining < (size_t)(reader->end - reader->p) ? remaining : (size_t)(reader->end - reader->p);
+
+                r = buffer_reserve(&buffer, n * bus_type_fixed_size(type));
+                if (r < 0)
+                        return r;
+        }
+
+        while ((r = cbor_reader_next(reader, &remaining)) > 0) {
+                JsonNumber number;
+                bool b = false;
+
+                if (type == SD_BUS_TYPE_BOOLEAN ? !cbor_reader_read_boolean(reader, &b)
+                                                : !cbor_reader_read_number(reader, &number))
+                        return -EINVAL;
+
+                r = bus_fixed_array_add(&buffer, type, &number, b);
+                if (r < 0)
+                        return r;
+        }
+        if (r < 0)
+                return r;
+
+        return sd_bus_message_append_array(message, type, buffer.data, buffer.size);
+}
+
+static int bus_message_append_from_cbor(sd_bus_message *message, CborReader *reader, const char *type) {
+        size_t signature_len;
+        size_t remaining;
+        int r;
+
+        if (bus_type_is_number(*type)) {
+                JsonNumber number;
+
+                if (!cbor_reader_read_number(reader, &number))
+                        return -EINVAL;
+
+                return bus_message_append_number(message, *type, &number);
+        }
+
+        switch (*type) {
+                case SD_BUS_TYPE_BOOLEAN: {
+                        bool b;
+                        int i;
+
+                        if (!cbor_reader_read_boolean(reader, &b))
+                                return -EINVAL;
+
+                        i = b;
+                        return sd_bus_message_append_basic(message, *type, &i);
+                }
+
+                case SD_BUS_TYPE_STRING:
+                case SD_BUS_TYPE_OBJECT_PATH:
+                case SD_BUS_TYPE_SIGNATURE: {
+                        const char *string;
+
+                        if (!cbor_reader_read_text(reader, &string))
+                                return -EINVAL;
+
+                        return sd_bus_message_append_basic(message, *type, string);
+                }
+
+                case SD_BUS_TYPE_ARRAY:
+                        if (type[1] == SD_BUS_TYPE_BYTE && cbor_reader_peek(reader) == CBOR_TYPE_BYTES) {
+                                const void *data;
+                                size_t size;
+
+                                if (!cbor_reader_read_bytes(reader, &data, &size))
+                                        return -EINVAL;
+
+                                return sd_bus_message_append_array(message, SD_BUS_TYPE_BYTE, data, size);
                         }
-                        {
-                                // get the signature inside the brackets e.g. (i(vy)i) --> i(vy)i
-                                char sub_signature[signature_len-1];
-                                char* sub_signature_p = sub_signature;
-                                memcpy(sub_signature, type + 1, signature_len - 2);
-                                sub_signature[signature_len - 2] = 0;
 
-                                log_debug("Parsing struct of lenght %d, %s", ja_len, sub_signature);
+                        if (bus_type_is_fixed(type[1]))
+                                return bus_message_append_fixed_array_from_cbor(message, reader, type[1]);
 
-                                // TODO: Check if container must be opened and closed in the for loop
-                                r = sd_bus_message_open_container(message, SD_BUS_TYPE_STRUCT, sub_signature);
-                                if (r < 0){
-                                        log_err("Creating struct container failed.");
+                        r = signature_element_length(type, &signature_len);
+                        if (r < 0) {
+                                log_err("Invalid array signature.");
+                                return r;
+                        }
+                        {
+                                char sub_signature[signature_len];
+                                memcpy(sub_signature, type + 1, signature_len - 1);
+                                sub_signature[signature_len - 1] = 0;
+
+                                r = sd_bus_message_open_container(message, SD_BUS_TYPE_ARRAY, sub_signature);
+                                if (r < 0) {
+                                        log_err("Cannot create dbus array container");
                                         return -EINVAL;
                                 }
 
-                                for(size_t i=0; i<ja_len; i++) {
-                                        unsigned int sub_type_inc = 0;
-
-                                        if(json_array_get(json, i, &a_json, 0) == false) {
-                                                log_err("Fetching value from array failed");
+                                if (sub_signature[0] == SD_BUS_TYPE_DICT_ENTRY_BEGIN &&
+                                    cbor_reader_peek(reader) == CBOR_TYPE_MAP) {
+                                        r = bus_message_append_dict_from_cbor(message, reader, sub_signature);
+                                        if (r < 0)
+                                                return r;
+                                } else {
+                                        // a dict may also be passed as an array of maps
+                                        if (!cbor_reader_begin_array(reader, &remaining)) {
+                                                log_err("DBUS interface expected array");
                                                 return -EINVAL;
                                         }
 
-                                        r = bus_message_append_from_json(message, a_json, sub_signature_p, &sub_type_inc);
-                                        if ( r < 0) {
-                                                log_err("Appending value to dbus struct failed");
-                                                return r;
+                                        while ((r = cbor_reader_next(reader, &remaining)) > 0) {
+                                                if (sub_signature[0] == SD_BUS_TYPE_DICT_ENTRY_BEGIN)
+                                                        r = bus_message_append_dict_from_cbor(message, reader, sub_signature);
+                                                else
+                                                        r = bus_message_append_from_cbor(message, reader, sub_signature);
+                                                if (r < 0)
+                                                        return r;
                                         }
-                                        sub_signature_p += sub_type_inc;
+                                        if (r < 0)
+                                                return r;
                                 }
                         }
-                        *type_inc = signature_len;
+
                         r = sd_bus_message_close_container(message);
-                        if (r < 0){
-                                log_err("Closing struct container failed.");
-                        }
+                        if (r < 0)
+                                log_err("Closing dbus container failed");
                         return r;
-                }
 
-                case SD_BUS_TYPE_DICT_ENTRY_BEGIN: {
-                        int r;
-                        size_t signature_len;
-
-                        if(json_value_get_type(json) != JSON_TYPE_OBJECT){
-                                log_err("DBUS interface expected json object -> dict");
+                case SD_BUS_TYPE_STRUCT_BEGIN:
+                        if (!cbor_reader_begin_array(reader, &remaining)) {
+                                log_err("DBUS interface expected cbor array for struct");
                                 return -EINVAL;
                         }
 
@@ -623,178 +1898,110 @@ static int bus_message_append_from_json(sd_bus_message *message, JsonValue *json
                                 return r;
                         }
                         {
-                                // Json dict iterator
-                                JsonObjectEntry* joe;
-                                _cleanup_(json_object_iterator_freep) JsonObjectIterator* joiter = json_object_iterator_new(json);
-
-                                // get the signature inside the brackets e.g. {i(vy)} --> i(vy)
-                                char sub_signature[signature_len-1];
+                                // get the signature inside the brackets e.g. (i(vy)i) --> i(vy)i
+                                char sub_signature[signature_len - 1];
+                                size_t member_len;
                                 memcpy(sub_signature, type + 1, signature_len - 2);
                                 sub_signature[signature_len - 2] = 0;
 
-                                if(joiter == NULL){
-                                        log_err("Invalid json object");
+                                r = sd_bus_message_open_container(message, SD_BUS_TYPE_STRUCT, sub_signature);
+                                if (r < 0) {
+                                        log_err("Creating struct container failed.");
                                         return -EINVAL;
                                 }
 
-                                log_debug("Parsing object %s", sub_signature);
-
-                                joe = json_object_iterator_next(joiter);
-                                while(joe){
-                                        unsigned int sub_type_inc = 0;
-                                        char* key = json_object_entry_key(joe);
-                                        JsonValue* value = json_object_entry_value(joe);
-
-                                        r = sd_bus_message_open_container(message, SD_BUS_TYPE_DICT_ENTRY, sub_signature);
-                                        if (r < 0){
-                                                log_err("Creating dict container failed.");
+                                for (const char *p = sub_signature; *p; p += member_len) {
+                                        if (cbor_reader_next(reader, &remaining) <= 0) {
+                                                log_err("Too few struct members, expected %s", sub_signature);
                                                 return -EINVAL;
                                         }
 
-                                        log_debug("Adding key: %s", key);
-                                        r = sd_bus_message_append_basic(message, SD_BUS_TYPE_STRING, key);  // TODO: convert to any basic type, not just string
-                                        if ( r < 0) {
-                                                log_err("DBUS appending key of dict failed");
+                                        r = bus_message_append_from_cbor(message, reader, p);
+                                        if (r < 0) {
+                                                log_err("Appending value to dbus struct failed");
                                                 return r;
                                         }
 
-                                        r = bus_message_append_from_json(message, value, sub_signature + 1, &sub_type_inc);
-                                        if ( r < 0) {
-                                                log_err("DBUS appending value of dict failed");
-                                                return r;
-                                        }
-                                        r = sd_bus_message_close_container(message);
-                                        if ( r < 0) {
-                                                log_err("CLosing dict entry container failed");
+                                        r = signature_element_length(p, &member_len);
+                                        if (r < 0)
                                                 return r;
-                                        }
-
-                                        joe = json_object_iterator_next(joiter);
                                 }
-                        }
-                        *type_inc = signature_len;
-                        return 0;
-                }
 
-                case SD_BUS_TYPE_VARIANT: {
-                        int r;
-                        JsonType j_type;
-                        JsonValue *json_copy = json;
-                        char dbus_variant_sign[2] = { _SD_BUS_TYPE_INVALID, '\0' };
-                        const char *p_dbus_variant_sign = dbus_variant_sign;
-                        unsigned int sub_type_inc = 0;
-
-                        j_type = json_value_get_type(json);
-                        switch(j_type) {
-                                case JSON_TYPE_OBJECT: {
-                                        JsonValue *valuep;
-
-                                        if(json_object_lookup(json, "dbus_variant_sign", &valuep, JSON_TYPE_STRING)) {
-                                                p_dbus_variant_sign = json_value_get_string(valuep);
-                                                if(json_object_lookup(json, "data", &valuep, 0)) {
-                                                        json_copy = valuep;
-                                                }
-                                        }
-                                        break;
-                                }
-                                case JSON_TYPE_ARRAY:
-                                        log_err("Variant is expected: Array needs to be passed as an object containing the dbus signature and the data.");
+                                if (cbor_reader_next(reader, &remaining) != 0) {
+                                        log_err("Too many struct members, expected %s", sub_signature);
                                         return -EINVAL;
-                                case JSON_TYPE_STRING:
-                                        dbus_variant_sign[0] = SD_BUS_TYPE_STRING;
-                                        break;
-                                case JSON_TYPE_NUMBER:
-                                        log_err("Variant is expected: Numbers need to be passed as an object containing the dbus signature and the data.");
-                                        return -EINVAL;
-                                case JSON_TYPE_TRUE:
-                                case JSON_TYPE_FALSE:
-                                        dbus_variant_sign[0] = SD_BUS_TYPE_BOOLEAN;
-                                        break;
-                                // case JSON_TYPE_NULL:
-                                //        d_type = SD_BUS_TYPE_BYTE;
-                                default:
-                                        dbus_variant_sign[0] = _SD_BUS_TYPE_INVALID;
-                        };
-
-                        r = sd_bus_message_open_container(message, SD_BUS_TYPE_VARIANT, p_dbus_variant_sign);
-                        if (r < 0){
-                                log_err("Opening variant container failed");
-                                return -EINVAL;
+                                }
                         }
 
-                        r = bus_message_append_from_json(message, json_copy, p_dbus_variant_sign, &sub_type_inc);
-                        if ( r < 0) {
-                                log_err("Appending variant failed");
-                                return r;
-                        }
-                        *type_inc = 1;
                         r = sd_bus_message_close_container(message);
-                        if (r < 0){
-                                log_err("Closing variant container failed.");
-                        }
+                        if (r < 0)
+                                log_err("Closing struct container failed.");
                         return r;
-                }
+
+                case SD_BUS_TYPE_VARIANT:
+                        return bus_message_append_variant_from_cbor(message, reader);
 
                 case SD_BUS_TYPE_UNIX_FD:
                         return -ENOTSUP;
 
-                case SD_BUS_TYPE_BOOLEAN: {
-                        bool b;
-
-                        if (json_value_get_type(json) == JSON_TYPE_TRUE)
-                                b = true;
-                        else if (json_value_get_type(json) == JSON_TYPE_FALSE)
-                                b = false;
-                        else
-                                return -EINVAL;
-
-                        *type_inc = 1;
-                        return sd_bus_message_append_basic(message, 'b', &b);
-                }
-
-                case SD_BUS_TYPE_STRING:
-                case SD_BUS_TYPE_OBJECT_PATH:
-                case SD_BUS_TYPE_SIGNATURE: {
-                        if (json_value_get_type(json) != JSON_TYPE_STRING)
-                                return -EINVAL;
-
-                        *type_inc = 1;
-                        return sd_bus_message_append_basic(message, *type, json_value_get_string(json));
-                }
                 default:
                         return -EINVAL;
         }
-
-        return -EINVAL;
 }
 
-static int bus_message_append_args_from_json(sd_bus_message *message, DBusMethod *method, JsonValue *args) {
-        size_t n_args;
+static int bus_message_append_args_from_cbor(sd_bus_message *message, DBusMethod *method, CborReader *args) {
+        size_t remaining;
         int r;
-        unsigned int sub_type_inc = 0;
 
-        n_args = json_array_get_length(args);
-
-        if (method->n_in_args != n_args)
+        if (!cbor_reader_begin_array(args, &remaining))
                 return -EINVAL;
 
-        for (size_t i = 0; i < n_args; i++) {
-                JsonValue *arg;
-
-                json_array_get(args, i, &arg, 0);
+        for (size_t i = 0; i < method->n_in_args; i++) {
+                if (cbor_reader_next(args, &remaining) <= 0)
+                        return -EINVAL;
 
-                r = bus_message_append_from_json(message, arg, method->in_args[i]->type, &sub_type_inc);
+                r = bus_message_append_from_cbor(message, args, method->in_args[i]->type);
                 if (r < 0)
                         return r;
         }
 
+        if (cbor_reader_next(args, &remaining) != 0)
+                return -EINVAL;
+
+        return 0;
+}
+
+/* JSON is the default, CBOR is only used when the client asks for it and
+ * prefers it to JSON. Either way the reply depends on the Accept header,
+ * which caches have to know. */
+static bool http_response_accepts_cbor(HttpResponse *response) {
+        const char *accept = http_response_get_header(response, "Accept");
+        double cbor = http_header_quality(accept, "application/cbor");
+
+        http_response_add_header(response, "Vary", "Accept");
+
+        return cbor > 0 && cbor > http_header_quality(accept, "application/json");
+}
+
+/* Byte arrays are written as base64 strings if the request has the query
+ * argument bytes=base64, or the same as a parameter of its Accept header
+ * ("application/json; bytes=base64"). */
+static unsigned http_response_json_flags(HttpResponse *response) {
+        const char *bytes = http_response_get_argument(response, "bytes");
+        const char *accept = http_response_get_header(response, "Accept");
+
+        if ((bytes && strcmp(bytes, "base64") == 0) ||
+            (accept && strstr(accept, "bytes=base64")))
+                return BUS_JSON_BASE64_BYTES;
+
         return 0;
 }
 
 static int get_properties_finished(sd_bus_message *message, void *userdata, sd_bus_error *ret_error) {
         HttpResponse *response = userdata;
         const sd_bus_error *error;
-        _cleanup_(json_value_freep) JsonValue *reply = NULL;
+        Buffer *body;
+        JsonWriter writer;
         int r;
 
         error = sd_bus_message_get_error(message);
@@ -803,13 +2010,24 @@ static int get_properties_finished(sd_bus_message *message, void *userdata, sd_b
                 return 0;
         }
 
-        r = bus_message_element_to_json(message, &reply);
+        if (http_response_accepts_cbor(response)) {
+                CborWriter cbor;
+
+                body = http_response_get_buffer(response, "application/cbor");
+                cbor_writer_init(&cbor, body);
+                r = bus_message_element_write_cbor(message, &cbor);
+        } else {
+                body = http_response_get_buffer(response, "application/json");
+                json_writer_init(&writer, body);
+                r = bus_message_element_write_json(message, &writer, http_response_json_flags(response));
+        }
         if (r < 0) {
+                buffer_clear(body);
                 http_response_end(response, 500);
                 return 0;
         }
 
-        http_response_end_json(response, 200, reply);
+        http_response_end(response, 200);
         return 0;
 }
 
@@ -817,7 +2035,8 @@ static int method_call_finished(sd_bus_message *message, void *userdata, sd_bus_
         HttpResponse *response = userdata;
         MethodCallRequest *request = http_response_get_user_data(response);
         const sd_bus_error *error;
-        _cleanup_(json_value_freep) JsonValue *reply = NULL;
+        Buffer *body;
+        JsonWriter writer;
         int r;
 
         log_info("get properties from dbus");
@@ -828,14 +2047,25 @@ static int method_call_finished(sd_bus_message *message, void *userdata, sd_bus_
                 return 0;
         }
 
-        r = bus_message_to_json(message, &reply, request->method);
+        if (http_response_accepts_cbor(response)) {
+                CborWriter cbor;
+
+                body = http_response_get_buffer(response, "application/cbor");
+                cbor_writer_init(&cbor, body);
+                r = bus_message_write_cbor(message, &cbor, request->method);
+        } else {
+                body = http_response_get_buffer(response, "application/json");
+                json_writer_init(&writer, body);
+                r = bus_message_write_json(message, &writer, request->method, http_response_json_flags(response));
+        }
         if (r < 0) {
-                log_err("bus_message_to_json failed");
+                log_err("writing the method reply failed");
+                buffer_clear(body);
                 http_response_end(response, 500);
                 return 0;
         }
 
-        http_response_end_json(response, 200, reply);
+        http_response_end(response, 200);
         return 0;
 }
 
@@ -845,9 +2075,6 @@ static int introspect_finished(sd_bus_message *message, void *userdata, sd_bus_e
         const sd_bus_error *error;
         const char *xml;
         _cleanup_(sd_bus_message_unrefp) sd_bus_message *method_message = NULL;
-        const char *interface;
-        const char *method_name;
-        JsonValue *args;
         int r;
 
         log_debug("dbus introspection");
@@ -865,37 +2092,33 @@ static int introspect_finished(sd_bus_message *message, void *userdata, sd_bus_e
                 return 0;
         }
 
-        r = dbus_node_new_from_xml(&request->node, xml);
+        r = dbus_node_new_from_xml(&request->node, xml, http_response_get_arena(response));
         if (r < 0) {
                 log_err("dbus_node_new_from_xml failed");
                 http_response_end(response, 500);
                 return 0;
         }
 
-        if (!json_object_lookup_string(request->json, "interface", &interface) ||
-            !json_object_lookup_string(request->json, "method", &method_name) ||
-            !json_object_lookup(request->json, "arguments", &args, JSON_TYPE_ARRAY)) {
-                log_err("Request requires parameter: interface, method, arguments[]!");
-                http_response_end_error(response, 400, "Invalid request", NULL);
-                return 0;
-        }
-
-        request->method = dbus_node_find_method(request->node, interface, method_name);
+        request->method = dbus_node_find_method(request->node, request->interface, request->method_name);
         if (!request->method) {
-                log_err("Invalid dbus method: %s", method_name);
+                log_err("Invalid dbus method: %s", request->method_name);
                 http_response_end_error(response, 400, "No such method", NULL);
                 return 0;
         }
 
         r = sd_bus_message_new_method_call(sd_bus_message_get_bus(message),
-                                           &method_message, request->destination, request->object, interface, method_name);
+                                           &method_message, request->destination, request->object,
+                                           request->interface, request->method_name);
         if (r < 0) {
                 log_err("sd_bus_message_new_method_call failed.");
                 http_response_end(response, 500);
                 return 0;
         }
 
-        r = bus_message_append_args_from_json(method_message, request->method, args);
+        if (request->cbor)
+                r = bus_message_append_args_from_cbor(method_message, request->method, &request->cbor_arguments);
+        else
+                r = bus_message_append_args_from_reader(method_message, request->method, &request->arguments);
         if (r == -EINVAL) {
                 log_err("dbus request with invalid parameters");
                 http_response_end_error(response, 400, "Invalid request", NULL);
@@ -912,115 +2135,189 @@ static int introspect_finished(sd_bus_message *message, void *userdata, sd_bus_e
         return 0;
 }
 
-static int parse_url(const char *url, char **namep, char **objectp) {
+static int parse_url(Arena *arena, const char *url, char **namep, char **objectp) {
         const char *p;
-        char *name;
-        char *object;
 
         if (url[0] != '/')
                 return -EINVAL;
 
         p = strchr(url + 1, '/');
         if (p) {
-                name = strndup(url + 1, p - url - 1);
-                object = strdup(p);
+                *namep = arena_strndup(arena, url + 1, p - url - 1);
+                *objectp = arena_strdup(arena, p);
         } else {
-                name = strdup(url + 1);
-                object = strdup("/");
+                *namep = arena_strdup(arena, url + 1);
+                *objectp = arena_strdup(arena, "/");
         }
 
-        if (namep)
-                *namep = name;
-
-        if (objectp)
-                *objectp = object;
-
         return 0;
 }
 
+// path is "/<destination>[/<object path>]"
 HttpServerHandlerStatus handle_get_dbus(const char *path, HttpResponse *response, void *userdata) {
         Environment *env = userdata;
+        sd_bus *bus = env->bus;
+        char *name;
+        char *object;
+        int r;
+        const char prop_interface[] = "org.freedesktop.DBus.Properties";
+        const char prop_func[] = "GetAll";
 
-        if (strncmp(env->dbus_prefix, path, strlen(env->dbus_prefix)) == 0) {  // starts with dbus_prefix
-                const char *dbus_path = &path[strlen(env->dbus_prefix) - 1]; // dbus_path must start with a slash!
-                sd_bus *bus = env->bus;
-                _cleanup_(freep) char *name = NULL;
-                _cleanup_(freep) char *object = NULL;
-                int r;
-                const char prop_interface[] = "org.freedesktop.DBus.Properties";
-                const char prop_func[] = "GetAll";
+        r = parse_url(http_response_get_arena(response), path, &name, &object);
+        if (r < 0) {
+                http_response_end(response, 400);
+                return HTTP_SERVER_HANDLED_ERROR;
+        }
 
-                r = parse_url(dbus_path, &name, &object);
-                if (r < 0) {
-                        http_response_end(response, 400);
-                        return HTTP_SERVER_HANDLED_ERROR;
-                }
+        http_suspend_connection(response);
+
+        r = sd_bus_call_method_async(bus, NULL, name, object, prop_interface, prop_func,
+                        get_properties_finished, response, "s", "");
+        if (r == -EINVAL) {
+                log_err("handle_get_dbus got EINVAL from dbus call %s %s %s %s", name, object, prop_interface, prop_func);
+                http_response_end(response, 400);
+                return HTTP_SERVER_HANDLED_ERROR;
+        }
+        else if (r < 0) {
+                log_err("handle_get_dbus error in call %s %s %s %s", name, object, prop_interface, prop_func);
+                http_response_end(response, 500);
+                return HTTP_SERVER_HANDLED_ERROR;
+        }
+        log_info("handle_get_dbus handled URL %s", path);
+        return HTTP_SERVER_HANDLED_SUCCESS;
+}
+
+/* Picks interface and method out of the request body. The arguments are
+ * only validated here; they are marshalled once the method's signature is
+ * known from introspection. */
+static int method_call_request_parse(MethodCallRequest *request, char *body, size_t len) {
+        JsonReader reader;
+        const char *key;
+        int r;
+
+        json_reader_init(&reader, body, len);
 
-                http_suspend_connection(response);
+        if (!json_reader_begin_object(&reader))
+                return -EINVAL;
 
-                r = sd_bus_call_method_async(bus, NULL, name, object, prop_interface, prop_func,
-                                get_properties_finished, response, "s", "");
-                if (r == -EINVAL) {
-                        log_err("handle_get_dbus got EINVAL from dbus call %s %s %s %s", name, object, prop_interface, prop_func);
-                        http_response_end(response, 400);
-                        return HTTP_SERVER_HANDLED_ERROR;
+        while ((r = json_reader_next_key(&reader, &key)) > 0) {
+                JsonType type = json_reader_peek(&reader);
+
+                if (strcmp(key, "interface") == 0 && type == JSON_TYPE_STRING)
+                        r = json_reader_read_string(&reader, &request->interface);
+                else if (strcmp(key, "method") == 0 && type == JSON_TYPE_STRING)
+                        r = json_reader_read_string(&reader, &request->method_name);
+                else {
+                        if (strcmp(key, "arguments") == 0 && type == JSON_TYPE_ARRAY)
+                                request->arguments = reader;
+                        r = json_reader_skip(&reader);
                 }
-                else if (r < 0) {
-                        log_err("handle_get_dbus error in call %s %s %s %s", name, object, prop_interface, prop_func);
-                        http_response_end(response, 500);
-                        return HTTP_SERVER_HANDLED_ERROR;
+                if (!r)
+                        return -EINVAL;
+        }
+        if (r < 0)
+                return r;
+
+        if (!json_reader_at_end(&reader))
+                return -EINVAL;
+
+        return 0;
+}
+
+static int method_call_request_parse_cbor(MethodCallRequest *request, void *body, size_t len) {
+        CborReader reader;
+        const char *key;
+        size_t remaining;
+        int r;
+
+        cbor_reader_init(&reader, body, len);
+
+        if (!cbor_reader_begin_map(&reader, &remaining))
+                return -EINVAL;
+
+        while ((r = cbor_reader_next(&reader, &remaining)) > 0) {
+                CborType type;
+
+                if (!cbor_reader_read_text(&reader, &key))
+                        return -EINVAL;
+
+                type = cbor_reader_peek(&reader);
+                if (strcmp(key, "interface") == 0 && type == CBOR_TYPE_TEXT)
+                        r = cbor_reader_read_text(&reader, &request->interface);
+                else if (strcmp(key, "method") == 0 && type == CBOR_TYPE_TEXT)
+                        r = cbor_reader_read_text(&reader, &request->method_name);
+                else {
+                        if (strcmp(key, "arguments") == 0 && type == CBOR_TYPE_ARRAY)
+                                request->cbor_arguments = reader;
+                        r = cbor_reader_skip(&reader);
                 }
-                log_info("handle_get_dbus handled URL %s", path);
-                return HTTP_SERVER_HANDLED_SUCCESS;
+                if (!r)
+                        return -EINVAL;
         }
-        log_debug("handle_get_dbus ignored URL %s", path);
-        return HTTP_SERVER_HANDLED_IGNORED;
+        if (r < 0)
+                return r;
+
+        if (!cbor_reader_at_end(&reader))
+                return -EINVAL;
+
+        return 0;
 }
 
+// path is "/<destination>[/<object path>]"
 HttpServerHandlerStatus handle_post_dbus(const char *path, void *body, size_t len, HttpResponse *response, void *userdata) {
         Environment *env = userdata;
+        sd_bus *bus = env->bus;
+        MethodCallRequest *request;
+        const char *content_type;
+        bool have_arguments;
+        int r;
 
-        if (strncmp(env->dbus_prefix, path, strlen(env->dbus_prefix)) == 0) {  // starts with dbus_prefix
-                const char *dbus_path = &path[strlen(env->dbus_prefix) - 1]; // dbus_path must start with a slash!
-                sd_bus *bus = env->bus;
-                MethodCallRequest *request;
-                int r;
+        if (!body) {
+                log_err("POST to URL %s without body", path);
+                http_response_end(response, 400);
+                return HTTP_SERVER_HANDLED_ERROR;
+        }
 
-                if (!body) {
-                        log_err("POST to URL %s without body", path);
-                        http_response_end(response, 400);
-                        return HTTP_SERVER_HANDLED_ERROR;
-                }
+        request = arena_alloc0(http_response_get_arena(response), sizeof(MethodCallRequest));
+        http_response_set_user_data(response, request, NULL);
 
-                request = calloc(1, sizeof(MethodCallRequest));
-                http_response_set_user_data(response, request, (void (*)(void *))method_call_request_free);
+        r = parse_url(http_response_get_arena(response), path, &request->destination, &request->object);
+        if (r < 0) {
+                log_err("POST to with invalid dbus URL %s", path);
+                http_response_end(response, 400);
+                return HTTP_SERVER_HANDLED_ERROR;
+        }
 
-                r = parse_url(dbus_path, &request->destination, &request->object);
-                if (r < 0) {
-                        log_err("POST to with invalid dbus URL %s", path);
-                        http_response_end(response, 400);
-                        return HTTP_SERVER_HANDLED_ERROR;
-                }
+        content_type = http_response_get_header(response, "Content-Type");
+        request->cbor = content_type && strncmp(content_type, "application/cbor", strlen("application/cbor")) == 0;
 
-                r = json_parse(body, &request->json, JSON_TYPE_OBJECT);
-                if (r < 0) {
-                        log_err("POST to %s with invalid JSON", path);
-                        http_response_end(response, 400);
-                        return HTTP_SERVER_HANDLED_ERROR;
-                }
+        // the request body outlives the response and thus the request
+        if (request->cbor)
+                r = method_call_request_parse_cbor(request, body, len);
+        else
+                r = method_call_request_parse(request, body, len);
+        if (r < 0) {
+                log_err("POST to %s with invalid %s", path, request->cbor ? "CBOR" : "JSON");
+                http_response_end(response, 400);
+                return HTTP_SERVER_HANDLED_ERROR;
+        }
+
+        have_arguments = request->cbor ? request->cbor_arguments.p != NULL : request->arguments.p != NULL;
+        if (!request->interface || !request->method_name || !have_arguments) {
+                log_err("Request requires parameter: interface, method, arguments[]!");
+                http_response_end_error(response, 400, "Invalid request", NULL);
+                return HTTP_SERVER_HANDLED_ERROR;
+        }
 
-                http_suspend_connection(response);
+        http_suspend_connection(response);
 
-                r = sd_bus_call_method_async(bus, NULL, request->destination, request->object,
-                                "org.freedesktop.DBus.Introspectable", "Introspect", introspect_finished, response, NULL);
-                if (r < 0) {
-                        log_err("handle_post_dbus introspection error for %s %s", request->destination, request->object);
-                        http_response_end(response, 400);
-                        return HTTP_SERVER_HANDLED_ERROR;
-                }
-                log_info("handle_post_dbus handled URL %s", path);
-                return HTTP_SERVER_HANDLED_SUCCESS;
+        r = sd_bus_call_method_async(bus, NULL, request->destination, request->object,
+                        "org.freedesktop.DBus.Introspectable", "Introspect", introspect_finished, response, NULL);
+        if (r < 0) {
+                log_err("handle_post_dbus introspection error for %s %s", request->destination, request->object);
+                http_response_end(response, 400);
+                return HTTP_SERVER_HANDLED_ERROR;
         }
-        log_debug("handle_post_dbus ignored URL %s", path);
-        return HTTP_SERVER_HANDLED_IGNORED;
+        log_info("handle_post_dbus handled URL %s", path);
+        return HTTP_SERVER_HANDLED_SUCCESS;
 }
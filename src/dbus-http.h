@@ -1,6 +1,19 @@
 #pragma once
 
+#include <systemd/sd-bus.h>
+
 #include "http-server.h"
+#include "json.h"
+#include "json-writer.h"
 
 HttpGetHandler handle_get_dbus;
 HttpPostHandler handle_post_dbus;
+
+void http_response_end_dbus_error(HttpResponse *response, const sd_bus_error *error);
+int bus_message_element_to_json(sd_bus_message *message, JsonValue **jsonp);
+// flags for bus_message_element_write_json()
+enum {
+        BUS_JSON_BASE64_BYTES = 1 << 0,         // "ay" as one base64 string, not an array of numbers
+};
+
+int bus_message_element_write_json(sd_bus_message *message, JsonWriter *writer, unsigned flags);
@@ -9,79 +9,32 @@
 #include <assert.h>
 #include <systemd/sd-bus.h>
 
-static void * grow_pointer_array(void *array, size_t *allocedp) {
+static void * grow_pointer_array(Arena *arena, void *array, size_t *allocedp) {
+        size_t old_size = *allocedp * sizeof(void *);
+
         if (*allocedp == 0)
                 *allocedp = 8;
         else
                 *allocedp *= 2;
 
-        return realloc(array, *allocedp * sizeof(void *));
-}
-
-static DBusArgument * dbus_argument_free(DBusArgument *arg) {
-        free(arg->name);
-        free(arg->type);
-        free(arg);
-
-        return NULL;
-}
-
-static DBusMethod * dbus_method_free(DBusMethod *method) {
-        for (size_t i = 0; i < method->n_in_args; i++)
-                dbus_argument_free(method->in_args[i]);
-
-        for (size_t i = 0; i < method->n_out_args; i++)
-                dbus_argument_free(method->out_args[i]);
-
-        free(method->name);
-        free(method->in_args);
-        free(method->out_args);
-        free(method);
-
-        return NULL;
+        return arena_realloc(arena, array, old_size, *allocedp * sizeof(void *));
 }
 
-static DBusProperty * dbus_property_free(DBusProperty *property) {
-        free(property->name);
-        free(property->type);
-        free(property);
-
-        return NULL;
-}
-
-static DBusMethod * dbus_interface_append_method(DBusInterface *interface, const char *name) {
+static DBusMethod * dbus_interface_append_method(Arena *arena, DBusInterface *interface, const char *name) {
         DBusMethod *method;
 
-        method = calloc(1, sizeof(DBusMethod));
-        method->name = strdup(name);
+        method = arena_alloc0(arena, sizeof(DBusMethod));
+        method->name = arena_strdup(arena, name);
 
         if (interface->n_methods == interface->n_alloced_methods)
-                interface->methods = grow_pointer_array(interface->methods, &interface->n_alloced_methods);
+                interface->methods = grow_pointer_array(arena, interface->methods, &interface->n_alloced_methods);
         interface->methods[interface->n_methods] = method;
         interface->n_methods += 1;
 
         return method;
 }
 
-static char * strdup_printf(const char *fmt, ...) {
-        va_list ap;
-        size_t len;
-        char *string;
-
-        va_start(ap, fmt);
-        len = vsnprintf(NULL, 0, fmt, ap);
-        va_end(ap);
-
-        string = malloc(len + 1);
-
-        va_start(ap, fmt);
-        len = vsnprintf(string, len + 1, fmt, ap);
-        va_end(ap);
-
-        return string;
-}
-
-static DBusArgument * dbus_method_append_argument(DBusMethod *method, const char *name, const char *type, const char *direction) {
+static DBusArgument * dbus_method_append_argument(Arena *arena, DBusMethod *method, const char *name, const char *type, const char *direction) {
         DBusArgument *argument;
         bool in;
 
@@ -92,24 +45,24 @@ static DBusArgument * dbus_method_append_argument(DBusMethod *method, const char
         else
                 return NULL;
 
-        argument = calloc(1, sizeof(DBusArgument));
+        argument = arena_alloc0(arena, sizeof(DBusArgument));
 
         /* name is optional */
         if (name)
-                argument->name = strdup(name);
+                argument->name = arena_strdup(arena, name);
         else
-                argument->name = strdup_printf("arg%u", in ? method->n_in_args : method->n_out_args);
+                argument->name = arena_printf(arena, "arg%zu", in ? method->n_in_args : method->n_out_args);
 
-        argument->type = strdup(type);
+        argument->type = arena_strdup(arena, type);
 
         if (in) {
                 if (method->n_in_args == method->n_alloced_in_args)
-                        method->in_args = grow_pointer_array(method->in_args, &method->n_alloced_in_args);
+                        method->in_args = grow_pointer_array(arena, method->in_args, &method->n_alloced_in_args);
                 method->in_args[method->n_in_args] = argument;
                 method->n_in_args += 1;
         } else {
                 if (method->n_out_args == method->n_alloced_out_args)
-                        method->out_args = grow_pointer_array(method->out_args, &method->n_alloced_out_args);
+                        method->out_args = grow_pointer_array(arena, method->out_args, &method->n_alloced_out_args);
                 method->out_args[method->n_out_args] = argument;
                 method->n_out_args += 1;
         }
@@ -117,66 +70,36 @@ static DBusArgument * dbus_method_append_argument(DBusMethod *method, const char
         return argument;
 }
 
-static DBusProperty * dbus_interface_append_property(DBusInterface *interface, const char *name, const char *type, bool writable) {
+static DBusProperty * dbus_interface_append_property(Arena *arena, DBusInterface *interface, const char *name, const char *type, bool writable) {
         DBusProperty *property;
 
-        property = calloc(1, sizeof(DBusProperty));
-        property->name = strdup(name);
-        property->type = strdup(type);
+        property = arena_alloc0(arena, sizeof(DBusProperty));
+        property->name = arena_strdup(arena, name);
+        property->type = arena_strdup(arena, type);
         property->writable = writable;
 
         if (interface->n_properties == interface->n_alloced_properties)
-                interface->properties = grow_pointer_array(interface->properties, &interface->n_alloced_properties);
+                interface->properties = grow_pointer_array(arena, interface->properties, &interface->n_alloced_properties);
         interface->properties[interface->n_properties] = property;
         interface->n_properties += 1;
 
         return property;
 }
 
-static DBusInterface * dbus_interface_free(DBusInterface *interface) {
-        for (size_t i = 0; i < interface->n_methods; i++)
-                dbus_method_free(interface->methods[i]);
-
-        for (size_t i = 0; i < interface->n_properties; i++)
-                dbus_property_free(interface->properties[i]);
-
-        free(interface->name);
-        free(interface->methods);
-        free(interface->properties);
-        free(interface);
-
-        return NULL;
-}
-
-static DBusInterface * dbus_node_append_interface(DBusNode *node, const char *name) {
+static DBusInterface * dbus_node_append_interface(Arena *arena, DBusNode *node, const char *name) {
         DBusInterface *interface;
 
-        interface = calloc(1, sizeof(DBusInterface));
-        interface->name = strdup(name);
+        interface = arena_alloc0(arena, sizeof(DBusInterface));
+        interface->name = arena_strdup(arena, name);
 
         if (node->n_interfaces == node->n_alloced_interfaces)
-                node->interfaces = grow_pointer_array(node->interfaces, &node->n_alloced_interfaces);
+                node->interfaces = grow_pointer_array(arena, node->interfaces, &node->n_alloced_interfaces);
         node->interfaces[node->n_interfaces] = interface;
         node->n_interfaces += 1;
 
         return interface;
 }
 
-DBusNode * dbus_node_free(DBusNode *node) {
-        for (size_t i = 0; i < node->n_interfaces; i++)
-                dbus_interface_free(node->interfaces[i]);
-
-        free(node->interfaces);
-        free(node);
-
-        return NULL;
-}
-
-void dbus_node_freep(DBusNode **nodep) {
-        if (*nodep)
-                dbus_node_free(*nodep);
-}
-
 enum {
         STATE_ROOT,
         STATE_NODE,
@@ -189,6 +112,7 @@ enum {
 typedef struct {
         int level;
         DBusNode *node;
+        Arena *arena;
 } State;
 
 static const char * find_attribute(const char **attributes, const char *attribute) {
@@ -206,7 +130,7 @@ static void start_element(void *data, const char *element, const char **attribut
         switch (state->level) {
                 case STATE_ROOT:
                         if (strcmp(element, "node") == 0 && !state->node) {
-                                state->node = calloc(1, sizeof(DBusNode));
+                                state->node = arena_alloc0(state->arena, sizeof(DBusNode));
                                 state->level = STATE_NODE;
                         }
                         break;
@@ -216,7 +140,7 @@ static void start_element(void *data, const char *element, const char **attribut
                                 const char *name = find_attribute(attributes, "name");
 
                                 if (name) {
-                                        dbus_node_append_interface(state->node, name);
+                                        dbus_node_append_interface(state->arena, state->node, name);
                                         state->level = STATE_INTERFACE;
                                 }
                         }
@@ -235,7 +159,7 @@ static void start_element(void *data, const char *element, const char **attribut
                                         direction = "in";
 
                                 if (type) {
-                                        dbus_method_append_argument(method, name, type, direction);
+                                        dbus_method_append_argument(state->arena, method, name, type, direction);
                                         state->level = STATE_ARGUMENT;
                                 }
                         }
@@ -249,7 +173,7 @@ static void start_element(void *data, const char *element, const char **attribut
                                 const char *name = find_attribute(attributes, "name");
 
                                 if (name) {
-                                        dbus_interface_append_method(interface, name);
+                                        dbus_interface_append_method(state->arena, interface, name);
                                         state->level = STATE_METHOD;
                                 }
                         } else if (strcmp(element, "property") == 0) {
@@ -258,7 +182,7 @@ static void start_element(void *data, const char *element, const char **attribut
                                 const char *access = find_attribute(attributes, "access");
 
                                 if (name && type && access) {
-                                        dbus_interface_append_property(interface, name, type, strcmp(access, "readwrite") == 0);
+                                        dbus_interface_append_property(state->arena, interface, name, type, strcmp(access, "readwrite") == 0);
                                         state->level = STATE_PROPERTY;
                                 }
                         }
@@ -298,9 +222,9 @@ static void end_element(void *data, const char *element) {
         }
 }
 
-int dbus_node_new_from_xml(DBusNode **nodep, const char *xml) {
+int dbus_node_new_from_xml(DBusNode **nodep, const char *xml, Arena *arena) {
         XML_Parser parser;
-        State state = { 0 };
+        State state = { .arena = arena };
         int r = 0;
 
         parser = XML_ParserCreate(NULL);
@@ -310,10 +234,9 @@ int dbus_node_new_from_xml(DBusNode **nodep, const char *xml) {
         if (XML_Parse(parser, xml, strlen(xml), XML_TRUE) == 0)
                 r = -EINVAL;
 
+        // a partial node is left to the arena
         if (r == 0)
                 *nodep = state.node;
-        else if (state.node)
-                dbus_node_free(state.node);
 
         XML_ParserFree(parser);
         return r;
@@ -360,6 +283,11 @@ bool bus_type_is_number(char c) {
         return !!memchr(valid_dbus_basic_types, c, 8);
 }
 
+// arrays of these are one block of fixed size elements on the wire
+bool bus_type_is_fixed(char c) {
+        return bus_type_is_number(c) || c == SD_BUS_TYPE_BOOLEAN;
+}
+
 bool bus_type_is_dbus_dict_key(char c) {
         return !!memchr(valid_dbus_basic_types, c, 9);
 }
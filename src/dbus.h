@@ -3,6 +3,8 @@
 #include <stdlib.h>
 #include <stdbool.h>
 
+#include "arena.h"
+
 typedef struct DBusNode DBusNode;
 typedef struct DBusInterface DBusInterface;
 typedef struct DBusMethod DBusMethod;
@@ -46,11 +48,11 @@ struct DBusProperty {
         bool writable;
 };
 
-int dbus_node_new_from_xml(DBusNode **nodep, const char *xml);
-DBusNode * dbus_node_free(DBusNode *node);
-void dbus_node_freep(DBusNode **nodep);
+// the node and everything it references is allocated from arena
+int dbus_node_new_from_xml(DBusNode **nodep, const char *xml, Arena *arena);
 DBusMethod * dbus_node_find_method(DBusNode *node, const char *interface_name, const char *method_name);
 int signature_element_length(const char *s, size_t *l);
 bool bus_type_is_number(char c);
+bool bus_type_is_fixed(char c);
 bool bus_type_is_dbus_dict_key(char c);
 bool bus_type_is_basic(char c);
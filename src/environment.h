@@ -2,7 +2,16 @@
 
 #include <systemd/sd-bus.h>
 
+#include "events.h"
+#include "signals.h"
+#include "watch.h"
+
 typedef struct {
         sd_bus *bus;
         const char *dbus_prefix;
+        SignalRegistry *signals;
+        const char *events_prefix;
+        EventStreams *events;
+        WatchRegistry *watches;
+        const char *watch_prefix;
 } Environment;
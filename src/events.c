@@ -0,0 +1,530 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "events.h"
+#include "signals.h"
+#include "json.h"
+#include "json-writer.h"
+#include "log.h"
+#include "environment.h"
+
+#define _cleanup_(fn) __attribute__((__cleanup__(fn)))
+
+static const char CONTENT_TYPE_EVENT_STREAM[] = "text/event-stream";
+
+static const char EVENT_FRAME_SUFFIX[] = "\n\n";
+
+struct EventStreams {
+        size_t queue_limit;
+        EventQueuePolicy policy;
+
+        EventStream **streams;
+        size_t n_streams;
+        size_t n_alloced_streams;
+
+        // totals include streams which are gone already
+        uint64_t dropped;
+        uint64_t coalesced;
+        uint64_t disconnected;
+};
+
+// A server-sent events connection. Queued buffers are shared with all other
+// subscribers of the same match, only the references are per connection.
+struct EventStream {
+        EventStreams *streams;
+        SignalSubscriber subscriber;
+        HttpStream *stream;
+        char *rule;
+        SignalBuffer **queue;
+        size_t head;
+        size_t n_queued;
+        size_t n_alloced;
+        size_t offset;          // bytes of the head frame already written
+        size_t queued_bytes;    // frame bytes of queue[head..n_queued), including the written part
+        size_t high_water;
+        uint64_t dropped;
+        uint64_t coalesced;
+        bool closing;           // disconnected for overflowing its queue
+};
+
+static const char * const event_queue_policy_names[] = {
+        [EVENT_QUEUE_DROP_OLDEST] = "drop-oldest",
+        [EVENT_QUEUE_COALESCE] = "coalesce",
+        [EVENT_QUEUE_DISCONNECT] = "disconnect",
+};
+
+static inline void freep(void *p) {
+        free(*(void **)p);
+}
+
+static void * grow_pointer_array(void *array, size_t *allocedp) {
+        if (*allocedp == 0)
+                *allocedp = 8;
+        else
+                *allocedp *= 2;
+
+        return realloc(array, *allocedp * sizeof(void *));
+}
+
+int event_queue_policy_from_string(const char *string, EventQueuePolicy *policyp) {
+        for (size_t i = 0; i < sizeof(event_queue_policy_names) / sizeof(event_queue_policy_names[0]); i++) {
+                if (strcmp(string, event_queue_policy_names[i]) == 0) {
+                        *policyp = i;
+                        return 0;
+                }
+        }
+
+        return -EINVAL;
+}
+
+void event_queue_policy_print(void) {
+        for (size_t i = 0; i < sizeof(event_queue_policy_names) / sizeof(event_queue_policy_names[0]); i++)
+                printf("%s%s", i ? "|" : "", event_queue_policy_names[i]);
+}
+
+int event_streams_new(EventStreams **streamsp, size_t queue_limit, EventQueuePolicy policy) {
+        EventStreams *streams;
+
+        streams = calloc(1, sizeof(EventStreams));
+        if (!streams)
+                return -ENOMEM;
+
+        streams->queue_limit = queue_limit;
+        streams->policy = policy;
+
+        *streamsp = streams;
+        return 0;
+}
+
+EventStreams * event_streams_free(EventStreams *streams) {
+        // the http server owns the connections and must be gone already
+        assert(streams->n_streams == 0);
+
+        free(streams->streams);
+        free(streams);
+
+        return NULL;
+}
+
+static size_t event_frame_header(const SignalBuffer *buffer, char *header, size_t size) {
+        size_t n = 0;
+
+        if (buffer->id[0])
+                n += snprintf(header + n, size - n, "id: %s\n", buffer->id);
+        if (buffer->event)
+                n += snprintf(header + n, size - n, "event: %s\n", buffer->event);
+        n += snprintf(header + n, size - n, "data: ");
+
+        return n;
+}
+
+static size_t event_frame_size(const SignalBuffer *buffer) {
+        char header[128];
+
+        return event_frame_header(buffer, header, sizeof(header)) + buffer->size + strlen(EVENT_FRAME_SUFFIX);
+}
+
+/* Copies the frame "id: <id>\ndata: <json>\n\n" starting at offset without
+ * assembling it in memory first. */
+static size_t event_frame_copy(const SignalBuffer *buffer, size_t offset, char *buf, size_t max) {
+        char header[128];
+        const char *segments[] = { header, buffer->data, EVENT_FRAME_SUFFIX };
+        const size_t sizes[] = { event_frame_header(buffer, header, sizeof(header)), buffer->size, strlen(EVENT_FRAME_SUFFIX) };
+        size_t n = 0;
+
+        for (size_t i = 0; i < 3 && n < max; i++) {
+                size_t chunk;
+
+                if (offset >= sizes[i]) {
+                        offset -= sizes[i];
+                        continue;
+                }
+
+                chunk = sizes[i] - offset;
+                if (chunk > max - n)
+                        chunk = max - n;
+
+                memcpy(buf + n, segments[i] + offset, chunk);
+                n += chunk;
+                offset = 0;
+        }
+
+        return n;
+}
+
+static void event_stream_clear(EventStream *es) {
+        for (size_t i = es->head; i < es->n_queued; i++)
+                signal_buffer_unref(es->queue[i]);
+
+        es->head = 0;
+        es->n_queued = 0;
+        es->offset = 0;
+        es->queued_bytes = 0;
+}
+
+static void event_stream_pop(EventStream *es) {
+        SignalBuffer *buffer = es->queue[es->head];
+
+        es->queued_bytes -= event_frame_size(buffer);
+        signal_buffer_unref(buffer);
+        es->head += 1;
+        es->offset = 0;
+
+        if (es->head == es->n_queued) {
+                es->head = 0;
+                es->n_queued = 0;
+        }
+}
+
+static void event_stream_push(EventStream *es, SignalBuffer *buffer) {
+        if (es->n_queued == es->n_alloced) {
+                if (es->head > 0) {
+                        memmove(es->queue, es->queue + es->head, (es->n_queued - es->head) * sizeof(SignalBuffer *));
+                        es->n_queued -= es->head;
+                        es->head = 0;
+                } else
+                        es->queue = grow_pointer_array(es->queue, &es->n_alloced);
+        }
+
+        es->queue[es->n_queued] = signal_buffer_ref(buffer);
+        es->n_queued += 1;
+        es->queued_bytes += event_frame_size(buffer);
+
+        if (es->queued_bytes > es->high_water)
+                es->high_water = es->queued_bytes;
+}
+
+/* Drops whole frames from the front until the queue fits its limit again.
+ * A partially written head frame has to be finished, otherwise the client
+ * would see a corrupt event. */
+static void event_stream_drop_oldest(EventStream *es) {
+        size_t limit = es->streams->queue_limit;
+        size_t i = es->head + (es->offset > 0 ? 1 : 0);
+        size_t n = i;
+
+        while (es->queued_bytes > limit && i < es->n_queued - 1) {
+                es->queued_bytes -= event_frame_size(es->queue[i]);
+                signal_buffer_unref(es->queue[i]);
+                es->dropped += 1;
+                es->streams->dropped += 1;
+                i += 1;
+        }
+
+        if (i == n)
+                return;
+
+        memmove(es->queue + n, es->queue + i, (es->n_queued - i) * sizeof(SignalBuffer *));
+        es->n_queued -= i - n;
+}
+
+static bool json_array_contains_string(JsonValue *array, const char *string) {
+        for (size_t i = 0; i < json_array_get_length(array); i++) {
+                JsonValue *element;
+
+                if (json_array_get(array, i, &element, JSON_TYPE_STRING) &&
+                    strcmp(json_value_get_string(element), string) == 0)
+                        return true;
+        }
+
+        return false;
+}
+
+/* Folds an older PropertiesChanged signal into a newer one. Whatever the
+ * newer signal says about a property wins. */
+static void properties_changed_merge(JsonValue *newer, JsonValue *older) {
+        _cleanup_(json_object_iterator_freep) JsonObjectIterator *iter = NULL;
+        JsonValue *arguments, *changed, *invalidated;
+        JsonValue *old_arguments, *old_changed, *old_invalidated;
+        JsonObjectEntry *entry;
+
+        json_object_lookup(newer, "arguments", &arguments, JSON_TYPE_ARRAY);
+        json_array_get(arguments, 1, &changed, JSON_TYPE_OBJECT);
+        json_array_get(arguments, 2, &invalidated, JSON_TYPE_ARRAY);
+
+        json_object_lookup(older, "arguments", &old_arguments, JSON_TYPE_ARRAY);
+        json_array_get(old_arguments, 1, &old_changed, JSON_TYPE_OBJECT);
+        json_array_get(old_arguments, 2, &old_invalidated, JSON_TYPE_ARRAY);
+
+        iter = json_object_iterator_new(old_changed);
+        while ((entry = json_object_iterator_next(iter))) {
+                const char *name = json_object_entry_key(entry);
+
+                if (!json_object_lookup(changed, name, NULL, 0) && !json_array_contains_string(invalidated, name))
+                        json_object_insert(changed, name, json_value_copy(json_object_entry_value(entry)));
+        }
+
+        for (size_t i = 0; i < json_array_get_length(old_invalidated); i++) {
+                JsonValue *name;
+
+                if (!json_array_get(old_invalidated, i, &name, JSON_TYPE_STRING))
+                        continue;
+
+                if (!json_object_lookup(changed, json_value_get_string(name), NULL, 0) &&
+                    !json_array_contains_string(invalidated, json_value_get_string(name)))
+                        json_array_append(invalidated, json_string_new(json_value_get_string(name)));
+        }
+}
+
+static bool signal_buffer_same_properties(const SignalBuffer *a, const SignalBuffer *b) {
+        return a->changed_path && b->changed_path &&
+               strcmp(a->changed_path, b->changed_path) == 0 &&
+               strcmp(a->changed_interface, b->changed_interface) == 0;
+}
+
+/* Replaces all queued PropertiesChanged signals for the same object and
+ * interface by a single one carrying the latest state. The merged signal
+ * keeps the id of the newest one, so resuming from it loses nothing.
+ * Only signals for the same object and interface are parsed.
+ * Returns the buffer to queue, which is a new reference. */
+static SignalBuffer * event_stream_coalesce(EventStream *es, SignalBuffer *buffer) {
+        _cleanup_(json_value_freep) JsonValue *merged = NULL;
+        SignalBuffer *coalesced;
+        size_t first = es->head + (es->offset > 0 ? 1 : 0);
+        size_t n = first;
+
+        if (!buffer->changed_path)
+                return signal_buffer_ref(buffer);
+
+        // walk backwards so that newer state is folded in first
+        for (size_t i = es->n_queued; i > first; i--) {
+                _cleanup_(json_value_freep) JsonValue *json = NULL;
+                SignalBuffer *queued = es->queue[i - 1];
+
+                if (!signal_buffer_same_properties(buffer, queued))
+                        continue;
+
+                if (!merged && json_parse(buffer->data, &merged, JSON_TYPE_OBJECT) < 0)
+                        return signal_buffer_ref(buffer);
+
+                if (json_parse(queued->data, &json, JSON_TYPE_OBJECT) < 0)
+                        continue;
+
+                properties_changed_merge(merged, json);
+
+                es->queued_bytes -= event_frame_size(queued);
+                signal_buffer_unref(queued);
+                es->queue[i - 1] = NULL;
+                es->coalesced += 1;
+                es->streams->coalesced += 1;
+        }
+
+        if (!merged)
+                return signal_buffer_ref(buffer);
+
+        for (size_t i = first; i < es->n_queued; i++) {
+                if (es->queue[i])
+                        es->queue[n++] = es->queue[i];
+        }
+        es->n_queued = n;
+
+        coalesced = signal_buffer_new(merged);
+        coalesced->seq = buffer->seq;
+        coalesced->event = buffer->event;
+        memcpy(coalesced->id, buffer->id, sizeof(coalesced->id));
+        coalesced->changed_path = strdup(buffer->changed_path);
+        coalesced->changed_interface = strdup(buffer->changed_interface);
+
+        return coalesced;
+}
+
+static ssize_t event_stream_read(void *userdata, char *buf, size_t max) {
+        EventStream *es = userdata;
+        size_t n = 0;
+
+        if (es->closing)
+                return -1;
+
+        while (es->n_queued > 0 && n < max) {
+                SignalBuffer *buffer = es->queue[es->head];
+                size_t written;
+
+                written = event_frame_copy(buffer, es->offset, buf + n, max - n);
+                es->offset += written;
+                n += written;
+
+                if (es->offset == event_frame_size(buffer))
+                        event_stream_pop(es);
+        }
+
+        return n;
+}
+
+static void event_stream_deliver(SignalSubscriber *subscriber, SignalBuffer *buffer) {
+        EventStream *es = subscriber->userdata;
+        EventStreams *streams = es->streams;
+
+        if (es->closing)
+                return;
+
+        if (streams->queue_limit > 0 && streams->policy == EVENT_QUEUE_COALESCE &&
+            es->queued_bytes + event_frame_size(buffer) > streams->queue_limit) {
+                SignalBuffer *coalesced = event_stream_coalesce(es, buffer);
+
+                event_stream_push(es, coalesced);
+                signal_buffer_unref(coalesced);
+        } else
+                event_stream_push(es, buffer);
+
+        if (streams->queue_limit > 0 && es->queued_bytes > streams->queue_limit) {
+                if (streams->policy == EVENT_QUEUE_DISCONNECT) {
+                        log_warning("Disconnecting event stream %s, %zu bytes queued", es->rule, es->queued_bytes);
+                        event_stream_clear(es);
+                        es->closing = true;
+                        streams->disconnected += 1;
+                } else
+                        event_stream_drop_oldest(es);
+        }
+
+        /* A closing stream ends, and unsubscribes, when MHD runs next. That
+         * is after the fan-out, so the other subscribers still get this signal. */
+        if (es->stream)
+                http_stream_wake(es->stream);
+}
+
+static void event_stream_free(EventStream *es) {
+        EventStreams *streams = es->streams;
+
+        signal_registry_unsubscribe(&es->subscriber);
+
+        for (size_t i = 0; i < streams->n_streams; i++) {
+                if (streams->streams[i] == es) {
+                        streams->streams[i] = streams->streams[streams->n_streams - 1];
+                        streams->n_streams -= 1;
+                        break;
+                }
+        }
+
+        event_stream_clear(es);
+        free(es->queue);
+        free(es->rule);
+        free(es);
+}
+
+static void handle_get_event_stats(EventStreams *streams, HttpResponse *response) {
+        JsonWriter writer;
+
+        json_writer_init(&writer, http_response_get_buffer(response, "application/json"));
+        json_writer_begin_object(&writer);
+        json_writer_key(&writer, "policy");
+        json_writer_string(&writer, event_queue_policy_names[streams->policy]);
+        json_writer_key(&writer, "queue_limit");
+        json_writer_number(&writer, streams->queue_limit);
+        json_writer_key(&writer, "dropped");
+        json_writer_number(&writer, streams->dropped);
+        json_writer_key(&writer, "coalesced");
+        json_writer_number(&writer, streams->coalesced);
+        json_writer_key(&writer, "disconnected");
+        json_writer_number(&writer, streams->disconnected);
+
+        json_writer_key(&writer, "streams");
+        json_writer_begin_array(&writer);
+        for (size_t i = 0; i < streams->n_streams; i++) {
+                EventStream *es = streams->streams[i];
+
+                json_writer_begin_object(&writer);
+                json_writer_key(&writer, "match");
+                json_writer_string(&writer, es->rule);
+                json_writer_key(&writer, "queued");
+                json_writer_number(&writer, es->n_queued - es->head);
+                json_writer_key(&writer, "queued_bytes");
+                json_writer_number(&writer, es->queued_bytes);
+                json_writer_key(&writer, "high_water");
+                json_writer_number(&writer, es->high_water);
+                json_writer_key(&writer, "dropped");
+                json_writer_number(&writer, es->dropped);
+                json_writer_key(&writer, "coalesced");
+                json_writer_number(&writer, es->coalesced);
+                json_writer_end_object(&writer);
+        }
+        json_writer_end_array(&writer);
+        json_writer_end_object(&writer);
+
+        http_response_end(response, 200);
+}
+
+/* Splits "<sender>[/<object path>]" */
+static int parse_events_url(const char *url, char **senderp, char **pathp) {
+        const char *p;
+
+        if (*url == '\0' || *url == '/')
+                return -EINVAL;
+
+        p = strchr(url, '/');
+        if (p) {
+                *senderp = strndup(url, p - url);
+                *pathp = strdup(p);
+        } else {
+                *senderp = strdup(url);
+                *pathp = NULL;
+        }
+
+        return 0;
+}
+
+HttpServerHandlerStatus handle_get_events(const char *path, HttpResponse *response, void *userdata) {
+        Environment *env = userdata;
+        _cleanup_(freep) char *sender = NULL;
+        _cleanup_(freep) char *object = NULL;
+        _cleanup_(freep) char *rule = NULL;
+        const char *last_event_id;
+        EventStream *es;
+        int r;
+
+        // the route itself lists the streams
+        if (strcmp(path, "") == 0 || strcmp(path, "/") == 0) {
+                handle_get_event_stats(env->events, response);
+                return HTTP_SERVER_HANDLED_SUCCESS;
+        }
+
+        // path is "/<sender>[/<object path>]"
+        r = parse_events_url(path + 1, &sender, &object);
+        if (r < 0) {
+                log_err("Invalid events URL %s", path);
+                http_response_end(response, 400);
+                return HTTP_SERVER_HANDLED_ERROR;
+        }
+
+        r = signal_match_rule_new(&rule, sender, object,
+                                  http_response_get_argument(response, "interface"),
+                                  http_response_get_argument(response, "member"));
+        if (r < 0) {
+                log_err("Invalid match for events URL %s", path);
+                http_response_end(response, 400);
+                return HTTP_SERVER_HANDLED_ERROR;
+        }
+
+        es = calloc(1, sizeof(EventStream));
+        es->streams = env->events;
+        es->rule = strdup(rule);
+        es->subscriber.deliver = event_stream_deliver;
+        es->subscriber.userdata = es;
+
+        if (env->events->n_streams == env->events->n_alloced_streams)
+                env->events->streams = grow_pointer_array(env->events->streams, &env->events->n_alloced_streams);
+        env->events->streams[env->events->n_streams] = es;
+        env->events->n_streams += 1;
+
+        r = signal_registry_subscribe(env->signals, rule, &es->subscriber);
+        if (r < 0) {
+                event_stream_free(es);
+                http_response_end(response, r == -EINVAL ? 400 : 500);
+                return HTTP_SERVER_HANDLED_ERROR;
+        }
+
+        // EventSource sends the header on reconnects, other clients may use the argument
+        last_event_id = http_response_get_header(response, "Last-Event-ID");
+        if (!last_event_id)
+                last_event_id = http_response_get_argument(response, "last_event_id");
+        if (last_event_id)
+                signal_subscriber_replay(&es->subscriber, last_event_id);
+
+        es->stream = http_response_end_stream(response, CONTENT_TYPE_EVENT_STREAM, event_stream_read,
+                                              es, (void (*)(void *))event_stream_free);
+
+        log_info("handle_get_events streaming %s", rule);
+        return HTTP_SERVER_HANDLED_SUCCESS;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdlib.h>
+
+#include "http-server.h"
+
+typedef struct EventStreams EventStreams;
+typedef struct EventStream EventStream;
+
+// What to do when a client does not read its events fast enough
+typedef enum {
+        EVENT_QUEUE_DROP_OLDEST,
+        EVENT_QUEUE_COALESCE,           // merge PropertiesChanged per object, then drop oldest
+        EVENT_QUEUE_DISCONNECT
+} EventQueuePolicy;
+
+int event_queue_policy_from_string(const char *string, EventQueuePolicy *policyp);
+void event_queue_policy_print(void);
+
+// queue_limit is the number of bytes queued per connection, 0 for no limit
+int event_streams_new(EventStreams **streamsp, size_t queue_limit, EventQueuePolicy policy);
+EventStreams * event_streams_free(EventStreams *streams);
+
+HttpGetHandler handle_get_events;
@@ -1,96 +1,155 @@
 
 #include "http-server.h"
+#include "assets.h"
+#include "buffer.h"
 #include "log.h"
+#include "upload.h"
 #include "environment.h"
 
+#include <ctype.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <microhttpd.h>
+#include <zlib.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdbool.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <sys/stat.h>
 
 
-static const char CONTENT_TYPE_HTML[] = "text/html; charset=utf-8";
-static const char CONTENT_TYPE_CSS[] = "text/css; charset=utf-8";
-static const char CONTENT_TYPE_JS[] = "application/javascript";
-static const char CONTENT_TYPE_MAP[] = "application/octet-stream";
-static const char CONTENT_TYPE_ICO[] = "image/x-icon";
-static const char CONTENT_TYPE_PNG[] = "image/png";
-static const char CONTENT_TYPE_JPG[] = "image/jpg";
-static const char CONTENT_TYPE_GIF[] = "image/gif";
-static const char CONTENT_TYPE_SVG[] = "image/svg+xml";
-static const char CONTENT_TYPE_TTF[] = "application/x-font-ttf";
-static const char CONTENT_TYPE_WOFF2[] = "font/woff2";
-static const char CONTENT_TYPE_JSON[] = "application/json";
+// what MHD recommends for the post processor to perform well
+#define UPLOAD_BUFFER_SIZE (64 * 1024)
 
-#define POSTBUFFERSIZE  512
+#ifndef MHD_HTTP_RANGE_NOT_SATISFIABLE
+#define MHD_HTTP_RANGE_NOT_SATISFIABLE MHD_HTTP_REQUESTED_RANGE_NOT_SATISFIABLE
+#endif
+#ifndef MHD_HTTP_PAYLOAD_TOO_LARGE
+#define MHD_HTTP_PAYLOAD_TOO_LARGE MHD_HTTP_REQUEST_ENTITY_TOO_LARGE
+#endif
+
+// the most reserved for a POST body up front, with its NUL the largest pooled buffer
+#define BODY_RESERVE_MAX (1024 * 1024 - 1)
+
+// the reply size a handler starts out with, before it has answered anything
+#define RESPONSE_SIZE_HINT (4 * 1024)
 
 #define _cleanup_(fn) __attribute__((__cleanup__(fn)))
 
 typedef struct HttpRequest HttpRequest;
+typedef struct HttpRoute HttpRoute;
 
 typedef enum { UNDEFINED, GET, POST, POST_FILE } ConnectionType;
 
 struct HttpServer {
         struct MHD_Daemon *daemon;
         sd_event_source *http_event;
-        HttpGetHandler **get_handlers;
-        HttpPostHandler **post_handlers;
+        sd_event_source *run_event;     // runs MHD once control is back in the loop
+        HttpRoute *routes;
         void *userdata;
-        const char *www_dir;
+        AssetIndex *assets;     // of the www directory
+        int compression_level;  // 0 if replies are never compressed
+        size_t compression_threshold;
+        size_t max_body_size;   // of POST requests, 0 for no limit
+        int upload_dir_fd;      // where /filepost stores files
+        uint64_t upload_max_size;       // of a whole upload request, 0 for no limit
+        size_t upload_buffer_size;      // of the post processor
+};
+
+/* A node of the route trie, one per path segment. A request is dispatched
+ * to the deepest node along its path that has a handler for its method. */
+struct HttpRoute {
+        char *segment;          // NULL for the root
+        HttpRoute **children;
+        size_t n_children;
+        size_t n_alloced_children;
+        HttpGetHandler *get_handler;
+        HttpPostHandler *post_handler;
+        // typical reply size of each handler
+        size_t get_size_hint;
+        size_t post_size_hint;
 };
 
 struct HttpRequest {
-        FILE *f;  // memstream buffer or file written to disk
-        // memstream buffer
-        char *body;
-        size_t size;
-        // or post processor
+        HttpServer *server;
+        // POST body, allocated up front if the client sent a Content-Length
+        Buffer body;
+        bool body_too_large;    // the rest of the body is discarded
+        // or post processor that streams files to the upload directory
         struct MHD_PostProcessor *postprocessor;
+        Upload *upload;         // the file being received
+        unsigned n_uploads;     // files stored so far
+        uint64_t upload_size;   // of those files and the current one
+        uint64_t received;      // bytes of the request body
+        int upload_status;      // the HTTP error once an upload failed, 0 before
+        struct timespec start;
         // shortcut for strcmp(method)
         ConnectionType conn_type;
+        // everything that lives exactly as long as the request
+        Arena *arena;
 };
 
 struct HttpResponse {
         struct MHD_Connection *connection;
+        HttpServer *server;
+        Arena *arena;   // owned by the request
 
-        FILE *f;
-        char *body;
-        size_t size;
+        Buffer body;    // from the buffer pool
+        FILE *f;        // writes into body
+        size_t *size_hint;      // of the route that answers, or NULL
 
         char *content_type;
 
+        char **header_names;
+        char **header_values;
+        size_t n_headers;
+        size_t n_alloced_headers;
+
         void *user_data;
         void (*free_func)(void *);
 };
 
+// Compresses a finished body while MHD sends it, without a compressed copy.
+typedef struct {
+        z_stream zstream;
+        char *body;
+} DeflateStream;
 
-static const char *get_extension(const char *path) {
-        const char *dot = strrchr(path, '.');
-        if (!dot) {
-                return dot;
-        } else {
-                return dot + 1;
-        }
-}
+struct HttpStream {
+        HttpServer *server;
+        struct MHD_Connection *connection;
+        HttpStreamReadFunc *read_func;
+        void *userdata;
+        void (*free_func)(void *);
+        bool suspended;
+};
 
-static ssize_t file_reader_callback (void *cls, uint64_t pos, char *buf, size_t max) {
-        FILE *file = cls;
 
-        (void)  fseek (file, pos, SEEK_SET);
-        return fread (buf, 1, max, file);
-}
+static void http_response_free(HttpResponse *response) {
+        if (response->f)
+                fclose(response->f);
+        buffer_pool_release(response->body.data);
+        free(response->content_type);
+
+        for (size_t i = 0; i < response->n_headers; i++) {
+                free(response->header_names[i]);
+                free(response->header_values[i]);
+        }
+        free(response->header_names);
+        free(response->header_values);
 
-static void file_free_callback (void *cls) {
-        FILE *file = cls;
-        fclose (file);
+        if (response->free_func)
+                response->free_func(response->user_data);
+        free(response);
 }
 
-static void free_full_path(char** full_path) {
-        if(*full_path)
-                free(*full_path);
+static void http_response_apply_headers(HttpResponse *response, struct MHD_Response *mhd_response) {
+        for (size_t i = 0; i < response->n_headers; i++)
+                MHD_add_response_header(mhd_response, response->header_names[i], response->header_values[i]);
 }
 
 
@@ -99,133 +158,291 @@ void http_suspend_connection(HttpResponse *response){
         MHD_suspend_connection(response->connection);
 }
 
+// true if a comma separated list of entity tags contains etag, weak tags compare equal
+static bool etag_list_matches(const char *list, const char *etag) {
+        size_t etag_len = strlen(etag);
+
+        for (const char *p = list; p && *p; p = strchr(p, ',')) {
+                size_t len;
+
+                p += strspn(p, ", \t");
+                if (*p == '*')
+                        return true;
+                if (strncmp(p, "W/", 2) == 0)
+                        p += 2;
+
+                len = strcspn(p, ", \t");
+                if (len == etag_len && strncmp(p, etag, len) == 0)
+                        return true;
+
+                p += len;
+        }
+
+        return false;
+}
+
+static bool parse_uint64(const char **p, uint64_t *valuep) {
+        char *end;
+
+        if (!isdigit((unsigned char)**p))
+                return false;
+
+        errno = 0;
+        *valuep = strtoull(*p, &end, 10);
+        if (errno != 0)
+                return false;
+
+        *p = end;
+        return true;
+}
+
+/* Parses a "bytes=first-last", "bytes=first-" or "bytes=-suffix" Range.
+ * Returns 1 for a range to send, 0 if the whole file is sent instead and
+ * -ERANGE if the range lies outside the file. Multiple ranges are answered
+ * with the whole file, which the RFC allows. */
+static int parse_range(const char *range, uint64_t size, uint64_t *offsetp, uint64_t *lengthp) {
+        const char *p;
+        uint64_t first, last;
+
+        if (strncmp(range, "bytes=", 6) != 0 || strchr(range, ','))
+                return 0;
+
+        p = range + 6;
+        if (*p == '-') {
+                p += 1;
+                if (!parse_uint64(&p, &last) || *p != '\0')
+                        return 0;
+                if (last == 0 || size == 0)
+                        return -ERANGE;
+
+                *offsetp = last < size ? size - last : 0;
+                *lengthp = size - *offsetp;
+                return 1;
+        }
+
+        if (!parse_uint64(&p, &first) || *p != '-')
+                return 0;
+
+        p += 1;
+        if (*p == '\0')
+                last = UINT64_MAX;
+        else if (!parse_uint64(&p, &last) || *p != '\0' || last < first)
+                return 0;
+
+        if (first >= size)
+                return -ERANGE;
+
+        *offsetp = first;
+        *lengthp = (last < size ? last + 1 : size) - first;
+        return 1;
+}
+
+static void asset_add_headers(struct MHD_Response *mhd_response, const Asset *asset,
+                              const char *etag, const char *last_modified) {
+        MHD_add_response_header(mhd_response, "ETag", etag);
+        MHD_add_response_header(mhd_response, "Last-Modified", last_modified);
+        if (asset->variants[ASSET_ENCODING_GZIP].exists || asset->variants[ASSET_ENCODING_BROTLI].exists)
+                MHD_add_response_header(mhd_response, "Vary", "Accept-Encoding");
+        if (asset->immutable)
+                MHD_add_response_header(mhd_response, "Cache-Control", "public, max-age=31536000, immutable");
+}
+
+// the connection of a file request is never suspended
+static void file_response_queue(HttpResponse *response, int status, struct MHD_Response *mhd_response) {
+        http_response_apply_headers(response, mhd_response);
+
+        if (MHD_queue_response(response->connection, status, mhd_response) != MHD_YES)
+                log_err("Enqueueing failed!");
+
+        MHD_destroy_response(mhd_response);
+        http_response_free(response);
+}
+
 static HttpServerHandlerStatus handle_get_file(void *cls, const char *url, HttpResponse *response) {
         HttpServer *server = cls;
-        _cleanup_(free_full_path) char *full_path = NULL;
-        struct stat path_stat;
-        FILE *file;
-        const char *content_type = NULL;
+        const Asset *asset;
+        AssetVariant opened;
+        const AssetVariant *variant = &opened;
+        AssetEncoding encoding;
+        struct MHD_Response *mhd_response;
+        const char *header;
+        char etag[64], last_modified[64];
+        struct tm tm;
+        uint64_t offset = 0, length;
+        int status = MHD_HTTP_OK;
+        int fd;
+        int ret;
 
         log_info("handle_get_file for URL: %s", url);
 
-        // prepend www folder
-        full_path = malloc(strlen(server->www_dir) + strlen(url) + 12); // leave enough space to append "/index.html" if necessary.
+        asset = asset_index_lookup(server->assets, url);
+        if (!asset) {
+                http_response_end(response, MHD_HTTP_NOT_FOUND);
+                return HTTP_SERVER_HANDLED_ERROR;
+        }
 
-        strcpy(full_path, server->www_dir);
-        strcat(full_path, url);
+        encoding = asset_choose_encoding(asset, http_response_get_header(response, "Accept-Encoding"));
 
-        if (access(full_path, R_OK) == -1) {
-                http_response_end(response, 404);
+        // the headers describe the file that is sent, not the one that was indexed
+        fd = asset_open(server->assets, asset, encoding, &opened);
+        if (fd < 0) {
+                log_warning("Cannot open %s: %s", asset->path, strerror(-fd));
+                http_response_end(response, MHD_HTTP_NOT_FOUND);
                 return HTTP_SERVER_HANDLED_ERROR;
         }
+        length = variant->size;
+
+        // every encoding is a representation of its own
+        snprintf(etag, sizeof(etag), "\"%" PRIx64 "-%" PRIx64 "%s%s\"", variant->size,
+                 (uint64_t)variant->mtime.tv_sec * 1000000000 + variant->mtime.tv_nsec,
+                 encoding ? "-" : "", encoding ? asset_encoding_to_string(encoding) : "");
+        strftime(last_modified, sizeof(last_modified), "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&variant->mtime.tv_sec, &tm));
+
+        // If-Modified-Since only counts without If-None-Match
+        header = http_response_get_header(response, "If-None-Match");
+        if (header && etag_list_matches(header, etag)) {
+                status = MHD_HTTP_NOT_MODIFIED;
+        } else if (!header && (header = http_response_get_header(response, "If-Modified-Since"))) {
+                struct tm since = {};
+                const char *end = strptime(header, "%a, %d %b %Y %H:%M:%S GMT", &since);
+
+                if (end && *end == '\0' && variant->mtime.tv_sec <= timegm(&since))
+                        status = MHD_HTTP_NOT_MODIFIED;
+        }
 
-        lstat(full_path, &path_stat);
-        if (S_ISDIR(path_stat.st_mode)) {
-                strcat(full_path, "/index.html");
+        if (status == MHD_HTTP_NOT_MODIFIED) {
+                close(fd);
+                mhd_response = MHD_create_response_from_buffer(0, NULL, MHD_RESPMEM_PERSISTENT);
+                asset_add_headers(mhd_response, asset, etag, last_modified);
+                file_response_queue(response, status, mhd_response);
+                return HTTP_SERVER_HANDLED_SUCCESS;
         }
 
-        lstat(full_path, &path_stat);
-        if (S_ISREG(path_stat.st_mode)) {
-                const char *extension = get_extension(full_path);
-
-                if (strcmp(extension, "html") == 0) {
-                        content_type = CONTENT_TYPE_HTML;
-                } else if (strcmp(extension, "css") == 0) {
-                        content_type = CONTENT_TYPE_CSS;
-                } else if (strcmp(extension, "js") == 0) {
-                        content_type = CONTENT_TYPE_JS;
-                } else if (strcmp(extension, "json") == 0) {
-                        content_type = CONTENT_TYPE_JSON;
-                } else if (strcmp(extension, "map") == 0) {
-                        content_type = CONTENT_TYPE_MAP;
-                } else if (strcmp(extension, "ico") == 0) {
-                        content_type = CONTENT_TYPE_ICO;
-                } else if (strcmp(extension, "png") == 0) {
-                        content_type = CONTENT_TYPE_PNG;
-                } else if (strcmp(extension, "jpg") == 0) {
-                        content_type = CONTENT_TYPE_JPG;
-                } else if (strcmp(extension, "gif") == 0) {
-                        content_type = CONTENT_TYPE_GIF;
-                } else if (strcmp(extension, "svg") == 0) {
-                        content_type = CONTENT_TYPE_SVG;
-                } else if (strcmp(extension, "ttf") == 0) {
-                        content_type = CONTENT_TYPE_TTF;
-                } else if (strcmp(extension, "woff2") == 0) {
-                        content_type = CONTENT_TYPE_WOFF2;
-                } else {
-                        // content type not recognized else
-                        log_warning("Content type is unknown");
-                        http_response_end(response, MHD_HTTP_NOT_FOUND);
-                        return HTTP_SERVER_HANDLED_ERROR;
+        // a Range only applies to the representation named by If-Range
+        header = http_response_get_header(response, "Range");
+        if (header) {
+                const char *if_range = http_response_get_header(response, "If-Range");
+
+                if (!if_range || strcmp(if_range, etag) == 0 || strcmp(if_range, last_modified) == 0) {
+                        ret = parse_range(header, variant->size, &offset, &length);
+                        if (ret == -ERANGE) {
+                                char content_range[64];
+
+                                snprintf(content_range, sizeof(content_range), "bytes */%" PRIu64, variant->size);
+                                http_response_add_header(response, "Content-Range", content_range);
+                                close(fd);
+                                http_response_end(response, MHD_HTTP_RANGE_NOT_SATISFIABLE);
+                                return HTTP_SERVER_HANDLED_ERROR;
+                        }
+                        if (ret > 0)
+                                status = MHD_HTTP_PARTIAL_CONTENT;
                 }
         }
 
-        file = fopen (full_path, "rb");
-        if (file == NULL) {
-                // content type not recognized
+        // MHD closes the descriptor once the file has been sent
+        mhd_response = MHD_create_response_from_fd_at_offset64(length, fd, offset);
+        if (mhd_response == NULL) {
+                close(fd);
+                log_err("Error in handle_get_file while handling path: %s (file found).", asset->path);
                 http_response_end(response, MHD_HTTP_INTERNAL_SERVER_ERROR);
                 return HTTP_SERVER_HANDLED_ERROR;
-        } else {
-                struct MHD_Response *mhd_response;
-                int ret;
-
-                if (response->f)
-                               fclose(response->f);
-
-                mhd_response = MHD_create_response_from_callback (path_stat.st_size, 32 * 1024,     /* 32k page size */
-                                &file_reader_callback, file, &file_free_callback);
-                if (mhd_response == NULL) {
-                        fclose (file);
-                        log_err("Error in handle_get_file while handling path: %s (file found).", full_path);
-                        return HTTP_SERVER_HANDLED_ERROR;
-                }
+        }
 
-                if(content_type) {
-                        MHD_add_response_header(mhd_response, "Content-Type", content_type);
-                }
+        MHD_add_response_header(mhd_response, "Content-Type", asset->content_type);
+        if (encoding != ASSET_ENCODING_IDENTITY)
+                MHD_add_response_header(mhd_response, "Content-Encoding", asset_encoding_to_string(encoding));
+        MHD_add_response_header(mhd_response, "Accept-Ranges", "bytes");
+        if (status == MHD_HTTP_PARTIAL_CONTENT) {
+                char content_range[96];
+
+                snprintf(content_range, sizeof(content_range), "bytes %" PRIu64 "-%" PRIu64 "/%" PRIu64,
+                         offset, offset + length - 1, variant->size);
+                MHD_add_response_header(mhd_response, "Content-Range", content_range);
+        }
+        asset_add_headers(mhd_response, asset, etag, last_modified);
 
-                ret = MHD_queue_response (response->connection, MHD_HTTP_OK, mhd_response);
-                if(ret != MHD_YES)
-                        log_err("Enqueueing failed!");
-                log_debug("file served for URL: %s, path: %s", url, full_path);
+        log_debug("file served for URL: %s, path: %s", url, asset->path);
+        file_response_queue(response, status, mhd_response);
 
-                MHD_destroy_response (mhd_response);
-                if (response->free_func)
-                        response->free_func(response->user_data);
-                free(response);
+        return HTTP_SERVER_HANDLED_SUCCESS;
+}
 
-                return HTTP_SERVER_HANDLED_SUCCESS;
+
+static int http_request_finish_upload(HttpRequest *request) {
+        _cleanup_(upload_freep) Upload *upload = request->upload;
+        int r;
+
+        if (!upload)
+                return 0;
+        request->upload = NULL;
+
+        r = upload_finish(upload);
+        if (r < 0) {
+                log_err("Storing upload %s failed: %s", upload_get_filename(upload), strerror(-r));
+                request->upload_status = MHD_HTTP_INTERNAL_SERVER_ERROR;
+                return r;
         }
-}
 
+        log_info("Stored upload %s (%" PRIu64 " bytes)", upload_get_filename(upload), upload_get_size(upload));
+        request->n_uploads += 1;
+        return 0;
+}
 
+// form fields without a filename are ignored, every file is stored under its own name
 static int iterate_post (void *cls, enum MHD_ValueKind kind, const char *key,
                 const char *filename, const char *content_type, const char *transfer_encoding,
                 const char *data, uint64_t off, size_t size) {
         HttpRequest *request = cls;
-        _cleanup_(free_full_path) char *full_path = NULL;
+        int r;
+
+        if (request->upload_status != 0)
+                return MHD_NO;
+        if (!filename)
+                return MHD_YES;
 
-        if (! request->f) {
-                if(asprintf(&full_path, "/tmp/%s", filename) < 0) {
-                        log_crit("Concatenation of filename failed");
+        // a file may start with an empty piece, which does not make it a new one
+        if (!request->upload || (off == 0 && (upload_get_size(request->upload) > 0 ||
+                                              strcmp(upload_get_filename(request->upload), filename) != 0))) {
+                if (http_request_finish_upload(request) < 0)
                         return MHD_NO;
-                }
-                request->f = fopen (full_path, "w+");
-                if (!request->f) {
-                        log_crit("Opening file %s failed", full_path);
+
+                r = upload_new(&request->upload, request->server->upload_dir_fd, filename);
+                if (r < 0) {
+                        log_err("Cannot receive upload %s: %s", filename, strerror(-r));
+                        request->upload_status = r == -EINVAL ? MHD_HTTP_BAD_REQUEST : MHD_HTTP_INTERNAL_SERVER_ERROR;
                         return MHD_NO;
                 }
         }
 
-        if (size > 0) {
-                if (! fwrite (data, sizeof (char), size, request->f)) {
-                        log_crit("Writing to file %s failed", full_path);
-                        return MHD_NO;
-                }
+        r = upload_write(request->upload, data, size);
+        if (r < 0) {
+                log_err("Writing upload %s failed: %s", filename, strerror(-r));
+                request->upload_status = r == -ENOSPC || r == -EDQUOT ?
+                        MHD_HTTP_INSUFFICIENT_STORAGE : MHD_HTTP_INTERNAL_SERVER_ERROR;
+                return MHD_NO;
         }
+        request->upload_size += size;
+
         return MHD_YES;
 }
 
+// reports how long the upload took, from the headers to the end of the body
+static void http_request_end_upload(HttpRequest *request, HttpResponse *response) {
+        struct timespec now;
+        double seconds;
+        Buffer *body;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        seconds = (now.tv_sec - request->start.tv_sec) + (now.tv_nsec - request->start.tv_nsec) / 1e9;
+
+        body = http_response_get_buffer(response, "application/json");
+        buffer_printf(body, "{\"result\":\"success\",\"files\":%u,\"bytes\":%" PRIu64
+                      ",\"seconds\":%.6f,\"bytes_per_second\":%.0f}",
+                      request->n_uploads, request->upload_size, seconds,
+                      seconds > 0 ? request->upload_size / seconds : 0);
+        http_response_end(response, MHD_HTTP_OK);
+}
+
 
 static void request_completed(void *cls, struct MHD_Connection *connection,
                               void **connection_cls, enum MHD_RequestTerminationCode toe) {
@@ -233,16 +450,130 @@ static void request_completed(void *cls, struct MHD_Connection *connection,
 
         log_debug("request_completed");
 
-        if (request->f)
-                fclose(request->f);
-
         if (request->postprocessor)
                 MHD_destroy_post_processor (request->postprocessor);
 
-        free(request->body);
-        free(request);
+        // an upload that did not finish is dropped
+        if (request->upload)
+                upload_free(request->upload);
+
+        if (request->arena)
+                arena_free(request->arena);
 
+        buffer_pool_release(request->body.data);
         log_debug("Completed connection request 0x%p",(void*)request);
+        free(request);
+}
+
+static HttpRoute * http_route_new(const char *segment, size_t len) {
+        HttpRoute *route;
+
+        route = calloc(1, sizeof(HttpRoute));
+        if (segment)
+                route->segment = strndup(segment, len);
+        route->get_size_hint = RESPONSE_SIZE_HINT;
+        route->post_size_hint = RESPONSE_SIZE_HINT;
+
+        return route;
+}
+
+static void http_route_free(HttpRoute *route) {
+        for (size_t i = 0; i < route->n_children; i++)
+                http_route_free(route->children[i]);
+
+        free(route->children);
+        free(route->segment);
+        free(route);
+}
+
+static HttpRoute * http_route_child(HttpRoute *route, const char *segment, size_t len) {
+        for (size_t i = 0; i < route->n_children; i++) {
+                HttpRoute *child = route->children[i];
+
+                if (strncmp(child->segment, segment, len) == 0 && child->segment[len] == '\0')
+                        return child;
+        }
+
+        return NULL;
+}
+
+// the route for prefix, which is created along with its parents
+static HttpRoute * http_route_add(HttpRoute *route, const char *prefix) {
+        for (const char *p = prefix; *p; ) {
+                HttpRoute *child;
+                size_t len;
+
+                p += strspn(p, "/");
+                len = strcspn(p, "/");
+                if (len == 0)
+                        break;
+
+                child = http_route_child(route, p, len);
+                if (!child) {
+                        if (route->n_children == route->n_alloced_children) {
+                                route->n_alloced_children = route->n_alloced_children ? route->n_alloced_children * 2 : 4;
+                                route->children = realloc(route->children, route->n_alloced_children * sizeof(HttpRoute *));
+                        }
+                        child = http_route_new(p, len);
+                        route->children[route->n_children++] = child;
+                }
+
+                route = child;
+                p += len;
+        }
+
+        return route;
+}
+
+/* Walks the trie along the segments of url. *restp is set to the part of url
+ * after the matching route, which is empty or starts with a slash. */
+static HttpRoute * http_route_find(HttpRoute *route, const char *url, ConnectionType type, const char **restp) {
+        HttpRoute *match = NULL;
+        const char *p = url;
+
+        for (;;) {
+                size_t len;
+
+                if (type == GET ? route->get_handler != NULL : route->post_handler != NULL) {
+                        match = route;
+                        *restp = p;
+                }
+
+                if (*p != '/')
+                        break;
+
+                len = strcspn(p + 1, "/");
+                if (len == 0)
+                        break;
+
+                route = http_route_child(route, p + 1, len);
+                if (!route)
+                        break;
+
+                p += 1 + len;
+        }
+
+        return match;
+}
+
+void http_server_add_get_route(HttpServer *server, const char *prefix, HttpGetHandler *handler) {
+        http_route_add(server->routes, prefix)->get_handler = handler;
+}
+
+void http_server_add_post_route(HttpServer *server, const char *prefix, HttpPostHandler *handler) {
+        http_route_add(server->routes, prefix)->post_handler = handler;
+}
+
+// answers a request that has not been suspended with an empty reply
+static int http_queue_status(struct MHD_Connection *connection, int status) {
+        struct MHD_Response *mhd_response;
+        int ret;
+
+        mhd_response = MHD_create_response_from_buffer(0, NULL, MHD_RESPMEM_PERSISTENT);
+        ret = MHD_queue_response(connection, status, mhd_response);
+        MHD_destroy_response(mhd_response);
+
+        return ret;
 }
 
 static int handle_request(void *cls, struct MHD_Connection *connection,
@@ -253,11 +584,16 @@ static int handle_request(void *cls, struct MHD_Connection *connection,
         HttpRequest *request = *connection_cls;
         HttpResponse *response;
         HttpServerHandlerStatus handler_r = HTTP_SERVER_HANDLED_IGNORED;
+        HttpRoute *route;
+        const char *rest;
         const char filepost_url[] = "/filepost";
 
         // new connection
         if (request == NULL) {
                 request = calloc(1, sizeof(HttpRequest));
+                request->arena = arena_new();
+                request->server = server;
+                clock_gettime(CLOCK_MONOTONIC, &request->start);
                 *connection_cls = request;
 
                 if (strcasecmp(method, MHD_HTTP_METHOD_GET) == 0){
@@ -272,12 +608,33 @@ static int handle_request(void *cls, struct MHD_Connection *connection,
                         request->conn_type = UNDEFINED;
                 }
 
-                /* Support file upload to /tmp folder (multipart/form-data , application/x-www-form-urlencoded) */
+                /* Support file upload to the upload directory (multipart/form-data , application/x-www-form-urlencoded) */
                 if ( request->conn_type == POST_FILE) {
-                        request->postprocessor = MHD_create_post_processor(connection, POSTBUFFERSIZE, iterate_post, (void *) request);
+                        request->postprocessor = MHD_create_post_processor(connection, server->upload_buffer_size, iterate_post, (void *) request);
                         if (request->postprocessor == NULL) {
-                                log_crit("Cannot allocate post processor");
-                                return MHD_YES;
+                                log_err("Upload to %s is not a form", url);
+                                return http_queue_status(connection, MHD_HTTP_UNSUPPORTED_MEDIA_TYPE);
+                        }
+                }
+
+                if (request->conn_type == POST || request->conn_type == POST_FILE) {
+                        const char *content_length;
+                        uint64_t length;
+
+                        content_length = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_CONTENT_LENGTH);
+                        if (content_length && parse_uint64(&content_length, &length) && length > 0) {
+                                uint64_t max = request->conn_type == POST ? server->max_body_size : server->upload_max_size;
+
+                                // rejected before any of the body is read
+                                if (max > 0 && length > max) {
+                                        log_warning("POST body of %" PRIu64 " bytes to %s is too large", length, url);
+                                        return http_queue_status(connection, MHD_HTTP_PAYLOAD_TOO_LARGE);
+                                }
+
+                                /* Only what the client claims up to a limit is reserved, beyond
+                                 * that the body grows as it arrives. Uploads go to disk. */
+                                if (request->conn_type == POST)
+                                        buffer_pool_reserve(&request->body, length < BODY_RESERVE_MAX ? length : BODY_RESERVE_MAX);
                         }
                 }
 
@@ -286,58 +643,80 @@ static int handle_request(void *cls, struct MHD_Connection *connection,
         }
 
         if (*upload_data_size) {
-                // If there is a postprocessor run the file upload
+                // If there is a postprocessor run the file upload, after a failure the rest is discarded
                 if(request->postprocessor != NULL) {
-                        if (MHD_post_process (request->postprocessor, upload_data, *upload_data_size) != MHD_YES) {
-                                log_crit("failure while post processing data.");
-                                return MHD_YES;
+                        request->received += *upload_data_size;
+                        if (request->upload_status == 0 && server->upload_max_size > 0 &&
+                            request->received > server->upload_max_size) {
+                                log_warning("Upload to %s is too large", url);
+                                request->upload_status = MHD_HTTP_PAYLOAD_TOO_LARGE;
                         }
-                // otherwise store the post data into a memstream object to be used for a dbus call
-                } else {
-                        if (!request->f) {
-                                log_debug("upload start (%d bytes)", *upload_data_size);
-                                request->f = open_memstream(&request->body, &request->size);
-                        } else {
-                                log_debug("upload continue (%d bytes)", *upload_data_size);
+                        if (request->upload_status == 0 &&
+                            MHD_post_process (request->postprocessor, upload_data, *upload_data_size) != MHD_YES) {
+                                log_err("failure while post processing data.");
+                                if (request->upload_status == 0)
+                                        request->upload_status = MHD_HTTP_BAD_REQUEST;
+                        }
+                // otherwise collect the body for the handler, up to the limit for chunked uploads
+                } else if (!request->body_too_large) {
+                        log_debug("upload (%zu bytes)", *upload_data_size);
+                        if ((server->max_body_size > 0 && request->body.size + *upload_data_size > server->max_body_size) ||
+                            buffer_append(&request->body, upload_data, *upload_data_size) < 0) {
+                                log_warning("POST body to %s is too large", url);
+                                request->body_too_large = true;
+                                buffer_pool_release(request->body.data);
+                                request->body = (Buffer){};
                         }
-                        fwrite(upload_data, 1, *upload_data_size, request->f);
                 }
                 *upload_data_size = 0;
                 return MHD_YES;
         }
 
-        if (request->f) {
-                fclose(request->f);
-                request->f = NULL;
-        }
-
         response = calloc(1, sizeof(HttpResponse));
         response->connection = connection;
+        response->arena = request->arena;
+        response->server = server;
 
         if (request->conn_type == GET) {
-                for(HttpGetHandler **handler_ptr = server->get_handlers; *handler_ptr != NULL; handler_ptr++) {
-                        handler_r = (*handler_ptr)(url, response, server->userdata);
-                        if(handler_r != HTTP_SERVER_HANDLED_IGNORED) {
-                                break;
-                        }
+                route = http_route_find(server->routes, url, GET, &rest);
+                if (route) {
+                        response->size_hint = &route->get_size_hint;
+                        handler_r = route->get_handler(rest, response, server->userdata);
                 }
-                // If no get handler is responsible, the file handler is called.
+                // If no route is responsible, the file handler is called.
                 if(handler_r == HTTP_SERVER_HANDLED_IGNORED) {
+                        response->size_hint = NULL;
                         log_debug("Calling the file handler for GET request to %s.", url);
                         handler_r = handle_get_file(cls, url, response);
                 }
+        } else if (request->conn_type == POST && request->body_too_large) {
+                http_response_end(response, MHD_HTTP_PAYLOAD_TOO_LARGE);
         } else if (request->conn_type == POST) {
-                for(HttpPostHandler **handler_ptr = server->post_handlers; *handler_ptr != NULL; handler_ptr++) {
-                        handler_r = (*handler_ptr)(url, request->body, request->size, response, server->userdata);
-                        if(handler_r != HTTP_SERVER_HANDLED_IGNORED) {
-                                break;
-                        }
+                route = http_route_find(server->routes, url, POST, &rest);
+                if (route) {
+                        response->size_hint = &route->post_size_hint;
+                        handler_r = route->post_handler(rest, request->body.data, request->body.size, response, server->userdata);
+                }
+                if (handler_r == HTTP_SERVER_HANDLED_IGNORED) {
+                        log_debug("No route for POST request to %s.", url);
+                        http_response_end(response, MHD_HTTP_NOT_FOUND);
                 }
         } else if(request->conn_type == POST_FILE) {
-                FILE *f = http_response_get_stream(response, "application/json");
-                fputs("{\"result\":\"success\"}", f);
                 log_debug("Finalizing file upload");
-                http_response_end(response, MHD_HTTP_OK);
+                // the post processor passes on what it still holds when it is destroyed
+                if (MHD_destroy_post_processor(request->postprocessor) != MHD_YES && request->upload_status == 0)
+                        request->upload_status = MHD_HTTP_BAD_REQUEST;
+                request->postprocessor = NULL;
+
+                if (request->upload_status == 0 && http_request_finish_upload(request) == 0 && request->n_uploads == 0) {
+                        log_err("Upload to %s without a file", url);
+                        request->upload_status = MHD_HTTP_BAD_REQUEST;
+                }
+
+                if (request->upload_status != 0)
+                        http_response_end(response, request->upload_status);
+                else
+                        http_request_end_upload(request, response);
         } else {
                 log_err("Handling of %s is not implemented.", method);
                 http_response_end(response, MHD_HTTP_NOT_ACCEPTABLE);
@@ -362,6 +741,18 @@ static int handle_http_event(sd_event_source *event, int fd, uint32_t revents, v
         return 1;
 }
 
+static int handle_run_event(sd_event_source *event, void *userdata) {
+        log_debug("MHD_run, handle_run_event");
+        mhd_run_to_end(userdata);
+        return 1;
+}
+
+/* Running MHD may complete any connection, whose free callbacks then call
+ * back into the caller. Code outside MHD's own callbacks runs it from here. */
+static void http_server_run_later(HttpServer *server) {
+        sd_event_source_set_enabled(server->run_event, SD_EVENT_ONESHOT);
+}
+
 static void http_server_log(void * arg, const char * fmt, va_list ap) {
         printf("microhttpd: ");
         vprintf(fmt, ap);
@@ -373,7 +764,6 @@ static bool ipv6_test(void) {
 }
 
 int http_server_new(HttpServer **serverp, uint16_t port, sd_event *loop,
-                    HttpGetHandler **get_handlers, HttpPostHandler **post_handlers,
                     void *userdata, const char *www_dir) {
         _cleanup_(http_server_freep) HttpServer *server = NULL;
         int flags;
@@ -381,10 +771,14 @@ int http_server_new(HttpServer **serverp, uint16_t port, sd_event *loop,
         int r;
 
         server = calloc(1, sizeof(HttpServer));
-        server->get_handlers = get_handlers;
-        server->post_handlers = post_handlers;
+        server->routes = http_route_new(NULL, 0);
         server->userdata = userdata;
-        server->www_dir = www_dir;
+        server->upload_dir_fd = -1;
+        server->upload_buffer_size = UPLOAD_BUFFER_SIZE;
+
+        r = asset_index_new(&server->assets, www_dir, loop);
+        if (r < 0)
+                return r;
 
         flags = MHD_ALLOW_SUSPEND_RESUME |
                 MHD_USE_PEDANTIC_CHECKS |
@@ -418,6 +812,11 @@ int http_server_new(HttpServer **serverp, uint16_t port, sd_event *loop,
         if (r < 0)
                 return r;
 
+        r = sd_event_add_defer(loop, &server->run_event, handle_run_event, server->daemon);
+        if (r < 0)
+                return r;
+        sd_event_source_set_enabled(server->run_event, SD_EVENT_OFF);
+
         *serverp = server;
         server = NULL;
 
@@ -427,10 +826,22 @@ int http_server_new(HttpServer **serverp, uint16_t port, sd_event *loop,
 HttpServer * http_server_free(HttpServer *server) {
         if (server->http_event)
                 sd_event_source_unref(server->http_event);
+        if (server->run_event)
+                sd_event_source_unref(server->run_event);
 
         if (server->daemon)
                 MHD_stop_daemon(server->daemon);
 
+        // every response has been destroyed along with the daemon
+        buffer_pool_flush();
+
+        if (server->assets)
+                asset_index_free(server->assets);
+
+        if (server->routes)
+                http_route_free(server->routes);
+        if (server->upload_dir_fd >= 0)
+                close(server->upload_dir_fd);
         free(server);
         return NULL;
 }
@@ -440,20 +851,10 @@ void http_server_freep(HttpServer **serverp) {
                 http_server_free(*serverp);
 }
 
-void http_response_end(HttpResponse *response, int status) {
-        struct MHD_Response *mhd_response;
-        const union MHD_ConnectionInfo *info;
+static void http_response_queue(HttpResponse *response, int status, struct MHD_Response *mhd_response) {
         int ret;
 
-        if (response->f)
-                fclose(response->f);
-
-        mhd_response = MHD_create_response_from_buffer(response->size, (void *)response->body, MHD_RESPMEM_MUST_FREE);
-
-        if (response->content_type) {
-                MHD_add_response_header(mhd_response, "Content-Type", response->content_type);
-                free(response->content_type);
-        }
+        http_response_apply_headers(response, mhd_response);
 
         log_debug("Enqueueing response and resuming connection 0x%p", (void*)(&(response->connection)));
         ret = MHD_queue_response(response->connection, status, mhd_response);
@@ -463,23 +864,231 @@ void http_response_end(HttpResponse *response, int status) {
         log_debug("Resuming connection");
         MHD_resume_connection(response->connection);
 
-        info = MHD_get_connection_info(response->connection, MHD_CONNECTION_INFO_DAEMON);
-        log_debug("mhd_run_to_end, http_response_end 1");
-        mhd_run_to_end(info->daemon);
+        // replies are often sent from bus callbacks, which MHD must not run inside of
+        http_server_run_later(response->server);
 
         MHD_destroy_response(mhd_response);
+        http_response_free(response);
+}
 
-        if (response->free_func)
-                response->free_func(response->user_data);
-        free(response);
+static ssize_t deflate_reader_callback(void *cls, uint64_t pos, char *buf, size_t max) {
+        DeflateStream *stream = cls;
+        int r;
+
+        stream->zstream.next_out = (Bytef *)buf;
+        stream->zstream.avail_out = max;
+
+        // all input is there from the start, so every call can finish
+        r = deflate(&stream->zstream, Z_FINISH);
+        if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR)
+                return MHD_CONTENT_READER_END_WITH_ERROR;
+
+        if (r == Z_STREAM_END && stream->zstream.avail_out == max)
+                return MHD_CONTENT_READER_END_OF_STREAM;
+
+        return max - stream->zstream.avail_out;
+}
+
+static void deflate_free_callback(void *cls) {
+        DeflateStream *stream = cls;
+
+        deflateEnd(&stream->zstream);
+        buffer_pool_release(stream->body);
+        free(stream);
+}
+
+/* Returns a response that sends body gzip or deflate compressed, if the
+ * client accepts that and body is large enough to be worth it. Returns
+ * NULL to send body as it is. */
+static struct MHD_Response * http_response_deflate(HttpResponse *response, char *body, size_t size) {
+        HttpServer *server = response->server;
+        const char *accept_encoding;
+        const char *encoding;
+        struct MHD_Response *mhd_response;
+        DeflateStream *stream;
+        int window_bits;
+
+        if (!server || server->compression_level == 0 || size < server->compression_threshold)
+                return NULL;
+
+        http_response_add_header(response, "Vary", "Accept-Encoding");
+
+        accept_encoding = http_response_get_header(response, "Accept-Encoding");
+        if (accept_encoding_allows(accept_encoding, "gzip")) {
+                encoding = "gzip";
+                window_bits = 16 + MAX_WBITS;
+        } else if (accept_encoding_allows(accept_encoding, "deflate")) {
+                encoding = "deflate";
+                window_bits = MAX_WBITS;
+        } else
+                return NULL;
+
+        stream = calloc(1, sizeof(DeflateStream));
+        if (deflateInit2(&stream->zstream, server->compression_level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                free(stream);
+                return NULL;
+        }
+        stream->zstream.next_in = (Bytef *)body;
+        stream->zstream.avail_in = size;
+
+        mhd_response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, 32 * 1024,
+                        &deflate_reader_callback, stream, &deflate_free_callback);
+        if (!mhd_response) {
+                deflateEnd(&stream->zstream);
+                free(stream);
+                return NULL;
+        }
+        stream->body = body;
+
+        MHD_add_response_header(mhd_response, "Content-Encoding", encoding);
+
+        return mhd_response;
+}
+
+void http_server_set_compression(HttpServer *server, int level, size_t threshold) {
+        server->compression_level = level;
+        server->compression_threshold = threshold;
+}
+
+void http_server_set_max_body_size(HttpServer *server, size_t max) {
+        server->max_body_size = max;
+}
+
+int http_server_set_upload(HttpServer *server, const char *dir, uint64_t max_size, size_t buffer_size) {
+        int fd;
+
+        fd = open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) {
+                int r = -errno;
+
+                log_err("Cannot open upload directory %s: %s", dir, strerror(-r));
+                return r;
+        }
+
+        if (server->upload_dir_fd >= 0)
+                close(server->upload_dir_fd);
+        server->upload_dir_fd = fd;
+        server->upload_max_size = max_size;
+        server->upload_buffer_size = buffer_size;
+
+        return 0;
+}
+
+void http_response_end(HttpResponse *response, int status) {
+        struct MHD_Response *mhd_response;
+        size_t size;
+        char *body;
+
+        if (response->f) {
+                fclose(response->f);
+                response->f = NULL;
+        }
+
+        /* Follows growing replies right away and shrinking ones slowly, so
+         * one small error reply does not undersize the next large result. */
+        if (response->size_hint && response->content_type) {
+                if (response->body.size >= *response->size_hint)
+                        *response->size_hint = response->body.size;
+                else
+                        *response->size_hint -= (*response->size_hint - response->body.size) / 8;
+        }
+
+        // MHD hands the body back to the pool once it has been sent
+        body = buffer_steal(&response->body, &size);
+        mhd_response = http_response_deflate(response, body, size);
+        if (!mhd_response)
+                mhd_response = MHD_create_response_from_buffer_with_free_callback(size, body, buffer_pool_release);
+
+        if (response->content_type)
+                MHD_add_response_header(mhd_response, "Content-Type", response->content_type);
+
+        http_response_queue(response, status, mhd_response);
+}
+
+static ssize_t stream_reader_callback(void *cls, uint64_t pos, char *buf, size_t max) {
+        HttpStream *stream = cls;
+        ssize_t n;
+
+        n = stream->read_func(stream->userdata, buf, max);
+        if (n < 0)
+                return MHD_CONTENT_READER_END_OF_STREAM;
+
+        // nothing to send: park the connection instead of letting MHD poll us
+        if (n == 0 && !stream->suspended) {
+                log_debug("Suspending stream on connection 0x%p", (void*)stream->connection);
+                stream->suspended = true;
+                MHD_suspend_connection(stream->connection);
+        }
+
+        return n;
+}
+
+static void stream_free_callback(void *cls) {
+        HttpStream *stream = cls;
+
+        if (stream->free_func)
+                stream->free_func(stream->userdata);
+        free(stream);
+}
+
+HttpStream * http_response_end_stream(HttpResponse *response, const char *content_type,
+                                      HttpStreamReadFunc *read_func, void *userdata, void (*free_func)(void *)) {
+        struct MHD_Response *mhd_response;
+        HttpStream *stream;
+
+        stream = calloc(1, sizeof(HttpStream));
+        stream->server = response->server;
+        stream->connection = response->connection;
+        stream->read_func = read_func;
+        stream->userdata = userdata;
+        stream->free_func = free_func;
+
+        mhd_response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, 4 * 1024,
+                        &stream_reader_callback, stream, &stream_free_callback);
+        MHD_add_response_header(mhd_response, "Content-Type", content_type);
+        MHD_add_response_header(mhd_response, "Cache-Control", "no-cache");
+
+        http_response_queue(response, MHD_HTTP_OK, mhd_response);
+
+        return stream;
+}
+
+void http_stream_wake(HttpStream *stream) {
+        if (!stream->suspended)
+                return;
+
+        log_debug("Resuming stream on connection 0x%p", (void*)stream->connection);
+        stream->suspended = false;
+        MHD_resume_connection(stream->connection);
+
+        // the stream may end on this run, which must not happen inside the caller
+        http_server_run_later(stream->server);
+}
+
+Buffer * http_response_get_buffer(HttpResponse *response, const char *content_type) {
+        if (!response->content_type) {
+                response->content_type = strdup(content_type);
+                // sized for what this handler usually replies, larger ones grow geometrically from here
+                buffer_pool_reserve(&response->body, response->size_hint ? *response->size_hint : RESPONSE_SIZE_HINT);
+        }
+
+        return &response->body;
+}
+
+static ssize_t response_stream_write(void *cookie, const char *data, size_t size) {
+        if (buffer_append(cookie, data, size) < 0)
+                return 0;
+
+        return size;
 }
 
 FILE * http_response_get_stream(HttpResponse *response, const char *content_type) {
+        static const cookie_io_functions_t functions = { .write = response_stream_write };
+
         if (response->f)
                 return response->f;
 
-        response->f = open_memstream(&response->body, &response->size);
-        response->content_type = strdup(content_type);
+        response->f = fopencookie(http_response_get_buffer(response, content_type), "w", functions);
 
         return response->f;
 }
@@ -492,6 +1101,61 @@ void http_response_set_user_data(HttpResponse *response, void *data, void (*free
         response->free_func = free_func;
 }
 
+Arena * http_response_get_arena(HttpResponse *response) {
+        return response->arena;
+}
+
 void * http_response_get_user_data(HttpResponse *response) {
         return response->user_data;
 }
+
+void http_response_add_header(HttpResponse *response, const char *name, const char *value) {
+        if (response->n_headers == response->n_alloced_headers) {
+                response->n_alloced_headers = response->n_alloced_headers ? response->n_alloced_headers * 2 : 4;
+                response->header_names = realloc(response->header_names, response->n_alloced_headers * sizeof(char *));
+                response->header_values = realloc(response->header_values, response->n_alloced_headers * sizeof(char *));
+        }
+
+        response->header_names[response->n_headers] = strdup(name);
+        response->header_values[response->n_headers] = strdup(value);
+        response->n_headers += 1;
+}
+
+double http_header_quality(const char *header, const char *token) {
+        size_t token_len = strlen(token);
+
+        for (const char *p = header; p && *p; p = strchr(p, ',')) {
+                size_t len;
+
+                p += strspn(p, ", \t");
+                len = strcspn(p, ",; \t");
+                if (len == token_len && strncasecmp(p, token, len) == 0) {
+                        const char *end;
+
+                        p += len;
+                        end = p + strcspn(p, ",");
+
+                        // only the q parameter matters, others may contain "q=" too
+                        while ((p = memchr(p, ';', end - p))) {
+                                p += 1;
+                                p += strspn(p, " \t");
+                                if ((*p == 'q' || *p == 'Q') && p[1] == '=')
+                                        return strtod(p + 2, NULL);
+                        }
+
+                        return 1;
+                }
+
+                p += len;
+        }
+
+        return 0;
+}
+
+const char * http_response_get_header(HttpResponse *response, const char *name) {
+        return MHD_lookup_connection_value(response->connection, MHD_HEADER_KIND, name);
+}
+
+const char * http_response_get_argument(HttpResponse *response, const char *name) {
+        return MHD_lookup_connection_value(response->connection, MHD_GET_ARGUMENT_KIND, name);
+}
@@ -2,27 +2,63 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <sys/types.h>
 #include <systemd/sd-event.h>
 
+#include "arena.h"
+#include "buffer.h"
+
 typedef struct HttpServer HttpServer;
 typedef struct HttpResponse HttpResponse;
+typedef struct HttpStream HttpStream;
 
 
-// return value for http handlers. The server calls available handlers until one handler does not return ignored state.
+// return value for http handlers. A GET handler that ignores a request leaves it to the file server.
 typedef enum{ HTTP_SERVER_HANDLED_SUCCESS, HTTP_SERVER_HANDLED_IGNORED, HTTP_SERVER_HANDLED_ERROR} HttpServerHandlerStatus;
 
 typedef HttpServerHandlerStatus HttpGetHandler(const char *path, HttpResponse *response, void *userdata);
 typedef HttpServerHandlerStatus HttpPostHandler(const char *path, void *data, size_t len, HttpResponse *response, void *userdata);
 
+// Fills buf with up to max bytes of a streamed body. Returns the number of bytes written,
+// 0 if there is nothing to send yet (the connection is parked until http_stream_wake())
+// or -1 to end the stream.
+typedef ssize_t HttpStreamReadFunc(void *userdata, char *buf, size_t max);
+
 int http_server_new(HttpServer **serverp, uint16_t port, sd_event *loop,
-                    HttpGetHandler **get_handlers, HttpPostHandler **post_handlers,
                     void *userdata, const char *www_dir);
 HttpServer * http_server_free(HttpServer *server);
 void http_server_freep(HttpServer **serverp);
+/* Routes match whole path segments, the longest registered prefix wins.
+ * Handlers get the path after the prefix, which is empty or starts with a
+ * slash. GET requests that no route handles are served from www_dir. */
+void http_server_add_get_route(HttpServer *server, const char *prefix, HttpGetHandler *handler);
+void http_server_add_post_route(HttpServer *server, const char *prefix, HttpPostHandler *handler);
+// compresses buffered replies of at least threshold bytes for clients that accept it, level 0 never does
+void http_server_set_compression(HttpServer *server, int level, size_t threshold);
+// larger POST bodies are answered with 413, before they are read if the client sends a Content-Length
+void http_server_set_max_body_size(HttpServer *server, size_t max);
+/* Files posted to /filepost are stored in dir. Upload requests larger than
+ * max_size, 0 for no limit, are answered with 413. buffer_size is that of
+ * the form parser, which hands file data on in pieces of up to that size. */
+int http_server_set_upload(HttpServer *server, const char *dir, uint64_t max_size, size_t buffer_size);
 
 void http_response_end(HttpResponse *response, int status);
+Buffer * http_response_get_buffer(HttpResponse *response, const char *content_type);
 FILE * http_response_get_stream(HttpResponse *response, const char *content_type);
 void http_response_set_user_data(HttpResponse *response, void *data, void (*free_func)(void *));
 void * http_response_get_user_data(HttpResponse *response);
+// freed when the request completes, which is after the response has been sent
+Arena * http_response_get_arena(HttpResponse *response);
+void http_response_add_header(HttpResponse *response, const char *name, const char *value);
+const char * http_response_get_header(HttpResponse *response, const char *name);
+const char * http_response_get_argument(HttpResponse *response, const char *name);
+/* The quality that an Accept or Accept-Encoding style header, which may be
+ * NULL, gives token: its q parameter, 1 without one, 0 if it is not listed. */
+double http_header_quality(const char *header, const char *token);
+
+HttpStream * http_response_end_stream(HttpResponse *response, const char *content_type,
+                                      HttpStreamReadFunc *read_func, void *userdata, void (*free_func)(void *));
+// sends what the stream has to send once control is back in the event loop
+void http_stream_wake(HttpStream *stream);
 
 void http_suspend_connection(HttpResponse *response);
@@ -0,0 +1,256 @@
+#include "json-scan.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define JSON_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+typedef const char * JsonScanFunc(const char *p, const char *end);
+
+typedef struct {
+        JsonScanFunc *string;
+        JsonScanFunc *whitespace;
+        JsonScanFunc *escape;
+} JsonScanKernels;
+
+static inline bool is_control(char c) {
+        return (unsigned char)c < 0x20;
+}
+
+static inline bool is_whitespace(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static const char * scan_string_scalar(const char *p, const char *end) {
+        while (p < end && *p != '"' && *p != '\\' && !is_control(*p))
+                p += 1;
+
+        return p;
+}
+
+static const char * scan_whitespace_scalar(const char *p, const char *end) {
+        while (p < end && is_whitespace(*p))
+                p += 1;
+
+        return p;
+}
+
+static const char * scan_escape_scalar(const char *p, const char *end) {
+        while (p < end && *p != '"' && *p != '\\' && *p != '/' && !is_control(*p))
+                p += 1;
+
+        return p;
+}
+
+static const JsonScanKernels scalar_kernels = {
+        scan_string_scalar, scan_whitespace_scalar, scan_escape_scalar
+};
+
+#ifdef JSON_SCAN_X86
+
+/* The masks have bit n set if byte n matches. They are inlined into the
+ * AVX2 kernels as well, which then run their 16 byte step VEX encoded and
+ * avoid the SSE/AVX transition penalty. */
+
+// there is no unsigned byte compare, x <= 0x1f iff max(x, 0x1f) == 0x1f
+static inline __m128i sse2_control(__m128i x) {
+        const __m128i limit = _mm_set1_epi8(0x1f);
+
+        return _mm_cmpeq_epi8(_mm_max_epu8(x, limit), limit);
+}
+
+static inline unsigned sse2_string_mask(const char *p) {
+        __m128i x = _mm_loadu_si128((const __m128i *)p);
+
+        return _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('"')),
+                                                           _mm_cmpeq_epi8(x, _mm_set1_epi8('\\'))),
+                                              sse2_control(x)));
+}
+
+static inline unsigned sse2_whitespace_mask(const char *p) {
+        __m128i x = _mm_loadu_si128((const __m128i *)p);
+
+        return _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(' ')),
+                                                           _mm_cmpeq_epi8(x, _mm_set1_epi8('\t'))),
+                                              _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('\n')),
+                                                           _mm_cmpeq_epi8(x, _mm_set1_epi8('\r')))));
+}
+
+static inline unsigned sse2_escape_mask(const char *p) {
+        __m128i x = _mm_loadu_si128((const __m128i *)p);
+
+        return _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('"')),
+                                                           _mm_cmpeq_epi8(x, _mm_set1_epi8('\\'))),
+                                              _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('/')),
+                                                           sse2_control(x))));
+}
+
+static const char * scan_string_sse2(const char *p, const char *end) {
+        for (; end - p >= 16; p += 16) {
+                unsigned mask = sse2_string_mask(p);
+
+                if (mask)
+                        return p + __builtin_ctz(mask);
+        }
+
+        return scan_string_scalar(p, end);
+}
+
+static const char * scan_whitespace_sse2(const char *p, const char *end) {
+        for (; end - p >= 16; p += 16) {
+                unsigned mask = ~sse2_whitespace_mask(p) & 0xffff;
+
+                if (mask)
+                        return p + __builtin_ctz(mask);
+        }
+
+        return scan_whitespace_scalar(p, end);
+}
+
+static const char * scan_escape_sse2(const char *p, const char *end) {
+        for (; end - p >= 16; p += 16) {
+                unsigned mask = sse2_escape_mask(p);
+
+                if (mask)
+                        return p + __builtin_ctz(mask);
+        }
+
+        return scan_escape_scalar(p, end);
+}
+
+static const JsonScanKernels sse2_kernels = {
+        scan_string_sse2, scan_whitespace_sse2, scan_escape_sse2
+};
+
+#define AVX2 __attribute__((target("avx2")))
+
+static inline AVX2 __m256i avx2_control(__m256i x) {
+        const __m256i limit = _mm256_set1_epi8(0x1f);
+
+        return _mm256_cmpeq_epi8(_mm256_max_epu8(x, limit), limit);
+}
+
+static AVX2 const char * scan_string_avx2(const char *p, const char *end) {
+        unsigned mask;
+
+        for (; end - p >= 32; p += 32) {
+                __m256i x = _mm256_loadu_si256((const __m256i *)p);
+
+                mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('"')),
+                                                                            _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\\'))),
+                                                            avx2_control(x)));
+                if (mask)
+                        return p + __builtin_ctz(mask);
+        }
+
+        if (end - p >= 16) {
+                mask = sse2_string_mask(p);
+                if (mask)
+                        return p + __builtin_ctz(mask);
+                p += 16;
+        }
+
+        return scan_string_scalar(p, end);
+}
+
+static AVX2 const char * scan_whitespace_avx2(const char *p, const char *end) {
+        unsigned mask;
+
+        for (; end - p >= 32; p += 32) {
+                __m256i x = _mm256_loadu_si256((const __m256i *)p);
+
+                mask = ~(unsigned)_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')),
+                                                                                       _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\t'))),
+                                                                       _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('\n')),
+                                                                                       _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\r')))));
+                if (mask)
+                        return p + __builtin_ctz(mask);
+        }
+
+        if (end - p >= 16) {
+                mask = ~sse2_whitespace_mask(p) & 0xffff;
+                if (mask)
+                        return p + __builtin_ctz(mask);
+                p += 16;
+        }
+
+        return scan_whitespace_scalar(p, end);
+}
+
+static AVX2 const char * scan_escape_avx2(const char *p, const char *end) {
+        unsigned mask;
+
+        for (; end - p >= 32; p += 32) {
+                __m256i x = _mm256_loadu_si256((const __m256i *)p);
+
+                mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('"')),
+                                                                            _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\\'))),
+                                                            _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('/')),
+                                                                            avx2_control(x))));
+                if (mask)
+                        return p + __builtin_ctz(mask);
+        }
+
+        if (end - p >= 16) {
+                mask = sse2_escape_mask(p);
+                if (mask)
+                        return p + __builtin_ctz(mask);
+                p += 16;
+        }
+
+        return scan_escape_scalar(p, end);
+}
+
+static const JsonScanKernels avx2_kernels = {
+        scan_string_avx2, scan_whitespace_avx2, scan_escape_avx2
+};
+
+#endif
+
+static const JsonScanKernels *kernels;
+
+/* DBUS_HTTP_JSON_SCAN=scalar|sse2 forces a less capable implementation,
+ * for benchmarking and for testing the fallbacks. */
+static const JsonScanKernels * json_scan_kernels(void) {
+        const char *force;
+
+        if (kernels)
+                return kernels;
+
+        force = getenv("DBUS_HTTP_JSON_SCAN");
+        kernels = &scalar_kernels;
+
+#ifdef JSON_SCAN_X86
+        if (!force || strcmp(force, "scalar") != 0) {
+                kernels = &sse2_kernels;
+
+                __builtin_cpu_init();
+                if (!force && __builtin_cpu_supports("avx2"))
+                        kernels = &avx2_kernels;
+        }
+#else
+        (void)force;
+#endif
+
+        return kernels;
+}
+
+const char * json_scan_string(const char *p, const char *end) {
+        return json_scan_kernels()->string(p, end);
+}
+
+const char * json_scan_whitespace(const char *p, const char *end) {
+        // most tokens are not preceded by whitespace at all
+        if (p == end || !is_whitespace(*p))
+                return p;
+
+        return json_scan_kernels()->whitespace(p + 1, end);
+}
+
+const char * json_scan_escape(const char *p, const char *end) {
+        return json_scan_kernels()->escape(p, end);
+}
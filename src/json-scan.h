@@ -0,0 +1,15 @@
+#pragma once
+
+/* Vectorized scanning kernels for the JSON reader and printer. Each returns
+ * a pointer to the first byte in [p, end) of the class it scans for, or end.
+ * They never read at or beyond end, so the input needs no padding. The
+ * implementation (AVX2, SSE2 or scalar) is picked on first use. */
+
+// '"', '\\' or a control character
+const char * json_scan_string(const char *p, const char *end);
+
+// anything that is not JSON whitespace
+const char * json_scan_whitespace(const char *p, const char *end);
+
+// a character json_print has to escape: '"', '\\', '/' or a control character
+const char * json_scan_escape(const char *p, const char *end);
@@ -0,0 +1,435 @@
+#include "json-writer.h"
+#include "json-scan.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define _cleanup_(fn) __attribute__((__cleanup__(fn)))
+
+// isfinite() cannot be relied upon with -ffast-math
+static bool is_finite(double number) {
+        uint64_t bits;
+
+        memcpy(&bits, &number, sizeof(bits));
+        return (bits & 0x7ff0000000000000ULL) != 0x7ff0000000000000ULL;
+}
+
+static bool is_integer(double number) {
+        double truncated = (int64_t)number;
+
+        return memcmp(&truncated, &number, sizeof(number)) == 0;
+}
+
+void json_writer_init(JsonWriter *writer, Buffer *buffer) {
+        writer->buffer = buffer;
+        writer->comma = false;
+}
+
+static void json_writer_separator(JsonWriter *writer) {
+        if (writer->comma)
+                buffer_append_char(writer->buffer, ',');
+}
+
+void json_writer_begin_object(JsonWriter *writer) {
+        json_writer_separator(writer);
+        buffer_append_char(writer->buffer, '{');
+        writer->comma = false;
+}
+
+void json_writer_end_object(JsonWriter *writer) {
+        buffer_append_char(writer->buffer, '}');
+        writer->comma = true;
+}
+
+void json_writer_begin_array(JsonWriter *writer) {
+        json_writer_separator(writer);
+        buffer_append_char(writer->buffer, '[');
+        writer->comma = false;
+}
+
+void json_writer_end_array(JsonWriter *writer) {
+        buffer_append_char(writer->buffer, ']');
+        writer->comma = true;
+}
+
+static void json_writer_escaped(JsonWriter *writer, const char *string) {
+        const char *p = string;
+        const char *end = string + strlen(string);
+
+        buffer_append_char(writer->buffer, '"');
+
+        for (;;) {
+                const char *special = json_scan_escape(p, end);
+
+                buffer_append(writer->buffer, p, special - p);
+                if (special == end)
+                        break;
+
+                switch (*special) {
+                        case '"':
+                                buffer_append(writer->buffer, "\\\"", 2);
+                                break;
+                        case '\\':
+                                buffer_append(writer->buffer, "\\\\", 2);
+                                break;
+                        case '/':
+                                buffer_append(writer->buffer, "\\/", 2);
+                                break;
+                        case '\b':
+                                buffer_append(writer->buffer, "\\b", 2);
+                                break;
+                        case '\f':
+                                buffer_append(writer->buffer, "\\f", 2);
+                                break;
+                        case '\n':
+                                buffer_append(writer->buffer, "\\n", 2);
+                                break;
+                        case '\r':
+                                buffer_append(writer->buffer, "\\r", 2);
+                                break;
+                        case '\t':
+                                buffer_append(writer->buffer, "\\t", 2);
+                                break;
+                        default:
+                                buffer_printf(writer->buffer, "\\u%04x", (unsigned char)*special);
+                                break;
+                }
+
+                p = special + 1;
+        }
+
+        buffer_append_char(writer->buffer, '"');
+}
+
+void json_writer_key(JsonWriter *writer, const char *key) {
+        json_writer_separator(writer);
+        json_writer_escaped(writer, key);
+        buffer_append_char(writer->buffer, ':');
+        writer->comma = false;
+}
+
+void json_writer_string(JsonWriter *writer, const char *string) {
+        json_writer_separator(writer);
+        json_writer_escaped(writer, string);
+        writer->comma = true;
+}
+
+void json_writer_base64(JsonWriter *writer, const void *data, size_t size) {
+        static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        const uint8_t *p = data;
+        char *out;
+
+        json_writer_separator(writer);
+
+        // the encoding never needs escaping, so it is written in place
+        if (buffer_reserve(writer->buffer, 4 * ((size + 2) / 3) + 2) < 0)
+                return;
+
+        out = writer->buffer->data + writer->buffer->size;
+        *out++ = '"';
+
+        for (; size >= 3; p += 3, size -= 3) {
+                *out++ = alphabet[p[0] >> 2];
+                *out++ = alphabet[(p[0] & 0x03) << 4 | p[1] >> 4];
+                *out++ = alphabet[(p[1] & 0x0f) << 2 | p[2] >> 6];
+                *out++ = alphabet[p[2] & 0x3f];
+        }
+
+        if (size == 1) {
+                *out++ = alphabet[p[0] >> 2];
+                *out++ = alphabet[(p[0] & 0x03) << 4];
+                *out++ = '=';
+                *out++ = '=';
+        } else if (size == 2) {
+                *out++ = alphabet[p[0] >> 2];
+                *out++ = alphabet[(p[0] & 0x03) << 4 | p[1] >> 4];
+                *out++ = alphabet[(p[1] & 0x0f) << 2];
+                *out++ = '=';
+        }
+
+        *out++ = '"';
+        *out = '\0';
+        writer->buffer->size = out - writer->buffer->data;
+        writer->comma = true;
+}
+
+// writes n in decimal, right aligned, into digits[24]; returns the first digit
+static char * format_unsigned(char digits[24], uint64_t n) {
+        char *p = digits + 24;
+
+        do {
+                *--p = '0' + n % 10;
+                n /= 10;
+        } while (n);
+
+        return p;
+}
+
+static const char digit_pairs[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+
+// writes n in decimal to out, two digits per division; returns the end
+static char * format_unsigned_pairs(char *out, uint64_t n) {
+        char digits[20];
+        char *p = digits + sizeof(digits);
+
+        while (n >= 100) {
+                p -= 2;
+                memcpy(p, digit_pairs + 2 * (n % 100), 2);
+                n /= 100;
+        }
+
+        if (n >= 10) {
+                p -= 2;
+                memcpy(p, digit_pairs + 2 * n, 2);
+        } else
+                *--p = '0' + n;
+
+        memcpy(out, p, digits + sizeof(digits) - p);
+        return out + (digits + sizeof(digits) - p);
+}
+
+static void json_writer_digits(JsonWriter *writer, uint64_t n, bool negative) {
+        char digits[24];
+        char *p = format_unsigned(digits, n);
+
+        if (negative)
+                *--p = '-';
+
+        buffer_append(writer->buffer, p, digits + sizeof(digits) - p);
+}
+
+void json_writer_integer(JsonWriter *writer, int64_t integer) {
+        json_writer_separator(writer);
+        json_writer_digits(writer, integer < 0 ? -(uint64_t)integer : (uint64_t)integer, integer < 0);
+        writer->comma = true;
+}
+
+void json_writer_unsigned(JsonWriter *writer, uint64_t integer) {
+        json_writer_separator(writer);
+        json_writer_digits(writer, integer, false);
+        writer->comma = true;
+}
+
+/* The buffer is grown once for the longest possible output, and every
+ * element is then formatted straight into it without further checks. */
+void json_writer_integer_array(JsonWriter *writer, const void *data, size_t n_elements, size_t width, bool is_signed) {
+        // "-9223372036854775808," and the like
+        static const size_t max_length[] = { [1] = 5, [2] = 7, [4] = 12, [8] = 21 };
+        char *out;
+
+        assert(width == 1 || width == 2 || width == 4 || width == 8);
+
+        json_writer_separator(writer);
+
+        if (buffer_reserve(writer->buffer, n_elements * max_length[width] + 2) < 0)
+                return;
+
+        out = writer->buffer->data + writer->buffer->size;
+        *out++ = '[';
+
+        for (size_t i = 0; i < n_elements; i++) {
+                int64_t value;
+                uint64_t magnitude;
+
+                if (i > 0)
+                        *out++ = ',';
+
+                // the conditional operator would convert signed to unsigned
+                switch (width) {
+                        case 1:
+                                if (is_signed)
+                                        value = ((const int8_t *)data)[i];
+                                else
+                                        value = ((const uint8_t *)data)[i];
+                                break;
+                        case 2:
+                                if (is_signed)
+                                        value = ((const int16_t *)data)[i];
+                                else
+                                        value = ((const uint16_t *)data)[i];
+                                break;
+                        case 4:
+                                if (is_signed)
+                                        value = ((const int32_t *)data)[i];
+                                else
+                                        value = ((const uint32_t *)data)[i];
+                                break;
+                        default:
+                                if (!is_signed) {
+                                        out = format_unsigned_pairs(out, ((const uint64_t *)data)[i]);
+                                        continue;
+                                }
+                                value = ((const int64_t *)data)[i];
+                }
+
+                magnitude = value < 0 ? -(uint64_t)value : (uint64_t)value;
+                if (value < 0)
+                        *out++ = '-';
+                out = format_unsigned_pairs(out, magnitude);
+        }
+
+        *out++ = ']';
+        *out = '\0';
+        writer->buffer->size = out - writer->buffer->data;
+        writer->comma = true;
+}
+
+static const double powers_of_ten[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8 };
+
+/* Values with few decimals are formatted from the scaled integer. k is
+ * increased until number * 10^k is integral and dividing by 10^k gives
+ * back exactly number, which makes the result the shortest round trip. */
+static bool format_short_decimal(JsonWriter *writer, double number) {
+        double magnitude = number < 0 ? -number : number;
+
+        if (!(magnitude >= 1e-8 && magnitude < 1e7))
+                return false;
+
+        for (size_t k = 1; k < sizeof(powers_of_ten) / sizeof(*powers_of_ten); k++) {
+                double scaled = magnitude * powers_of_ten[k];
+                double back;
+                uint64_t n;
+                char digits[24];
+                char *p;
+                size_t n_digits;
+
+                if (scaled >= 9007199254740992.0)        // 2^53, no longer exact
+                        return false;
+
+                n = (uint64_t)(scaled + 0.5);
+                back = (double)n / powers_of_ten[k];
+                if (memcmp(&back, &magnitude, sizeof(back)) != 0)
+                        continue;
+
+                p = format_unsigned(digits, n);
+                n_digits = digits + sizeof(digits) - p;
+
+                if (number < 0)
+                        buffer_append_char(writer->buffer, '-');
+                if (n_digits <= k) {
+                        buffer_append(writer->buffer, "0.", 2);
+                        for (size_t i = n_digits; i < k; i++)
+                                buffer_append_char(writer->buffer, '0');
+                        buffer_append(writer->buffer, p, n_digits);
+                } else {
+                        buffer_append(writer->buffer, p, n_digits - k);
+                        buffer_append_char(writer->buffer, '.');
+                        buffer_append(writer->buffer, p + n_digits - k, k);
+                }
+                return true;
+        }
+
+        return false;
+}
+
+void json_writer_number(JsonWriter *writer, double number) {
+        json_writer_separator(writer);
+
+        // integers are by far the most common, avoid printf for them
+        if (number > -1e15 && number < 1e15 && is_integer(number))
+                json_writer_digits(writer, number < 0 ? -(int64_t)number : (int64_t)number, number < 0);
+        else if (!is_finite(number))
+                buffer_append(writer->buffer, "null", 4);
+        else if (!format_short_decimal(writer, number)) {
+                char digits[32];
+
+                // the shortest precision that survives the round trip
+                for (int precision = 15; precision <= 17; precision++) {
+                        double parsed;
+
+                        snprintf(digits, sizeof(digits), "%.*g", precision, number);
+                        parsed = strtod(digits, NULL);
+                        if (memcmp(&parsed, &number, sizeof(number)) == 0)
+                                break;
+                }
+
+                buffer_append_string(writer->buffer, digits);
+        }
+
+        writer->comma = true;
+}
+
+void json_writer_json_number(JsonWriter *writer, const JsonNumber *number) {
+        switch (number->type) {
+                case JSON_NUMBER_INTEGER:
+                        json_writer_integer(writer, number->integer);
+                        break;
+                case JSON_NUMBER_UNSIGNED:
+                        json_writer_unsigned(writer, number->unsigned_integer);
+                        break;
+                default:
+                        json_writer_number(writer, number->real);
+        }
+}
+
+void json_writer_boolean(JsonWriter *writer, bool b) {
+        json_writer_separator(writer);
+        if (b)
+                buffer_append(writer->buffer, "true", 4);
+        else
+                buffer_append(writer->buffer, "false", 5);
+        writer->comma = true;
+}
+
+void json_writer_null(JsonWriter *writer) {
+        json_writer_separator(writer);
+        buffer_append(writer->buffer, "null", 4);
+        writer->comma = true;
+}
+
+void json_writer_value(JsonWriter *writer, JsonValue *value) {
+        switch (json_value_get_type(value)) {
+                case JSON_TYPE_STRING:
+                        json_writer_string(writer, json_value_get_string(value));
+                        break;
+
+                case JSON_TYPE_OBJECT: {
+                        _cleanup_(json_object_iterator_freep) JsonObjectIterator *iter = NULL;
+                        JsonObjectEntry *entry;
+
+                        json_writer_begin_object(writer);
+                        iter = json_object_iterator_new(value);
+                        while ((entry = json_object_iterator_next(iter))) {
+                                json_writer_key(writer, json_object_entry_key(entry));
+                                json_writer_value(writer, json_object_entry_value(entry));
+                        }
+                        json_writer_end_object(writer);
+                        break;
+                }
+
+                case JSON_TYPE_ARRAY:
+                        json_writer_begin_array(writer);
+                        for (size_t i = 0; i < json_array_get_length(value); i++) {
+                                JsonValue *element;
+
+                                json_array_get(value, i, &element, 0);
+                                json_writer_value(writer, element);
+                        }
+                        json_writer_end_array(writer);
+                        break;
+
+                case JSON_TYPE_NUMBER: {
+                        JsonNumber number;
+
+                        json_value_get_json_number(value, &number);
+                        json_writer_json_number(writer, &number);
+                        break;
+                }
+
+                case JSON_TYPE_TRUE:
+                        json_writer_boolean(writer, true);
+                        break;
+
+                case JSON_TYPE_FALSE:
+                        json_writer_boolean(writer, false);
+                        break;
+
+                case JSON_TYPE_NULL:
+                        json_writer_null(writer);
+                        break;
+        }
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "buffer.h"
+#include "json.h"
+
+/* Writes compact JSON straight into a Buffer. Object members are written
+ * in the order they are given, keys are never sorted. The caller is
+ * responsible for well-formed nesting. */
+typedef struct {
+        Buffer *buffer;
+        bool comma;     // the next key or element needs a separator
+} JsonWriter;
+
+void json_writer_init(JsonWriter *writer, Buffer *buffer);
+
+void json_writer_begin_object(JsonWriter *writer);
+void json_writer_end_object(JsonWriter *writer);
+void json_writer_begin_array(JsonWriter *writer);
+void json_writer_end_array(JsonWriter *writer);
+void json_writer_key(JsonWriter *writer, const char *key);
+
+void json_writer_string(JsonWriter *writer, const char *string);
+// a string with data in standard base64, padded
+void json_writer_base64(JsonWriter *writer, const void *data, size_t size);
+void json_writer_number(JsonWriter *writer, double number);
+void json_writer_integer(JsonWriter *writer, int64_t integer);
+void json_writer_unsigned(JsonWriter *writer, uint64_t integer);
+// a whole array of integers that are width bytes wide, 1, 2, 4 or 8
+void json_writer_integer_array(JsonWriter *writer, const void *data, size_t n_elements, size_t width, bool is_signed);
+void json_writer_json_number(JsonWriter *writer, const JsonNumber *number);
+void json_writer_boolean(JsonWriter *writer, bool b);
+void json_writer_null(JsonWriter *writer);
+
+// writes a whole tree, for replies that are built as JsonValue anyway
+void json_writer_value(JsonWriter *writer, JsonValue *value);
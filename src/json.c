@@ -1,36 +1,70 @@
 
 #include "json.h"
+#include "json-scan.h"
 
 #include <assert.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <stdint.h>
 #include <string.h>
 
 #define _cleanup_(func) __attribute__((__cleanup__(func)))
 
 
+/* A value is 16 bytes. Arrays and objects keep their members inline, so
+ * walking a large array touches consecutive memory instead of one heap node
+ * per element, and strings of up to JSON_SMALL_STRING_MAX bytes are stored
+ * inside the value. Values passed to json_array_append() and
+ * json_object_insert() are moved into the container, and pointers to
+ * members stay valid until the container is modified. */
+
+#define JSON_SMALL_STRING_MAX 13
+
+enum {
+        JSON_STRING_HEAP,
+        JSON_STRING_SMALL,
+        JSON_STRING_BORROWED,   // points into an in-place parsed buffer
+};
+
+typedef struct JsonObject JsonObject;
+
 struct JsonValue {
-        JsonType type;
         union {
-                double number;
-                char *string;
                 struct {
-                        JsonObjectEntry **entries;
-                        size_t n_entries;
-                        size_t n_alloced;
-                        bool sorted;
-                } object;
+                        uint8_t type;           // JsonType
+                        uint8_t kind;           // JsonNumberType, or where a string is stored
+                        uint32_t n_elements;    // capacity follows from it, see json_array_reserve()
+                        union {
+                                double real;
+                                int64_t integer;
+                                uint64_t unsigned_integer;
+                                char *string;
+                                JsonValue *elements;
+                                JsonObject *object;
+                        };
+                };
                 struct {
-                        JsonValue **elements;
-                        size_t n_elements;
-                        size_t n_alloced;
-                } array;
+                        uint8_t small_type;
+                        uint8_t small_kind;
+                        char small[JSON_SMALL_STRING_MAX + 1];
+                };
         };
 };
 
+_Static_assert(sizeof(JsonValue) == 16, "JsonValue must stay 16 bytes");
+
 struct JsonObjectEntry {
         char *key;
-        JsonValue *value;
+        bool borrowed;
+        JsonValue value;
+};
+
+struct JsonObject {
+        JsonObjectEntry *entries;       // in insertion order
+        size_t n_entries;
+        size_t n_alloced;
+        uint32_t *index;                // hash of key -> 1 + entry, built on demand
+        size_t n_index;
 };
 
 char* json_object_entry_key(JsonObjectEntry* joe){
@@ -38,45 +72,43 @@ char* json_object_entry_key(JsonObjectEntry* joe){
 }
 
 JsonValue* json_object_entry_value(JsonObjectEntry* joe) {
-        return joe->value;
+        return &joe->value;
 }
 
+static inline const char * json_value_string(const JsonValue *value) {
+        return value->kind == JSON_STRING_SMALL ? value->small : value->string;
+}
 
-static bool json_read_value(const char **j, JsonValue **valuep);
 
-static void freep(void *p) {
-        free(*(void **)p);
-}
+/* The input is either parsed read-only, in which case every string is
+ * copied out exactly once, or in place: strings are then terminated and
+ * unescaped inside the input buffer and referenced from the tree. */
 
-static void fclosep(FILE **filep) {
-        if (*filep)
-                fclose(*filep);
-}
+static bool json_read_value(JsonReader *reader, JsonValue *value);
 
-static void skip_whitespace(const char **j) {
-        while (**j == ' ' || **j == '\t' || **j == '\n' || **j == '\r')
-                *j += 1;
+static void skip_whitespace(JsonReader *reader) {
+        reader->p = json_scan_whitespace(reader->p, reader->end);
 }
 
-static bool json_read_char(const char **j, char c) {
-        skip_whitespace(j);
+static bool json_read_char(JsonReader *reader, char c) {
+        skip_whitespace(reader);
 
-        if (**j != c)
+        if (*reader->p != c)
                 return false;
 
-        *j += 1;
+        reader->p += 1;
         return true;
 }
 
-static bool json_read_literal(const char **j, const char *literal) {
+static bool json_read_literal(JsonReader *reader, const char *literal) {
         size_t len = strlen(literal);
 
-        skip_whitespace(j);
+        skip_whitespace(reader);
 
-        if (strncmp(*j, literal, len) != 0)
+        if (strncmp(reader->p, literal, len) != 0)
                 return false;
 
-        *j += len;
+        reader->p += len;
         return true;
 }
 
@@ -93,163 +125,442 @@ static int unhex(char d, uint8_t *valuep) {
         return 0;
 }
 
-static bool json_read_unicode_char(const char **j, FILE *stream) {
-        const char *p = *j;
+static bool json_read_unicode_escape(const char *p, const char *end, uint32_t *cpp) {
         uint8_t digits[4];
-        uint16_t cp;
+
+        if (end - p < 4)
+                return false;
 
         for (size_t i = 0; i < 4; i++)
-                if (p[i] == '\0' || unhex(p[i], &digits[i]) != 0)
+                if (unhex(p[i], &digits[i]) != 0)
                         return false;
 
-        cp = digits[0] << 12 | digits[1] << 8 | digits[2] << 4 | digits[3];
+        *cpp = digits[0] << 12 | digits[1] << 8 | digits[2] << 4 | digits[3];
+        return true;
+}
 
-        if (cp <= 0x007f) {
-                fputc((char)cp, stream);
+/* Decodes the escape sequence starting after the backslash at *p, returns
+ * the number of bytes written to out. The output is never longer than the
+ * escape sequence, which allows decoding in place. */
+static size_t json_unescape_char(const char **p, const char *end, char *out) {
+        const char *s = *p;
+        uint32_t cp, low;
+
+        switch (*s) {
+                case '"':
+                case '\\':
+                case '/':
+                        *out = *s;
+                        *p = s + 1;
+                        return 1;
+                case 'b':
+                        *out = '\b';
+                        *p = s + 1;
+                        return 1;
+                case 'f':
+                        *out = '\f';
+                        *p = s + 1;
+                        return 1;
+                case 'n':
+                        *out = '\n';
+                        *p = s + 1;
+                        return 1;
+                case 'r':
+                        *out = '\r';
+                        *p = s + 1;
+                        return 1;
+                case 't':
+                        *out = '\t';
+                        *p = s + 1;
+                        return 1;
+                case 'u':
+                        break;
+                default:
+                        return 0;
+        }
 
+        if (!json_read_unicode_escape(s + 1, end, &cp))
+                return 0;
+        s += 5;
+
+        // a surrogate pair encodes one code point outside of the BMP
+        if (cp >= 0xd800 && cp <= 0xdbff && end - s >= 6 && s[0] == '\\' && s[1] == 'u' &&
+            json_read_unicode_escape(s + 2, end, &low) && low >= 0xdc00 && low <= 0xdfff) {
+                cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                s += 6;
+        }
+
+        *p = s;
+
+        if (cp <= 0x007f) {
+                out[0] = (char)cp;
+                return 1;
         } else if (cp <= 0x07ff) {
-                fputc((char)(0xc0 | (cp >> 6)), stream);
-                fputc((char)(0x80 | (cp & 0x3f)), stream);
+                out[0] = (char)(0xc0 | (cp >> 6));
+                out[1] = (char)(0x80 | (cp & 0x3f));
+                return 2;
+        } else if (cp <= 0xffff) {
+                out[0] = (char)(0xe0 | (cp >> 12));
+                out[1] = (char)(0x80 | ((cp >> 6) & 0x3f));
+                out[2] = (char)(0x80 | (cp & 0x3f));
+                return 3;
         }
 
-        else {
-                fputc((char)(0xe0 | (cp >> 12)), stream);
-                fputc((char)(0x80 | ((cp >> 6) & 0x3f)), stream);
-                fputc((char)(0x80 | (cp & 0x3f)), stream);
+        out[0] = (char)(0xf0 | (cp >> 18));
+        out[1] = (char)(0x80 | ((cp >> 12) & 0x3f));
+        out[2] = (char)(0x80 | ((cp >> 6) & 0x3f));
+        out[3] = (char)(0x80 | (cp & 0x3f));
+        return 4;
+}
+
+/* Unescapes the string body [p, end) into out, which may be p itself. */
+static bool json_unescape(const char *p, const char *end, char *out, size_t *lenp) {
+        size_t n = 0;
+
+        while (p < end) {
+                const char *backslash;
+                size_t chunk;
+
+                backslash = memchr(p, '\\', end - p);
+                chunk = (backslash ? backslash : end) - p;
+                memmove(out + n, p, chunk);
+                n += chunk;
+                p += chunk;
+
+                if (p < end) {
+                        size_t len;
+
+                        p += 1;
+                        len = json_unescape_char(&p, end, out + n);
+                        if (len == 0)
+                                return false;
+                        n += len;
+                }
         }
 
+        *lenp = n;
         return true;
 }
 
-static bool json_read_string(const char **j, char **stringp) {
-        _cleanup_(fclosep) FILE *stream = NULL;
-        _cleanup_(freep) char *string = NULL;
-        size_t size;
-        const char *p = *j;
+/* Finds the closing quote of the string at the reader, without consuming
+ * or modifying anything. */
+static bool json_scan_string_end(JsonReader *reader, const char **endp, bool *escapedp) {
+        const char *p;
+        bool escaped = false;
 
-        skip_whitespace(&p);
+        skip_whitespace(reader);
 
-        if (*p != '"')
+        if (*reader->p != '"')
                 return false;
 
-        stream = open_memstream(&string, &size);
-
-        for (p = p + 1; *p != '"'; p++) {
-                if (*p == '\0')
+        for (p = reader->p + 1;; p++) {
+                p = json_scan_string(p, reader->end);
+                if (p == reader->end || *p == '\0')
                         return false;
 
+                if (*p == '"')
+                        break;
+
                 if (*p == '\\') {
+                        escaped = true;
                         p += 1;
-                        switch (*p) {
-                                case '"':
-                                        fputc('"', stream);
-                                        break;
-                                case '\\':
-                                         fputc('\\', stream);
-                                         break;
-                                case '/':
-                                         fputc('/', stream);
-                                         break;
-                                case 'b':
-                                         fputc('\b', stream);
-                                         break;
-                                case 'f':
-                                         fputc('\f', stream);
-                                         break;
-                                case 'n':
-                                         fputc('\n', stream);
-                                         break;
-                                case 'r':
-                                         fputc('\r', stream);
-                                         break;
-                                case 't':
-                                         fputc('\t', stream);
-                                         break;
-                                case 'u':
-                                         if (!json_read_unicode_char(&p, stream))
-                                                 return false;
-                                         break;
-                                default:
-                                           return false;
-                        }
+                        if (p == reader->end)
+                                return false;
+                }
+                // other control characters are tolerated unescaped
+        }
+
+        *endp = p;
+        *escapedp = escaped;
+        return true;
+}
+
+// unescapes the string scanned up to end into out, which may be the input itself
+static bool json_copy_string(JsonReader *reader, const char *end, bool escaped, char *out) {
+        const char *start = reader->p + 1;
+        size_t len;
 
-                } else
-                        fputc(*p, stream);
+        if (escaped) {
+                if (!json_unescape(start, end, out, &len))
+                        return false;
+        } else {
+                len = end - start;
+                if (out != start)
+                        memcpy(out, start, len);
         }
 
-        fclose(stream);
-        stream = NULL;
+        // in place, this overwrites the closing quote or a byte of the consumed escapes
+        out[len] = '\0';
+
+        reader->p = end + 1;
+        return true;
+}
+
+static bool json_read_string(JsonReader *reader, char **stringp, bool *borrowedp) {
+        const char *end;
+        bool escaped;
+        char *string;
+
+        if (!json_scan_string_end(reader, &end, &escaped))
+                return false;
+
+        if (reader->in_place)
+                string = (char *)reader->p + 1;
+        else
+                string = malloc(end - reader->p);
+
+        if (!json_copy_string(reader, end, escaped, string)) {
+                if (!reader->in_place)
+                        free(string);
+                return false;
+        }
 
-        *j = p + 1;
         if (stringp) {
                 *stringp = string;
-                string = NULL;
+                *borrowedp = reader->in_place;
+        } else if (!reader->in_place)
+                free(string);
+
+        return true;
+}
+
+// short strings are copied into the value even when parsing in place
+static bool json_read_string_value(JsonReader *reader, JsonValue *value) {
+        const char *end;
+        bool escaped;
+        char *out;
+
+        if (!json_scan_string_end(reader, &end, &escaped))
+                return false;
+
+        if (end - reader->p - 1 <= JSON_SMALL_STRING_MAX) {
+                value->kind = JSON_STRING_SMALL;
+                out = value->small;
+        } else if (reader->in_place) {
+                value->kind = JSON_STRING_BORROWED;
+                out = value->string = (char *)reader->p + 1;
+        } else {
+                value->kind = JSON_STRING_HEAP;
+                out = value->string = malloc(end - reader->p);
+        }
+
+        if (!json_copy_string(reader, end, escaped, out)) {
+                if (value->kind == JSON_STRING_HEAP)
+                        free(value->string);
+                return false;
         }
+
+        value->type = JSON_TYPE_STRING;
         return true;
 }
 
-static bool json_read_number(const char **j, double *nump) {
+/* Integers are accumulated digit by digit, which is exact and much faster
+ * than strtod(). Anything with a fraction or exponent, or too large for 64
+ * bits, is left to strtod(). Returns the end of the number or p. */
+static const char * json_parse_number(const char *p, JsonNumber *number) {
+        const char *s = p;
+        bool negative = false;
+        uint64_t n = 0;
         char *end;
-        double num;
 
-        skip_whitespace(j);
+        if (*s == '-') {
+                negative = true;
+                s += 1;
+        }
+
+        if (*s >= '0' && *s <= '9') {
+                for (; *s >= '0' && *s <= '9'; s++) {
+                        unsigned digit = *s - '0';
 
-        num = strtod(*j, &end);
-        if (end == *j)
+                        if (n > (UINT64_MAX - digit) / 10)
+                                goto real;
+                        n = n * 10 + digit;
+                }
+
+                switch (*s) {
+                        case '.':
+                        case 'e':
+                        case 'E':
+                        case 'x':
+                        case 'X':
+                                goto real;
+                }
+
+                if (!negative) {
+                        if (n <= INT64_MAX) {
+                                number->type = JSON_NUMBER_INTEGER;
+                                number->integer = n;
+                        } else {
+                                number->type = JSON_NUMBER_UNSIGNED;
+                                number->unsigned_integer = n;
+                        }
+                        return s;
+                }
+
+                if (n <= (uint64_t)INT64_MAX + 1) {
+                        number->type = JSON_NUMBER_INTEGER;
+                        number->integer = n == (uint64_t)INT64_MAX + 1 ? INT64_MIN : -(int64_t)n;
+                        return s;
+                }
+        }
+
+real:
+        number->type = JSON_NUMBER_REAL;
+        number->real = strtod(p, &end);
+        return end;
+}
+
+static bool json_read_number(JsonReader *reader, JsonNumber *numberp) {
+        JsonNumber number;
+        const char *end;
+
+        skip_whitespace(reader);
+
+        end = json_parse_number(reader->p, &number);
+        if (end == reader->p)
                 return false;
 
-        *j = end;
-        if (nump)
-                *nump = num;
+        reader->p = end;
+        if (numberp)
+                *numberp = number;
         return true;
 }
 
-static void * grow_pointer_array(void *array, size_t *allocedp) {
+bool json_number_parse(const char *string, JsonNumber *numberp) {
+        const char *end;
+
+        end = json_parse_number(string, numberp);
+        return end != string && *end == '\0';
+}
+
+double json_number_to_double(const JsonNumber *number) {
+        switch (number->type) {
+                case JSON_NUMBER_INTEGER:
+                        return number->integer;
+                case JSON_NUMBER_UNSIGNED:
+                        return number->unsigned_integer;
+                default:
+                        return number->real;
+        }
+}
+
+// 2^63 as a double, the first value outside of int64_t
+#define TWO_POW_63 9223372036854775808.0
+
+bool json_number_to_int64(const JsonNumber *number, int64_t *valuep) {
+        switch (number->type) {
+                case JSON_NUMBER_INTEGER:
+                        *valuep = number->integer;
+                        return true;
+
+                case JSON_NUMBER_UNSIGNED:
+                        return false;
+
+                default:
+                        if (!(number->real >= -TWO_POW_63 && number->real < TWO_POW_63))
+                                return false;
+                        if ((double)(int64_t)number->real < number->real || (double)(int64_t)number->real > number->real)
+                                return false;
+                        *valuep = (int64_t)number->real;
+                        return true;
+        }
+}
+
+bool json_number_to_uint64(const JsonNumber *number, uint64_t *valuep) {
+        switch (number->type) {
+                case JSON_NUMBER_INTEGER:
+                        if (number->integer < 0)
+                                return false;
+                        *valuep = number->integer;
+                        return true;
+
+                case JSON_NUMBER_UNSIGNED:
+                        *valuep = number->unsigned_integer;
+                        return true;
+
+                default:
+                        if (!(number->real >= 0 && number->real < 2 * TWO_POW_63))
+                                return false;
+                        if ((double)(uint64_t)number->real < number->real || (double)(uint64_t)number->real > number->real)
+                                return false;
+                        *valuep = (uint64_t)number->real;
+                        return true;
+        }
+}
+
+static void * grow_array(void *array, size_t size, size_t *allocedp) {
         if (*allocedp == 0)
                 *allocedp = 8;
         else
                 *allocedp *= 2;
 
-        return realloc(array, *allocedp * sizeof(void *));
+        return realloc(array, *allocedp * size);
 }
 
-static JsonObjectEntry * json_object_entry_free(JsonObjectEntry *entry) {
-        free(entry->key);
-        if (entry->value)
-                json_value_free(entry->value);
-        free(entry);
-        return NULL;
+/* Arrays grow in powers of two from 4 elements, so their capacity follows
+ * from the length and the value has no room to spend on it. */
+static size_t json_array_capacity(size_t n_elements) {
+        size_t n_alloced = 4;
+
+        if (n_elements == 0)
+                return 0;
+
+        while (n_alloced < n_elements)
+                n_alloced *= 2;
+
+        return n_alloced;
 }
 
-static int json_object_entry_compare(const void *p1, const void *p2) {
-        const JsonObjectEntry *entry1 = *(JsonObjectEntry **)p1;
-        const JsonObjectEntry *entry2 = *(JsonObjectEntry **)p2;
+// makes room for one more element, returns the free slot
+static JsonValue * json_array_reserve(JsonValue *value) {
+        size_t n = value->n_elements;
+
+        assert(n < UINT32_MAX);
 
-        return strcmp(entry1->key, entry2->key);
+        if (n == 0 || (n >= 4 && (n & (n - 1)) == 0))
+                value->elements = realloc(value->elements, (n ? 2 * n : 4) * sizeof(JsonValue));
+
+        return &value->elements[n];
 }
 
-static int json_object_entry_compare_key(const void *key, const void *p) {
-        const JsonObjectEntry *entry = *(JsonObjectEntry **)p;
+// makes room for one more entry, returns the free slot
+static JsonObjectEntry * json_object_reserve(JsonObject *object) {
+        if (object->n_entries == object->n_alloced)
+                object->entries = grow_array(object->entries, sizeof(JsonObjectEntry), &object->n_alloced);
 
-        return strcmp(key, entry->key);
+        return &object->entries[object->n_entries];
 }
 
-JsonValue * json_value_free(JsonValue *value) {
+static void json_value_clear(JsonValue *value);
+
+static void json_object_free(JsonObject *object) {
+        for (size_t i = 0; i < object->n_entries; i++) {
+                if (!object->entries[i].borrowed)
+                        free(object->entries[i].key);
+                json_value_clear(&object->entries[i].value);
+        }
+
+        free(object->entries);
+        free(object->index);
+        free(object);
+}
+
+// frees what the value owns, but not the value itself
+static void json_value_clear(JsonValue *value) {
         switch (value->type) {
                 case JSON_TYPE_STRING:
-                        free(value->string);
+                        if (value->kind == JSON_STRING_HEAP)
+                                free(value->string);
                         break;
 
                 case JSON_TYPE_OBJECT:
-                        for (size_t i = 0; i < value->object.n_entries; i++)
-                                json_object_entry_free(value->object.entries[i]);
-                        free(value->object.entries);
+                        json_object_free(value->object);
                         break;
 
                 case JSON_TYPE_ARRAY:
-                        for (size_t i = 0; i < value->array.n_elements; i++)
-                                json_value_free(value->array.elements[i]);
-                        free(value->array.elements);
+                        for (size_t i = 0; i < value->n_elements; i++)
+                                json_value_clear(&value->elements[i]);
+                        free(value->elements);
                         break;
 
                 case JSON_TYPE_NUMBER:
@@ -258,106 +569,172 @@ JsonValue * json_value_free(JsonValue *value) {
                 case JSON_TYPE_NULL:
                         break;
         }
+}
 
+JsonValue * json_value_free(JsonValue *value) {
+        json_value_clear(value);
         free(value);
         return NULL;
 }
 
-static bool json_read_object_entry(const char **j, JsonObjectEntry **entryp) {
-        JsonObjectEntry *entry;
+void json_value_freep(JsonValue **valuep) {
+        if (*valuep)
+                json_value_free(*valuep);
+}
 
-        entry = calloc(1, sizeof(JsonObjectEntry));
+static bool json_read_object_entry(JsonReader *reader, JsonObjectEntry *entry) {
+        if (!json_read_string(reader, &entry->key, &entry->borrowed))
+                return false;
 
-        if (!json_read_string(j, &entry->key) ||
-            !json_read_char(j, ':') ||
-            !json_read_value(j, &entry->value)) {
-                json_object_entry_free(entry);
+        if (!json_read_char(reader, ':') ||
+            !json_read_value(reader, &entry->value)) {
+                if (!entry->borrowed)
+                        free(entry->key);
                 return false;
         }
 
-        *entryp = entry;
-
         return true;
 }
 
-void json_value_freep(JsonValue **valuep) {
-        if (*valuep)
-                json_value_free(*valuep);
+static void json_value_set_number(JsonValue *value, const JsonNumber *number) {
+        value->type = JSON_TYPE_NUMBER;
+        value->kind = number->type;
+
+        switch (number->type) {
+                case JSON_NUMBER_INTEGER:
+                        value->integer = number->integer;
+                        break;
+                case JSON_NUMBER_UNSIGNED:
+                        value->unsigned_integer = number->unsigned_integer;
+                        break;
+                default:
+                        value->real = number->real;
+        }
 }
 
-static bool json_read_value(const char **j, JsonValue **valuep) {
-        _cleanup_(json_value_freep) JsonValue *value = NULL;
+// *value only holds something that needs clearing if this succeeds
+static bool json_read_value(JsonReader *reader, JsonValue *value) {
+        JsonNumber number;
 
-        value = calloc(1, sizeof(JsonValue));
+        if (json_read_string_value(reader, value))
+                return true;
 
-        if (json_read_string(j, &value->string))
-                value->type = JSON_TYPE_STRING;
-        else if (json_read_number(j, &value->number))
-                value->type = JSON_TYPE_NUMBER;
-        else if (json_read_literal(j, "null"))
+        if (json_read_number(reader, &number)) {
+                json_value_set_number(value, &number);
+                return true;
+        }
+
+        if (json_read_literal(reader, "null"))
                 value->type = JSON_TYPE_NULL;
-        else if (json_read_literal(j, "true"))
+        else if (json_read_literal(reader, "true"))
                 value->type = JSON_TYPE_TRUE;
-        else if (json_read_literal(j, "false"))
+        else if (json_read_literal(reader, "false"))
                 value->type = JSON_TYPE_FALSE;
-        else if (json_read_char(j, '{')) {
-                JsonObjectEntry *entry;
+        else if (json_read_char(reader, '{')) {
+                JsonValue object = { .type = JSON_TYPE_OBJECT };
 
-                value->type = JSON_TYPE_OBJECT;
+                object.object = calloc(1, sizeof(JsonObject));
 
-                while (json_read_object_entry(j, &entry)) {
-                        if (value->object.n_entries == value->object.n_alloced)
-                                value->object.entries = grow_pointer_array(value->object.entries, &value->object.n_alloced);
+                if (json_read_char(reader, '}')) {
+                        *value = object;
+                        return true;
+                }
 
-                        value->object.entries[value->object.n_entries] = entry;
-                        value->object.n_entries += 1;
+                while (json_read_object_entry(reader, json_object_reserve(object.object))) {
+                        object.object->n_entries += 1;
 
-                        if (!json_read_char(j, ','))
+                        if (!json_read_char(reader, ','))
                                 break;
                 }
 
-                if (!json_read_char(j, '}'))
+                if (!json_read_char(reader, '}')) {
+                        json_value_clear(&object);
                         return false;
+                }
 
-        } else if (json_read_char(j, '[')) {
-                JsonValue *element;
+                *value = object;
+                return true;
 
-                value->type = JSON_TYPE_ARRAY;
+        } else if (json_read_char(reader, '[')) {
+                JsonValue array = { .type = JSON_TYPE_ARRAY };
 
-                while (json_read_value(j, &element)) {
-                        if (value->array.n_elements == value->array.n_alloced)
-                                value->array.elements = grow_pointer_array(value->array.elements, &value->array.n_alloced);
+                if (json_read_char(reader, ']')) {
+                        *value = array;
+                        return true;
+                }
 
-                        value->array.elements[value->array.n_elements] = element;
-                        value->array.n_elements += 1;
+                // elements are parsed straight into their slot
+                while (json_read_value(reader, json_array_reserve(&array))) {
+                        array.n_elements += 1;
 
-                        if (!json_read_char(j, ','))
+                        if (!json_read_char(reader, ','))
                                 break;
                 }
 
-                if (!json_read_char(j, ']'))
+                if (!json_read_char(reader, ']')) {
+                        json_value_clear(&array);
                         return false;
+                }
+
+                *value = array;
+                return true;
 
         } else
                 return false;
 
+        value->kind = 0;
+        return true;
+}
+
+static int json_read_document(JsonReader *reader, JsonValue **valuep, unsigned expected_type) {
+        _cleanup_(json_value_freep) JsonValue *value = NULL;
+
+        value = calloc(1, sizeof(JsonValue));
+        if (!json_read_value(reader, value))
+                return -EINVAL;
+
+        if (expected_type > 0 && value->type != expected_type)
+                return -EINVAL;
+
+        skip_whitespace(reader);
+
         *valuep = value;
         value = NULL;
 
-        return true;
+        return 0;
 }
 
 int json_parse(const char *string, JsonValue **valuep, unsigned expected_type) {
         _cleanup_(json_value_freep) JsonValue *value = NULL;
+        JsonReader reader = { .p = string, .end = string + strlen(string) };
+        int r;
 
-        if (!json_read_value(&string, &value))
-                return -EINVAL;
+        r = json_read_document(&reader, &value, expected_type);
+        if (r < 0)
+                return r;
 
-        if (expected_type > 0 && value->type != expected_type)
+        if (*reader.p != '\0')
                 return -EINVAL;
 
-        skip_whitespace(&string);
-        if (*string != '\0')
+        *valuep = value;
+        value = NULL;
+
+        return 0;
+}
+
+int json_parse_in_place(char *string, size_t length, JsonValue **valuep, unsigned expected_type) {
+        _cleanup_(json_value_freep) JsonValue *value = NULL;
+        JsonReader reader = { .p = string, .end = string + length, .in_place = true };
+        int r;
+
+        assert(string[length] == '\0');
+
+        r = json_read_document(&reader, &value, expected_type);
+        if (r < 0)
+                return r;
+
+        // trailing garbage or an embedded NUL
+        if (reader.p != string + length)
                 return -EINVAL;
 
         *valuep = value;
@@ -366,6 +743,178 @@ int json_parse(const char *string, JsonValue **valuep, unsigned expected_type) {
         return 0;
 }
 
+
+void json_reader_init(JsonReader *reader, char *string, size_t length) {
+        assert(string[length] == '\0');
+
+        *reader = (JsonReader) { .p = string, .end = string + length, .in_place = true };
+}
+
+JsonType json_reader_peek(JsonReader *reader) {
+        skip_whitespace(reader);
+
+        switch (*reader->p) {
+                case '{':
+                        return JSON_TYPE_OBJECT;
+                case '[':
+                        return JSON_TYPE_ARRAY;
+                case '"':
+                        return JSON_TYPE_STRING;
+                case 't':
+                        return JSON_TYPE_TRUE;
+                case 'f':
+                        return JSON_TYPE_FALSE;
+                case 'n':
+                        return JSON_TYPE_NULL;
+                case '-':
+                case '0' ... '9':
+                        return JSON_TYPE_NUMBER;
+                default:
+                        return 0;
+        }
+}
+
+bool json_reader_begin_object(JsonReader *reader) {
+        if (!json_read_char(reader, '{'))
+                return false;
+
+        reader->first = true;
+        return true;
+}
+
+/* Consumes the separator in front of the next entry or element, or the
+ * closing bracket. */
+static int json_reader_next(JsonReader *reader, char close) {
+        if (json_read_char(reader, close)) {
+                // the enclosing container now has at least one element
+                reader->first = false;
+                return 0;
+        }
+
+        if (!reader->first) {
+                if (!json_read_char(reader, ','))
+                        return -EINVAL;
+
+                // tolerate a trailing comma, like json_parse()
+                if (json_read_char(reader, close))
+                        return 0;
+        }
+
+        reader->first = false;
+        return 1;
+}
+
+int json_reader_next_key(JsonReader *reader, const char **keyp) {
+        char *key;
+        bool borrowed;
+        int r;
+
+        r = json_reader_next(reader, '}');
+        if (r <= 0)
+                return r;
+
+        if (!json_read_string(reader, &key, &borrowed) || !json_read_char(reader, ':'))
+                return -EINVAL;
+
+        *keyp = key;
+        return 1;
+}
+
+bool json_reader_begin_array(JsonReader *reader) {
+        if (!json_read_char(reader, '['))
+                return false;
+
+        reader->first = true;
+        return true;
+}
+
+int json_reader_next_element(JsonReader *reader) {
+        return json_reader_next(reader, ']');
+}
+
+bool json_reader_read_string(JsonReader *reader, const char **stringp) {
+        char *string;
+        bool borrowed;
+
+        if (!json_read_string(reader, &string, &borrowed))
+                return false;
+
+        *stringp = string;
+        return true;
+}
+
+bool json_reader_read_number(JsonReader *reader, JsonNumber *numberp) {
+        if (json_reader_peek(reader) != JSON_TYPE_NUMBER)
+                return false;
+
+        return json_read_number(reader, numberp);
+}
+
+bool json_reader_read_boolean(JsonReader *reader, bool *bp) {
+        if (json_read_literal(reader, "true"))
+                *bp = true;
+        else if (json_read_literal(reader, "false"))
+                *bp = false;
+        else
+                return false;
+
+        return true;
+}
+
+bool json_reader_skip(JsonReader *reader) {
+        const char *end;
+        bool escaped;
+        int r;
+
+        switch (json_reader_peek(reader)) {
+                case JSON_TYPE_STRING:
+                        if (!json_scan_string_end(reader, &end, &escaped))
+                                return false;
+                        reader->p = end + 1;
+                        return true;
+
+                case JSON_TYPE_NUMBER:
+                        return json_read_number(reader, NULL);
+
+                case JSON_TYPE_TRUE:
+                        return json_read_literal(reader, "true");
+
+                case JSON_TYPE_FALSE:
+                        return json_read_literal(reader, "false");
+
+                case JSON_TYPE_NULL:
+                        return json_read_literal(reader, "null");
+
+                case JSON_TYPE_OBJECT:
+                        json_reader_begin_object(reader);
+                        while ((r = json_reader_next(reader, '}')) > 0) {
+                                if (!json_scan_string_end(reader, &end, &escaped))
+                                        return false;
+                                reader->p = end + 1;
+
+                                if (!json_read_char(reader, ':') || !json_reader_skip(reader))
+                                        return false;
+                        }
+                        return r == 0;
+
+                case JSON_TYPE_ARRAY:
+                        json_reader_begin_array(reader);
+                        while ((r = json_reader_next(reader, ']')) > 0)
+                                if (!json_reader_skip(reader))
+                                        return false;
+                        return r == 0;
+        }
+
+        return false;
+}
+
+bool json_reader_at_end(JsonReader *reader) {
+        skip_whitespace(reader);
+
+        return reader->p == reader->end;
+}
+
+
 JsonType json_value_get_type(const JsonValue *value) {
         return value->type;
 }
@@ -374,85 +923,252 @@ const char * json_value_get_string(JsonValue *value) {
         if (value->type != JSON_TYPE_STRING)
                 return NULL;
 
-        return value->string;
+        return json_value_string(value);
 }
 
-double json_value_get_number(JsonValue *value) {
+bool json_value_get_json_number(JsonValue *value, JsonNumber *numberp) {
         if (value->type != JSON_TYPE_NUMBER)
+                return false;
+
+        numberp->type = value->kind;
+        switch (value->kind) {
+                case JSON_NUMBER_INTEGER:
+                        numberp->integer = value->integer;
+                        break;
+                case JSON_NUMBER_UNSIGNED:
+                        numberp->unsigned_integer = value->unsigned_integer;
+                        break;
+                default:
+                        numberp->real = value->real;
+        }
+
+        return true;
+}
+
+double json_value_get_number(JsonValue *value) {
+        JsonNumber number;
+
+        if (!json_value_get_json_number(value, &number))
                 return 0.0;
 
-        return value->number;
+        return json_number_to_double(&number);
 }
 
-JsonValue * json_number_new(double number) {
+static JsonValue * json_value_new(JsonType type) {
         JsonValue *value;
 
         value = calloc(1, sizeof(JsonValue));
-        value->type = JSON_TYPE_NUMBER;
-        value->number = number;
+        value->type = type;
 
         return value;
 }
 
-JsonValue * json_string_new(const char *string) {
+JsonValue * json_number_new(double number) {
         JsonValue *value;
 
-        value = calloc(1, sizeof(JsonValue));
-        value->type = JSON_TYPE_STRING;
-        value->string = strdup(string);
+        value = json_value_new(JSON_TYPE_NUMBER);
+        value->kind = JSON_NUMBER_REAL;
+        value->real = number;
 
         return value;
 }
 
-JsonValue * json_boolean_new(bool b) {
+JsonValue * json_integer_new(int64_t integer) {
         JsonValue *value;
 
-        value = calloc(1, sizeof(JsonValue));
-        value->type = b ? JSON_TYPE_TRUE : JSON_TYPE_FALSE;
+        value = json_value_new(JSON_TYPE_NUMBER);
+        value->kind = JSON_NUMBER_INTEGER;
+        value->integer = integer;
 
         return value;
 }
 
-JsonValue * json_null_new(void) {
+JsonValue * json_unsigned_new(uint64_t integer) {
         JsonValue *value;
 
-        value = calloc(1, sizeof(JsonValue));
-        value->type = JSON_TYPE_NULL;
+        value = json_value_new(JSON_TYPE_NUMBER);
+        if (integer <= INT64_MAX) {
+                value->kind = JSON_NUMBER_INTEGER;
+                value->integer = integer;
+        } else {
+                value->kind = JSON_NUMBER_UNSIGNED;
+                value->unsigned_integer = integer;
+        }
+
+        return value;
+}
+
+static void json_value_set_string(JsonValue *value, const char *string) {
+        size_t len = strlen(string);
+
+        value->type = JSON_TYPE_STRING;
+
+        if (len <= JSON_SMALL_STRING_MAX) {
+                value->kind = JSON_STRING_SMALL;
+                memcpy(value->small, string, len + 1);
+        } else {
+                value->kind = JSON_STRING_HEAP;
+                value->string = memcpy(malloc(len + 1), string, len + 1);
+        }
+}
+
+JsonValue * json_string_new(const char *string) {
+        JsonValue *value;
+
+        value = json_value_new(JSON_TYPE_STRING);
+        json_value_set_string(value, string);
 
         return value;
 }
 
+JsonValue * json_boolean_new(bool b) {
+        return json_value_new(b ? JSON_TYPE_TRUE : JSON_TYPE_FALSE);
+}
+
+JsonValue * json_null_new(void) {
+        return json_value_new(JSON_TYPE_NULL);
+}
+
+// deep copies value into *copy, borrowed strings included
+static void json_value_copy_to(JsonValue *copy, const JsonValue *value) {
+        switch (value->type) {
+                case JSON_TYPE_STRING:
+                        json_value_set_string(copy, json_value_string(value));
+                        break;
+
+                case JSON_TYPE_OBJECT: {
+                        const JsonObject *object = value->object;
+
+                        *copy = (JsonValue) { .type = JSON_TYPE_OBJECT };
+                        copy->object = calloc(1, sizeof(JsonObject));
+                        copy->object->entries = malloc(object->n_entries * sizeof(JsonObjectEntry));
+                        copy->object->n_entries = copy->object->n_alloced = object->n_entries;
+
+                        for (size_t i = 0; i < object->n_entries; i++) {
+                                copy->object->entries[i].key = strdup(object->entries[i].key);
+                                copy->object->entries[i].borrowed = false;
+                                json_value_copy_to(&copy->object->entries[i].value, &object->entries[i].value);
+                        }
+                        break;
+                }
+
+                case JSON_TYPE_ARRAY:
+                        *copy = (JsonValue) { .type = JSON_TYPE_ARRAY, .n_elements = value->n_elements };
+                        copy->elements = malloc(json_array_capacity(value->n_elements) * sizeof(JsonValue));
+
+                        for (size_t i = 0; i < value->n_elements; i++)
+                                json_value_copy_to(&copy->elements[i], &value->elements[i]);
+                        break;
+
+                case JSON_TYPE_NUMBER:
+                case JSON_TYPE_TRUE:
+                case JSON_TYPE_FALSE:
+                case JSON_TYPE_NULL:
+                        *copy = *value;
+                        break;
+        }
+}
+
+JsonValue * json_value_copy(const JsonValue *value) {
+        JsonValue *copy;
+
+        copy = malloc(sizeof(JsonValue));
+        json_value_copy_to(copy, value);
+
+        return copy;
+}
+
 JsonValue * json_object_new(void) {
         JsonValue *value;
 
-        value = calloc(1, sizeof(JsonValue));
-        value->type = JSON_TYPE_OBJECT;
+        value = json_value_new(JSON_TYPE_OBJECT);
+        value->object = calloc(1, sizeof(JsonObject));
 
         return value;
 }
 
+/* Small objects are searched linearly. Larger ones get an open addressing
+ * index over the entry array the first time they are searched, so objects
+ * that are only built and written never pay for it. Later entries shadow
+ * earlier ones with the same key. */
+#define JSON_OBJECT_LINEAR_MAX 8
+
+static uint32_t json_hash(const char *key) {
+        uint32_t hash = 2166136261u;    // FNV-1a
+
+        for (; *key; key++)
+                hash = (hash ^ (unsigned char)*key) * 16777619u;
+
+        return hash;
+}
+
+static void json_object_index_add(JsonObject *object, size_t n) {
+        size_t mask = object->n_index - 1;
+        const char *key = object->entries[n].key;
+
+        for (size_t i = json_hash(key) & mask;; i = (i + 1) & mask) {
+                uint32_t slot = object->index[i];
+
+                if (slot == 0 || strcmp(object->entries[slot - 1].key, key) == 0) {
+                        object->index[i] = n + 1;
+                        return;
+                }
+        }
+}
+
+static void json_object_index_build(JsonObject *object) {
+        size_t n_index = 16;
+
+        while (n_index < 2 * object->n_entries)
+                n_index *= 2;
+
+        free(object->index);
+        object->index = calloc(n_index, sizeof(uint32_t));
+        object->n_index = n_index;
+
+        for (size_t n = 0; n < object->n_entries; n++)
+                json_object_index_add(object, n);
+}
+
+static JsonObjectEntry * json_object_find(JsonObject *object, const char *key) {
+        size_t mask;
+
+        if (object->n_entries <= JSON_OBJECT_LINEAR_MAX) {
+                for (size_t n = object->n_entries; n > 0; n--)
+                        if (strcmp(object->entries[n - 1].key, key) == 0)
+                                return &object->entries[n - 1];
+                return NULL;
+        }
+
+        if (!object->index)
+                json_object_index_build(object);
+
+        mask = object->n_index - 1;
+        for (size_t i = json_hash(key) & mask;; i = (i + 1) & mask) {
+                uint32_t slot = object->index[i];
+
+                if (slot == 0)
+                        return NULL;
+                if (strcmp(object->entries[slot - 1].key, key) == 0)
+                        return &object->entries[slot - 1];
+        }
+}
+
 bool json_object_lookup(JsonValue *value, const char *key, JsonValue **valuep, unsigned expected_type) {
-        JsonObjectEntry **entryp;
+        JsonObjectEntry *entry;
 
         if (value->type != JSON_TYPE_OBJECT)
                 return false;
 
-        if (!value->object.sorted) {
-                qsort(value->object.entries, value->object.n_entries, sizeof(JsonObjectEntry *),
-                                json_object_entry_compare);
-                value->object.sorted = true;
-        }
-
-        entryp = bsearch(key, value->object.entries, value->object.n_entries, sizeof(JsonObjectEntry *),
-                         json_object_entry_compare_key);
-        if (!entryp)
+        entry = json_object_find(value->object, key);
+        if (!entry)
                 return false;
 
-        if (expected_type > 0 && (*entryp)->value->type != expected_type)
+        if (expected_type > 0 && entry->value.type != expected_type)
                 return false;
 
         if (valuep)
-                *valuep = (*entryp)->value;
+                *valuep = &entry->value;
 
         return true;
 }
@@ -463,76 +1179,67 @@ bool json_object_lookup_string(JsonValue *value, const char *key, const char **s
         if (!json_object_lookup(value, key, &entry, JSON_TYPE_STRING))
                 return false;
 
-        *stringp = entry->string;
+        *stringp = json_value_string(entry);
 
         return true;
 }
 
 int json_object_insert(JsonValue *value, const char *key, JsonValue *element) {
+        JsonObject *object;
         JsonObjectEntry *entry;
 
         assert(value);
         assert(value->type == JSON_TYPE_OBJECT);
         assert(key);
-        assert(value);
+        assert(element);
 
-        entry = calloc(1, sizeof(JsonObjectEntry));
+        object = value->object;
+        entry = json_object_reserve(object);
 
         entry->key = strdup(key);
-        entry->value = element;
-
-        if (value->object.n_entries == value->object.n_alloced)
-                value->object.entries = grow_pointer_array(value->object.entries, &value->object.n_alloced);
-
-        value->object.entries[value->object.n_entries] = entry;
-        value->object.n_entries += 1;
-
-        value->object.sorted = false;
+        entry->borrowed = false;
+        entry->value = *element;
+        free(element);
+
+        object->n_entries += 1;
+
+        // keep an existing index up to date while it is at most half full
+        if (object->index) {
+                if (2 * object->n_entries <= object->n_index)
+                        json_object_index_add(object, object->n_entries - 1);
+                else {
+                        free(object->index);
+                        object->index = NULL;
+                }
+        }
 
         return 0;
 }
 
 int json_object_insert_string(JsonValue *value, const char *key, const char *string) {
-        _cleanup_(json_value_freep) JsonValue *element = NULL;
-        int r;
-
-        element = calloc(1, sizeof(JsonValue));
-        element->type = JSON_TYPE_STRING;
-        element->string = strdup(string);
-
-        r = json_object_insert(value, key, element);
-        if (r < 0)
-                return r;
-
-        element = NULL;
-
-        return 0;
+        return json_object_insert(value, key, json_string_new(string));
 }
 
 JsonValue * json_array_new(void) {
-        JsonValue *value;
-
-        value = calloc(1, sizeof(JsonValue));
-        value->type = JSON_TYPE_ARRAY;
-
-        return value;
+        return json_value_new(JSON_TYPE_ARRAY);
 }
 
 size_t json_array_get_length(JsonValue *value) {
-        return value->array.n_elements;
+        return value->n_elements;
 }
 
 bool json_array_get(JsonValue *value, size_t index, JsonValue **valuep, unsigned expected_type) {
         JsonValue *element;
 
-        if (index >= value->array.n_elements)
+        if (index >= value->n_elements)
                 return false;
 
-        element = value->array.elements[index];
+        element = &value->elements[index];
         if (expected_type > 0 && element->type != expected_type)
                 return false;
 
-        *valuep = element;
+        if (valuep)
+                *valuep = element;
 
         return true;
 }
@@ -542,47 +1249,58 @@ int json_array_append(JsonValue *value, JsonValue *element) {
         assert(value->type == JSON_TYPE_ARRAY);
         assert(element);
 
-        if (value->array.n_elements == value->array.n_alloced)
-                value->array.elements = grow_pointer_array(value->array.elements, &value->array.n_alloced);
+        *json_array_reserve(value) = *element;
+        free(element);
 
-        value->array.elements[value->array.n_elements] = element;
-        value->array.n_elements += 1;
+        value->n_elements += 1;
 
         return 0;
 }
 
 static void json_print_string(const char *string, FILE *f) {
-        const char *p;
+        const char *p = string;
+        const char *end = string + strlen(string);
 
         fputc('"', f);
 
-        for (p = string; *p; p++) {
-                if (*p == '"')
-                        fputs("\\\"", f);
-
-                else if (*p == '\\')
-                        fputs("\\\\", f);
-
-                else if (*p == '/')
-                        fputs("\\/", f);
-
-                else if (*p == '\b')
-                        fputs("\\b", f);
+        for (;;) {
+                const char *special = json_scan_escape(p, end);
 
-                else if (*p == '\f')
-                        fputs("\\f", f);
-
-                else if (*p == '\n')
-                        fputs("\\n", f);
-
-                else if (*p == '\r')
-                        fputs("\\r", f);
+                fwrite(p, 1, special - p, f);
+                if (special == end)
+                        break;
 
-                else if (*p == '\t')
-                        fputs("\\t", f);
+                switch (*special) {
+                        case '"':
+                                fputs("\\\"", f);
+                                break;
+                        case '\\':
+                                fputs("\\\\", f);
+                                break;
+                        case '/':
+                                fputs("\\/", f);
+                                break;
+                        case '\b':
+                                fputs("\\b", f);
+                                break;
+                        case '\f':
+                                fputs("\\f", f);
+                                break;
+                        case '\n':
+                                fputs("\\n", f);
+                                break;
+                        case '\r':
+                                fputs("\\r", f);
+                                break;
+                        case '\t':
+                                fputs("\\t", f);
+                                break;
+                        default:
+                                fprintf(f, "\\u%04x", (unsigned char)*special);
+                                break;
+                }
 
-                else
-                        fprintf(f, "%c", *p);
+                p = special + 1;
         }
 
         fputc('"', f);
@@ -591,20 +1309,17 @@ static void json_print_string(const char *string, FILE *f) {
 void json_print(JsonValue *value, FILE *f) {
         switch (value->type) {
                 case JSON_TYPE_STRING:
-                        json_print_string(value->string, f);
+                        json_print_string(json_value_string(value), f);
                         break;
 
                 case JSON_TYPE_OBJECT:
-                        /* force sorting */
-                        json_object_lookup(value, "", NULL, 0);
-
                         fputs("{ ", f);
-                        for (size_t i = 0; i < value->object.n_entries; i++) {
-                                json_print_string(value->object.entries[i]->key, f);
+                        for (size_t i = 0; i < value->object->n_entries; i++) {
+                                json_print_string(value->object->entries[i].key, f);
                                 fputs(": ", f);
-                                json_print(value->object.entries[i]->value, f);
+                                json_print(&value->object->entries[i].value, f);
 
-                                if (i < value->object.n_entries - 1)
+                                if (i < value->object->n_entries - 1)
                                         fputs(", ", f);
                         }
                         fputs(" }", f);
@@ -612,17 +1327,26 @@ void json_print(JsonValue *value, FILE *f) {
 
                 case JSON_TYPE_ARRAY:
                         fputs("[ ", f);
-                        for (size_t i = 0; i < value->array.n_elements; i++) {
-                                json_print(value->array.elements[i], f);
+                        for (size_t i = 0; i < value->n_elements; i++) {
+                                json_print(&value->elements[i], f);
 
-                                if (i < value->array.n_elements - 1)
+                                if (i < value->n_elements - 1)
                                         fputs(", ", f);
                         }
                         fputs(" ]", f);
                         break;
 
                 case JSON_TYPE_NUMBER:
-                        fprintf(f, "%.30g", value->number);
+                        switch (value->kind) {
+                                case JSON_NUMBER_INTEGER:
+                                        fprintf(f, "%" PRId64, value->integer);
+                                        break;
+                                case JSON_NUMBER_UNSIGNED:
+                                        fprintf(f, "%" PRIu64, value->unsigned_integer);
+                                        break;
+                                default:
+                                        fprintf(f, "%.30g", value->real);
+                        }
                         break;
 
                 case JSON_TYPE_TRUE:
@@ -664,8 +1388,8 @@ void json_object_iterator_freep(JsonObjectIterator **joiter) {
 }
 
 JsonObjectEntry* json_object_iterator_next(JsonObjectIterator* joiter){
-        if(joiter->jobject->object.n_entries > joiter->index){
-                JsonObjectEntry* joe = joiter->jobject->object.entries[joiter->index];
+        if(joiter->jobject->object->n_entries > joiter->index){
+                JsonObjectEntry* joe = &joiter->jobject->object->entries[joiter->index];
                 joiter->index++;
                 return joe;
         }
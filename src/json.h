@@ -1,11 +1,15 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 
 typedef enum JsonType JsonType;
+typedef enum JsonNumberType JsonNumberType;
+typedef struct JsonNumber JsonNumber;
 typedef struct JsonValue JsonValue;
+typedef struct JsonReader JsonReader;
 
 enum JsonType {
         JSON_TYPE_OBJECT = 1,
@@ -17,20 +21,79 @@ enum JsonType {
         JSON_TYPE_NULL
 };
 
+/* Numbers without fraction or exponent that fit into 64 bits are kept
+ * exactly, everything else is a double. */
+enum JsonNumberType {
+        JSON_NUMBER_REAL,
+        JSON_NUMBER_INTEGER,            // fits int64_t
+        JSON_NUMBER_UNSIGNED,           // above INT64_MAX
+};
+
+struct JsonNumber {
+        JsonNumberType type;
+        union {
+                double real;
+                int64_t integer;
+                uint64_t unsigned_integer;
+        };
+};
+
+bool json_number_parse(const char *string, JsonNumber *numberp);
+double json_number_to_double(const JsonNumber *number);
+// these fail unless the number is integral and in range
+bool json_number_to_int64(const JsonNumber *number, int64_t *valuep);
+bool json_number_to_uint64(const JsonNumber *number, uint64_t *valuep);
+
 int json_parse(const char *string, JsonValue **valuep, unsigned expected_type);
+// string[length] must be '\0'. The returned tree references string, which
+// has to outlive it and is modified.
+int json_parse_in_place(char *string, size_t length, JsonValue **valuep, unsigned expected_type);
+
+/* A pull reader that walks a document in place without building a tree.
+ * Strings are unescaped inside the input, which has to outlive them, and
+ * json_reader_skip() leaves the input untouched. A JsonReader may be copied
+ * to come back to a value later. */
+struct JsonReader {
+        const char *p;
+        const char *end;        // the terminating '\0'
+        bool in_place;
+        bool first;             // no element read yet from the innermost container
+};
+
+void json_reader_init(JsonReader *reader, char *string, size_t length);
+JsonType json_reader_peek(JsonReader *reader);
+bool json_reader_begin_object(JsonReader *reader);
+// returns 1 and the key if another entry follows, 0 after the closing '}'
+int json_reader_next_key(JsonReader *reader, const char **keyp);
+bool json_reader_begin_array(JsonReader *reader);
+// returns 1 if another element follows, 0 after the closing ']'
+int json_reader_next_element(JsonReader *reader);
+bool json_reader_read_string(JsonReader *reader, const char **stringp);
+bool json_reader_read_number(JsonReader *reader, JsonNumber *numberp);
+bool json_reader_read_boolean(JsonReader *reader, bool *bp);
+bool json_reader_skip(JsonReader *reader);
+bool json_reader_at_end(JsonReader *reader);
 
 JsonValue * json_value_free(JsonValue *value);
 void json_value_freep(JsonValue **valuep);
 JsonType json_value_get_type(const JsonValue *value);
+JsonValue * json_value_copy(const JsonValue *value);
 
 const char * json_value_get_string(JsonValue *value);
 double json_value_get_number(JsonValue *value);
+bool json_value_get_json_number(JsonValue *value, JsonNumber *numberp);
 
 JsonValue * json_number_new(double number);
+JsonValue * json_integer_new(int64_t integer);
+JsonValue * json_unsigned_new(uint64_t integer);
 JsonValue * json_string_new(const char *string);
 JsonValue * json_boolean_new(bool b);
 JsonValue * json_null_new(void);
 
+/* Containers hold their members inline: inserting or appending moves the
+ * element into the container, and pointers to members returned by lookups,
+ * json_array_get() and iterators are only valid until the container that
+ * holds them is modified. */
 JsonValue * json_object_new(void);
 bool json_object_lookup(JsonValue *value, const char *key, JsonValue **valuep, unsigned expected_type);
 bool json_object_lookup_string(JsonValue *value, const char *key, const char **stringp);
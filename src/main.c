@@ -4,6 +4,7 @@
 #include <string.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <systemd/sd-bus.h>
 #include <systemd/sd-event.h>
 #include <unistd.h>
@@ -11,17 +12,34 @@
 #include "systemd-compat.h"
 #include "environment.h"
 #include "dbus-http.h"
+#include "events.h"
+#include "watch.h"
 #include "log.h"
 
 
 #define _cleanup_(fn) __attribute__((__cleanup__(fn)))
 
 const char default_www_dir[] = "/usr/share/dbus-http/www";
+const size_t default_event_queue_limit = 1024 * 1024;
+const int default_compression_level = 6;
+const size_t default_compression_threshold = 1024;
+const size_t default_max_body_size = 16 * 1024 * 1024;
+const char default_upload_dir[] = "/tmp";
+const uint64_t default_upload_max_size = 1024 * 1024 * 1024;
+const size_t default_upload_buffer_size = 64 * 1024;
 
 typedef struct {
         bool session_bus;
         uint16_t http_port;
         char *www_dir;
+        size_t event_queue_limit;
+        EventQueuePolicy event_queue_policy;
+        int compression_level;
+        size_t compression_threshold;
+        size_t max_body_size;
+        char *upload_dir;
+        uint64_t upload_max_size;
+        size_t upload_buffer_size;
 } CmdArgs;
 
 
@@ -31,6 +49,7 @@ static void cmd_args_free(CmdArgs **cmd_args) {
                         free((*cmd_args)->www_dir);
                         (*cmd_args)->www_dir = NULL;
                 }
+                free((*cmd_args)->upload_dir);
                 free(*cmd_args);
                 *cmd_args = NULL;
         }
@@ -56,8 +75,16 @@ static CmdArgs* cmd_args_new (int argc, char **argv) {
         cmd_args->session_bus = false;
         cmd_args->http_port = 80;
         cmd_args->www_dir = NULL;
+        cmd_args->event_queue_limit = default_event_queue_limit;
+        cmd_args->event_queue_policy = EVENT_QUEUE_DROP_OLDEST;
+        cmd_args->compression_level = default_compression_level;
+        cmd_args->compression_threshold = default_compression_threshold;
+        cmd_args->max_body_size = default_max_body_size;
+        cmd_args->upload_dir = NULL;
+        cmd_args->upload_max_size = default_upload_max_size;
+        cmd_args->upload_buffer_size = default_upload_buffer_size;
 
-        while ((short_arg = getopt (argc, argv, "sp:v:w:h")) != -1) {
+        while ((short_arg = getopt (argc, argv, "sp:v:w:q:Q:z:Z:b:u:U:P:h")) != -1) {
                 switch (short_arg)
                 {
                 case 's':
@@ -96,11 +123,116 @@ static CmdArgs* cmd_args_new (int argc, char **argv) {
                                 return NULL;
                         }
                         break;
+                case 'q': {
+                        char *tail_ptr;
+                        unsigned long long limit;
+                        limit = strtoull(optarg, &tail_ptr, 10);
+                        if(*optarg != '-' && *tail_ptr == 0) {
+                                cmd_args->event_queue_limit = limit;
+                        } else {
+                                puts("event queue limit must be a number of bytes, 0 for no limit");
+                                cmd_args_free(&cmd_args);
+                                return NULL;
+                        }
+                        break;
+                }
+                case 'Q':
+                        if(event_queue_policy_from_string(optarg, &cmd_args->event_queue_policy) < 0) {
+                                printf("event queue policy must be one of: ");
+                                event_queue_policy_print();
+                                puts("");
+                                cmd_args_free(&cmd_args);
+                                return NULL;
+                        }
+                        break;
+                case 'z': {
+                        char *tail_ptr;
+                        long level;
+                        level = strtol(optarg, &tail_ptr, 10);
+                        if(level >= 0 && level <= 9 && *tail_ptr == 0) {
+                                cmd_args->compression_level = level;
+                        } else {
+                                puts("compression level must be 0..9, 0 to never compress");
+                                cmd_args_free(&cmd_args);
+                                return NULL;
+                        }
+                        break;
+                }
+                case 'Z': {
+                        char *tail_ptr;
+                        unsigned long long threshold;
+                        threshold = strtoull(optarg, &tail_ptr, 10);
+                        if(*optarg != '-' && *tail_ptr == 0) {
+                                cmd_args->compression_threshold = threshold;
+                        } else {
+                                puts("compression threshold must be a number of bytes");
+                                cmd_args_free(&cmd_args);
+                                return NULL;
+                        }
+                        break;
+                }
+                case 'b': {
+                        char *tail_ptr;
+                        unsigned long long max;
+                        max = strtoull(optarg, &tail_ptr, 10);
+                        if(*optarg != '-' && *tail_ptr == 0) {
+                                cmd_args->max_body_size = max;
+                        } else {
+                                puts("request body limit must be a number of bytes");
+                                cmd_args_free(&cmd_args);
+                                return NULL;
+                        }
+                        break;
+                }
+                case 'u':
+                        free(cmd_args->upload_dir);
+                        cmd_args->upload_dir = strdup(optarg);
+                        break;
+                case 'U': {
+                        char *tail_ptr;
+                        unsigned long long max;
+                        max = strtoull(optarg, &tail_ptr, 10);
+                        if(*optarg != '-' && *tail_ptr == 0) {
+                                cmd_args->upload_max_size = max;
+                        } else {
+                                puts("upload limit must be a number of bytes");
+                                cmd_args_free(&cmd_args);
+                                return NULL;
+                        }
+                        break;
+                }
+                case 'P': {
+                        char *tail_ptr;
+                        unsigned long long size;
+                        size = strtoull(optarg, &tail_ptr, 10);
+                        // MHD needs at least 256 bytes to parse the form
+                        if(*optarg != '-' && *tail_ptr == 0 && size >= 256) {
+                                cmd_args->upload_buffer_size = size;
+                        } else {
+                                puts("upload buffer size must be at least 256 bytes");
+                                cmd_args_free(&cmd_args);
+                                return NULL;
+                        }
+                        break;
+                }
                 // Invalid argument or -h -?...
                 default:
                         puts("-s run on session DBUS");
                         puts("-p 0..32767 HTTP port (default 80)");
                         printf("-w folder exported by file server (default %s)\n", default_www_dir);
+                        printf("-q bytes queued per event stream before -Q applies, 0 for no limit (default %zu)\n",
+                               default_event_queue_limit);
+                        printf("-Q [");
+                        event_queue_policy_print();
+                        puts("] what to do with slow event stream clients (default drop-oldest)");
+                        printf("-z 0..9 compression level of replies for clients that accept gzip or deflate, 0 to never compress (default %d)\n",
+                               default_compression_level);
+                        printf("-Z bytes smallest reply that is compressed (default %zu)\n", default_compression_threshold);
+                        printf("-b bytes largest POST body, 0 for no limit (default %zu)\n", default_max_body_size);
+                        printf("-u folder where files posted to /filepost are stored (default %s)\n", default_upload_dir);
+                        printf("-U bytes largest upload to /filepost, 0 for no limit (default %" PRIu64 ")\n",
+                               default_upload_max_size);
+                        printf("-P bytes buffer of the upload form parser (default %zu)\n", default_upload_buffer_size);
                         printf("-v [");
                         log_print_levels();
                         puts("]");
@@ -112,16 +244,6 @@ static CmdArgs* cmd_args_new (int argc, char **argv) {
 }
 
 
-HttpGetHandler *get_handlers[] = {
-                handle_get_dbus,
-                NULL
-};
-
-HttpPostHandler *post_handlers[] = {
-                handle_post_dbus,
-                NULL
-};
-
 int main(int argc, char **argv) {
         _cleanup_(sd_event_unrefp) sd_event *loop = NULL;
         _cleanup_(sd_bus_unrefp) sd_bus *bus = NULL;
@@ -161,16 +283,41 @@ int main(int argc, char **argv) {
                 goto finish;
 
         // Initialize the Server Environment
-        env = malloc(sizeof *env);
+        env = calloc(1, sizeof *env);
         if (env == NULL) {
                 puts("failed to allocate memory.");
                 goto finish;
         }
         env->bus = bus;
         env->dbus_prefix = "/dbus/";
+        env->events_prefix = "/events/";
+        env->watch_prefix = "/watch/";
+
+        r = signal_registry_new(&env->signals, bus);
+        if (r < 0)
+                goto finish;
+
+        r = event_streams_new(&env->events, cmd_args->event_queue_limit, cmd_args->event_queue_policy);
+        if (r < 0)
+                goto finish;
 
-        r = http_server_new(&server, cmd_args->http_port, loop, get_handlers, post_handlers, env,
-                        cmd_args_get_www_dir(cmd_args));
+        r = watch_registry_new(&env->watches, bus, env->signals);
+        if (r < 0)
+                goto finish;
+
+        r = http_server_new(&server, cmd_args->http_port, loop, env, cmd_args_get_www_dir(cmd_args));
+        if (r < 0)
+                goto finish;
+
+        http_server_add_get_route(server, env->dbus_prefix, handle_get_dbus);
+        http_server_add_post_route(server, env->dbus_prefix, handle_post_dbus);
+        http_server_add_get_route(server, env->events_prefix, handle_get_events);
+        http_server_add_get_route(server, env->watch_prefix, handle_get_watch);
+
+        http_server_set_compression(server, cmd_args->compression_level, cmd_args->compression_threshold);
+        http_server_set_max_body_size(server, cmd_args->max_body_size);
+        r = http_server_set_upload(server, cmd_args->upload_dir ? cmd_args->upload_dir : default_upload_dir,
+                                   cmd_args->upload_max_size, cmd_args->upload_buffer_size);
         if (r < 0)
                 goto finish;
 
@@ -183,8 +330,18 @@ finish:
                 log_emerg("Failure: %s\n", strerror(-r));
 
         cmd_args_free(&cmd_args);
-        if(env)
+        // streams still hold subscriptions, stop the server first
+        if (server)
+                server = http_server_free(server);
+        if(env) {
+                if (env->watches)
+                        watch_registry_free(env->watches);
+                if (env->events)
+                        event_streams_free(env->events);
+                if (env->signals)
+                        signal_registry_free(env->signals);
                 free(env);
+        }
 
         return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 }
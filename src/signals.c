@@ -0,0 +1,503 @@
+#include "signals.h"
+#include "dbus-http.h"
+#include "json.h"
+#include "json-writer.h"
+#include "log.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <systemd/sd-event.h>
+
+#define _cleanup_(fn) __attribute__((__cleanup__(fn)))
+
+#define USEC_PER_SEC 1000000ULL
+
+// recent signals kept per match for clients resuming with Last-Event-ID
+#define SIGNAL_REPLAY_LENGTH 64
+// how long a match outlives its last subscriber, to bridge reconnects
+#define SIGNAL_LINGER_SEC 30
+
+struct SignalRegistry {
+        sd_bus *bus;
+        SignalMatch **matches;
+        size_t n_matches;
+        size_t n_alloced_matches;
+        uint64_t linger_usec;
+};
+
+/* One sd_bus match per distinct rule. Every subscriber holds a reference,
+ * the bus match is removed a while (SIGNAL_LINGER_SEC by default) after the
+ * last subscriber left.
+ * The most recent signals stay in a ring, so that reconnecting clients
+ * receive what they missed instead of refetching all state. */
+struct SignalMatch {
+        SignalRegistry *registry;
+        char *rule;
+        sd_bus_slot *slot;
+        SignalSubscriber **subscribers;         // NULL for those that left during dispatch
+        size_t n_subscribers;
+        size_t n_alloced_subscribers;
+        bool dispatching;
+        uint64_t epoch;
+        uint64_t next_seq;
+        SignalBuffer *replay[SIGNAL_REPLAY_LENGTH];
+        size_t replay_start;
+        size_t n_replay;
+        sd_event_source *linger_timer;
+};
+
+static void * grow_pointer_array(void *array, size_t *allocedp) {
+        if (*allocedp == 0)
+                *allocedp = 8;
+        else
+                *allocedp *= 2;
+
+        return realloc(array, *allocedp * sizeof(void *));
+}
+
+SignalBuffer * signal_buffer_ref(SignalBuffer *buffer) {
+        buffer->n_ref += 1;
+        return buffer;
+}
+
+SignalBuffer * signal_buffer_unref(SignalBuffer *buffer) {
+        assert(buffer->n_ref > 0);
+
+        buffer->n_ref -= 1;
+        if (buffer->n_ref == 0) {
+                free(buffer->changed_path);
+                free(buffer->changed_interface);
+                free(buffer->data);
+                free(buffer);
+        }
+
+        return NULL;
+}
+
+static SignalBuffer * signal_buffer_new_from_buffer(Buffer *data) {
+        SignalBuffer *buffer;
+
+        buffer = calloc(1, sizeof(SignalBuffer));
+        buffer->n_ref = 1;
+        buffer->data = buffer_steal(data, &buffer->size);
+
+        return buffer;
+}
+
+SignalBuffer * signal_buffer_new(JsonValue *json) {
+        _cleanup_(buffer_clear) Buffer data = {};
+        JsonWriter writer;
+
+        json_writer_init(&writer, &data);
+        json_writer_value(&writer, json);
+
+        return signal_buffer_new_from_buffer(&data);
+}
+
+/* Coalescing event streams compare PropertiesChanged signals by object and
+ * interface. Both are noted here, so that queued signals need not be parsed
+ * again to find the ones to fold. */
+static int signal_buffer_note_properties_changed(SignalBuffer *buffer, sd_bus_message *message) {
+        const char *interface;
+        int r;
+
+        if (sd_bus_message_is_signal(message, "org.freedesktop.DBus.Properties", "PropertiesChanged") <= 0 ||
+            !sd_bus_message_has_signature(message, "sa{sv}as"))
+                return 0;
+
+        r = sd_bus_message_rewind(message, true);
+        if (r < 0)
+                return r;
+
+        r = sd_bus_message_read_basic(message, SD_BUS_TYPE_STRING, &interface);
+        if (r < 0)
+                return r;
+
+        buffer->changed_path = strdup(sd_bus_message_get_path(message));
+        buffer->changed_interface = strdup(interface);
+        return 0;
+}
+
+static int signal_buffer_new_from_message(SignalBuffer **bufferp, sd_bus_message *message) {
+        _cleanup_(buffer_clear) Buffer data = {};
+        JsonWriter writer;
+        SignalBuffer *buffer;
+        int r;
+
+        // other matches may have read this message already
+        r = sd_bus_message_rewind(message, true);
+        if (r < 0)
+                return r;
+
+        json_writer_init(&writer, &data);
+        json_writer_begin_object(&writer);
+
+        json_writer_key(&writer, "arguments");
+        json_writer_begin_array(&writer);
+        while (!sd_bus_message_at_end(message, false)) {
+                r = bus_message_element_write_json(message, &writer, 0);
+                if (r < 0)
+                        return r;
+        }
+        json_writer_end_array(&writer);
+
+        if (sd_bus_message_get_sender(message)) {
+                json_writer_key(&writer, "sender");
+                json_writer_string(&writer, sd_bus_message_get_sender(message));
+        }
+        json_writer_key(&writer, "path");
+        json_writer_string(&writer, sd_bus_message_get_path(message));
+        json_writer_key(&writer, "interface");
+        json_writer_string(&writer, sd_bus_message_get_interface(message));
+        json_writer_key(&writer, "member");
+        json_writer_string(&writer, sd_bus_message_get_member(message));
+
+        json_writer_end_object(&writer);
+
+        buffer = signal_buffer_new_from_buffer(&data);
+
+        r = signal_buffer_note_properties_changed(buffer, message);
+        if (r < 0) {
+                signal_buffer_unref(buffer);
+                return r;
+        }
+
+        *bufferp = buffer;
+        return 0;
+}
+
+static void signal_match_remember(SignalMatch *match, SignalBuffer *buffer) {
+        size_t index;
+
+        if (match->n_replay == SIGNAL_REPLAY_LENGTH) {
+                signal_buffer_unref(match->replay[match->replay_start]);
+                match->replay_start = (match->replay_start + 1) % SIGNAL_REPLAY_LENGTH;
+                match->n_replay -= 1;
+        }
+
+        index = (match->replay_start + match->n_replay) % SIGNAL_REPLAY_LENGTH;
+        match->replay[index] = signal_buffer_ref(buffer);
+        match->n_replay += 1;
+}
+
+static void signal_match_linger(SignalMatch *match);
+
+/* Drops the slots cleared during dispatch. Only a match that lost its last
+ * subscriber in this dispatch starts lingering, one that was lingering
+ * already must not have its deadline pushed out by every signal. */
+static void signal_match_compact(SignalMatch *match, bool had_subscribers) {
+        size_t n = 0;
+
+        for (size_t i = 0; i < match->n_subscribers; i++) {
+                if (match->subscribers[i])
+                        match->subscribers[n++] = match->subscribers[i];
+        }
+        match->n_subscribers = n;
+
+        if (had_subscribers && match->n_subscribers == 0)
+                signal_match_linger(match);
+}
+
+static int signal_match_handler(sd_bus_message *message, void *userdata, sd_bus_error *ret_error) {
+        SignalMatch *match = userdata;
+        SignalBuffer *buffer;
+        size_t n;
+        bool had_subscribers;
+        int r;
+
+        // serialize once, every subscriber takes its own reference
+        r = signal_buffer_new_from_message(&buffer, message);
+        if (r < 0) {
+                log_err("Serializing signal %s.%s failed: %s", sd_bus_message_get_interface(message),
+                        sd_bus_message_get_member(message), strerror(-r));
+                return 0;
+        }
+
+        buffer->seq = match->next_seq++;
+        snprintf(buffer->id, sizeof(buffer->id), "%" PRIu64 "-%" PRIu64, match->epoch, buffer->seq);
+        signal_match_remember(match, buffer);
+
+        log_debug("Dispatching signal to %zu subscribers of %s", match->n_subscribers, match->rule);
+
+        /* A subscriber may leave while another one is being delivered to.
+         * Its slot is cleared instead of being refilled from the end, and
+         * the match neither lingers nor is freed before the loop is done.
+         * Subscribers that join meanwhile only receive the next signal. */
+        n = match->n_subscribers;
+        had_subscribers = n > 0;
+        match->dispatching = true;
+        for (size_t i = 0; i < n; i++) {
+                if (match->subscribers[i])
+                        match->subscribers[i]->deliver(match->subscribers[i], buffer);
+        }
+        match->dispatching = false;
+
+        signal_match_compact(match, had_subscribers);
+
+        signal_buffer_unref(buffer);
+        return 0;
+}
+
+static SignalMatch * signal_match_free(SignalMatch *match) {
+        if (match->slot)
+                sd_bus_slot_unref(match->slot);
+        if (match->linger_timer)
+                sd_event_source_unref(match->linger_timer);
+
+        for (size_t i = 0; i < match->n_replay; i++)
+                signal_buffer_unref(match->replay[(match->replay_start + i) % SIGNAL_REPLAY_LENGTH]);
+
+        free(match->rule);
+        free(match->subscribers);
+        free(match);
+
+        return NULL;
+}
+
+int signal_registry_new(SignalRegistry **registryp, sd_bus *bus) {
+        SignalRegistry *registry;
+
+        registry = calloc(1, sizeof(SignalRegistry));
+        if (!registry)
+                return -ENOMEM;
+
+        registry->bus = bus;
+        registry->linger_usec = SIGNAL_LINGER_SEC * USEC_PER_SEC;
+
+        *registryp = registry;
+        return 0;
+}
+
+SignalRegistry * signal_registry_free(SignalRegistry *registry) {
+        for (size_t i = 0; i < registry->n_matches; i++)
+                signal_match_free(registry->matches[i]);
+
+        free(registry->matches);
+        free(registry);
+
+        return NULL;
+}
+
+void signal_registry_freep(SignalRegistry **registryp) {
+        if (*registryp)
+                signal_registry_free(*registryp);
+}
+
+void signal_registry_set_linger_time(SignalRegistry *registry, uint64_t usec) {
+        registry->linger_usec = usec;
+}
+
+size_t signal_registry_get_n_matches(SignalRegistry *registry) {
+        return registry->n_matches;
+}
+
+static int match_rule_append(FILE *f, const char *key, const char *value) {
+        if (!value)
+                return 0;
+
+        if (strchr(value, '\'') || strchr(value, ','))
+                return -EINVAL;
+
+        fprintf(f, ",%s='%s'", key, value);
+        return 0;
+}
+
+/* Builds the rule with a fixed key order, so equal subscriptions map onto the
+ * same string and thus onto the same bus match. */
+int signal_match_rule_new(char **rulep, const char *sender, const char *path, const char *interface, const char *member) {
+        char *rule = NULL;
+        size_t size;
+        FILE *f;
+        int r = 0;
+
+        f = open_memstream(&rule, &size);
+        fputs("type='signal'", f);
+
+        if (match_rule_append(f, "sender", sender) < 0 ||
+            match_rule_append(f, "path", path) < 0 ||
+            match_rule_append(f, "interface", interface) < 0 ||
+            match_rule_append(f, "member", member) < 0)
+                r = -EINVAL;
+
+        fclose(f);
+
+        if (r < 0) {
+                free(rule);
+                return r;
+        }
+
+        *rulep = rule;
+        return 0;
+}
+
+static SignalMatch * signal_registry_find_match(SignalRegistry *registry, const char *rule) {
+        for (size_t i = 0; i < registry->n_matches; i++) {
+                if (strcmp(registry->matches[i]->rule, rule) == 0)
+                        return registry->matches[i];
+        }
+
+        return NULL;
+}
+
+int signal_registry_subscribe(SignalRegistry *registry, const char *rule, SignalSubscriber *subscriber) {
+        SignalMatch *match;
+        int r;
+
+        assert(subscriber->deliver);
+        assert(!subscriber->match);
+
+        match = signal_registry_find_match(registry, rule);
+        if (!match) {
+                struct timespec ts;
+
+                match = calloc(1, sizeof(SignalMatch));
+                match->registry = registry;
+                match->rule = strdup(rule);
+
+                // wall clock based, so that event ids do not repeat across restarts
+                clock_gettime(CLOCK_REALTIME, &ts);
+                match->epoch = (uint64_t)ts.tv_sec * USEC_PER_SEC + ts.tv_nsec / 1000;
+                match->next_seq = 1;
+
+                r = sd_bus_add_match(registry->bus, &match->slot, rule, signal_match_handler, match);
+                if (r < 0) {
+                        log_err("Adding match %s failed: %s", rule, strerror(-r));
+                        signal_match_free(match);
+                        return r;
+                }
+
+                if (registry->n_matches == registry->n_alloced_matches)
+                        registry->matches = grow_pointer_array(registry->matches, &registry->n_alloced_matches);
+                registry->matches[registry->n_matches] = match;
+                registry->n_matches += 1;
+
+                log_debug("Installed match %s", rule);
+        } else if (match->linger_timer)
+                sd_event_source_set_enabled(match->linger_timer, SD_EVENT_OFF);
+
+        if (match->n_subscribers == match->n_alloced_subscribers)
+                match->subscribers = grow_pointer_array(match->subscribers, &match->n_alloced_subscribers);
+        match->subscribers[match->n_subscribers] = subscriber;
+        match->n_subscribers += 1;
+
+        subscriber->match = match;
+
+        log_debug("Match %s has %zu subscribers", rule, match->n_subscribers);
+        return 0;
+}
+
+static void signal_registry_remove_match(SignalRegistry *registry, SignalMatch *match) {
+        for (size_t i = 0; i < registry->n_matches; i++) {
+                if (registry->matches[i] == match) {
+                        registry->matches[i] = registry->matches[registry->n_matches - 1];
+                        registry->n_matches -= 1;
+                        break;
+                }
+        }
+
+        log_debug("Removed match %s", match->rule);
+        signal_match_free(match);
+}
+
+static int signal_match_linger_handler(sd_event_source *source, uint64_t usec, void *userdata) {
+        SignalMatch *match = userdata;
+
+        signal_registry_remove_match(match->registry, match);
+        return 0;
+}
+
+static void signal_match_linger(SignalMatch *match) {
+        sd_event *event = sd_bus_get_event(match->registry->bus);
+        uint64_t usec = 0;
+        int r;
+
+        sd_event_now(event, CLOCK_MONOTONIC, &usec);
+        usec += match->registry->linger_usec;
+
+        if (match->linger_timer) {
+                sd_event_source_set_time(match->linger_timer, usec);
+                sd_event_source_set_enabled(match->linger_timer, SD_EVENT_ONESHOT);
+                return;
+        }
+
+        r = sd_event_add_time(event, &match->linger_timer, CLOCK_MONOTONIC, usec, USEC_PER_SEC,
+                              signal_match_linger_handler, match);
+        if (r < 0)
+                signal_registry_remove_match(match->registry, match);
+}
+
+void signal_registry_unsubscribe(SignalSubscriber *subscriber) {
+        SignalMatch *match = subscriber->match;
+
+        if (!match)
+                return;
+
+        subscriber->match = NULL;
+
+        for (size_t i = 0; i < match->n_subscribers; i++) {
+                if (match->subscribers[i] == subscriber) {
+                        // the dispatch loop compacts once it is done
+                        if (match->dispatching) {
+                                match->subscribers[i] = NULL;
+                                return;
+                        }
+
+                        match->subscribers[i] = match->subscribers[match->n_subscribers - 1];
+                        match->n_subscribers -= 1;
+                        break;
+                }
+        }
+
+        if (match->n_subscribers == 0)
+                signal_match_linger(match);
+}
+
+static void signal_subscriber_reset(SignalSubscriber *subscriber) {
+        SignalMatch *match = subscriber->match;
+        SignalBuffer *buffer;
+
+        buffer = calloc(1, sizeof(SignalBuffer));
+        buffer->n_ref = 1;
+        buffer->seq = match->next_seq - 1;
+        snprintf(buffer->id, sizeof(buffer->id), "%" PRIu64 "-%" PRIu64, match->epoch, buffer->seq);
+        buffer->event = "reset";
+        buffer->data = strdup("{}");
+        buffer->size = strlen(buffer->data);
+
+        subscriber->deliver(subscriber, buffer);
+        signal_buffer_unref(buffer);
+}
+
+/* Delivers the buffered signals following last_event_id to the subscriber.
+ * If some of them are no longer available, a single "reset" event is
+ * delivered instead and false returned: the client has to refetch its
+ * state, older signals would only be stale. */
+bool signal_subscriber_replay(SignalSubscriber *subscriber, const char *last_event_id) {
+        SignalMatch *match = subscriber->match;
+        uint64_t epoch;
+        uint64_t seq;
+
+        assert(match);
+
+        if (sscanf(last_event_id, "%" SCNu64 "-%" SCNu64, &epoch, &seq) != 2 ||
+            epoch != match->epoch || seq >= match->next_seq ||
+            seq + 1 < match->next_seq - match->n_replay) {
+                log_debug("Cannot resume %s after %s", match->rule, last_event_id);
+                signal_subscriber_reset(subscriber);
+                return false;
+        }
+
+        for (size_t i = 0; i < match->n_replay; i++) {
+                SignalBuffer *buffer = match->replay[(match->replay_start + i) % SIGNAL_REPLAY_LENGTH];
+
+                if (buffer->seq > seq)
+                        subscriber->deliver(subscriber, buffer);
+        }
+
+        log_debug("Replayed signals after %s of %s", last_event_id, match->rule);
+        return true;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <systemd/sd-bus.h>
+
+#include "json.h"
+
+typedef struct SignalRegistry SignalRegistry;
+typedef struct SignalMatch SignalMatch;
+typedef struct SignalBuffer SignalBuffer;
+typedef struct SignalSubscriber SignalSubscriber;
+
+// A signal serialized to JSON once, shared by all subscribers of a match.
+struct SignalBuffer {
+        unsigned n_ref;
+        uint64_t seq;
+        char id[48];            // "<epoch>-<seq>", unique across match instances
+        const char *event;      // event type, NULL for plain signals
+        char *data;
+        size_t size;
+        // object and interface of a PropertiesChanged signal, NULL otherwise
+        char *changed_path;
+        char *changed_interface;
+};
+
+typedef void SignalDeliverFunc(SignalSubscriber *subscriber, SignalBuffer *buffer);
+
+// Embedded by the consumer. deliver() is called for every matching signal.
+// Any subscriber may unsubscribe while a signal is being delivered.
+struct SignalSubscriber {
+        SignalMatch *match;
+        SignalDeliverFunc *deliver;
+        void *userdata;
+};
+
+int signal_registry_new(SignalRegistry **registryp, sd_bus *bus);
+SignalRegistry * signal_registry_free(SignalRegistry *registry);
+void signal_registry_freep(SignalRegistry **registryp);
+// how long matches are kept after their last subscriber left
+void signal_registry_set_linger_time(SignalRegistry *registry, uint64_t usec);
+size_t signal_registry_get_n_matches(SignalRegistry *registry);
+
+int signal_match_rule_new(char **rulep, const char *sender, const char *path, const char *interface, const char *member);
+
+int signal_registry_subscribe(SignalRegistry *registry, const char *rule, SignalSubscriber *subscriber);
+void signal_registry_unsubscribe(SignalSubscriber *subscriber);
+bool signal_subscriber_replay(SignalSubscriber *subscriber, const char *last_event_id);
+
+SignalBuffer * signal_buffer_new(JsonValue *json);
+SignalBuffer * signal_buffer_ref(SignalBuffer *buffer);
+SignalBuffer * signal_buffer_unref(SignalBuffer *buffer);
@@ -0,0 +1,144 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "upload.h"
+
+#define _cleanup_(fn) __attribute__((__cleanup__(fn)))
+
+struct Upload {
+        int dir_fd;             // not owned
+        int fd;
+        char *filename;
+        char *tmp_name;         // hidden name until finished, NULL with O_TMPFILE
+        uint64_t size;
+};
+
+static bool upload_filename_valid(const char *filename) {
+        return filename && *filename &&
+               strcmp(filename, ".") != 0 && strcmp(filename, "..") != 0 &&
+               !strchr(filename, '/');
+}
+
+// a hidden name next to the target, unique within this process
+static int upload_set_tmp_name(Upload *upload) {
+        static unsigned counter;
+
+        if (asprintf(&upload->tmp_name, ".%s.%d.%u", upload->filename, getpid(), counter++) < 0) {
+                upload->tmp_name = NULL;
+                return -ENOMEM;
+        }
+
+        return 0;
+}
+
+int upload_new(Upload **uploadp, int dir_fd, const char *filename) {
+        _cleanup_(upload_freep) Upload *upload = NULL;
+
+        if (!upload_filename_valid(filename))
+                return -EINVAL;
+
+        upload = calloc(1, sizeof(Upload));
+        upload->dir_fd = dir_fd;
+        upload->filename = strdup(filename);
+
+        upload->fd = openat(dir_fd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644);
+        if (upload->fd < 0 && (errno == EOPNOTSUPP || errno == EISDIR)) {
+                // the file system cannot do unnamed files
+                if (upload_set_tmp_name(upload) < 0)
+                        return -ENOMEM;
+                upload->fd = openat(dir_fd, upload->tmp_name, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0644);
+        }
+        if (upload->fd < 0) {
+                int r = -errno;
+
+                free(upload->tmp_name);
+                upload->tmp_name = NULL;
+                return r;
+        }
+
+        *uploadp = upload;
+        upload = NULL;
+
+        return 0;
+}
+
+Upload * upload_free(Upload *upload) {
+        if (upload->fd >= 0)
+                close(upload->fd);
+        if (upload->tmp_name)
+                unlinkat(upload->dir_fd, upload->tmp_name, 0);
+
+        free(upload->tmp_name);
+        free(upload->filename);
+        free(upload);
+
+        return NULL;
+}
+
+void upload_freep(Upload **uploadp) {
+        if (*uploadp)
+                upload_free(*uploadp);
+}
+
+int upload_write(Upload *upload, const void *data, size_t size) {
+        const char *p = data;
+
+        while (size > 0) {
+                ssize_t n = write(upload->fd, p, size);
+
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return -errno;
+                }
+
+                p += n;
+                size -= n;
+                upload->size += n;
+        }
+
+        return 0;
+}
+
+/* An unnamed file is linked under a hidden name first. Renaming that over
+ * the target replaces an earlier upload atomically, the name never goes
+ * missing and the old file stays if anything fails. */
+int upload_finish(Upload *upload) {
+        char fd_path[64];
+        int r;
+
+        if (!upload->tmp_name) {
+                r = upload_set_tmp_name(upload);
+                if (r < 0)
+                        return r;
+
+                // linking by file descriptor needs privileges, through /proc it does not
+                snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", upload->fd);
+                if (linkat(AT_FDCWD, fd_path, upload->dir_fd, upload->tmp_name, AT_SYMLINK_FOLLOW) < 0) {
+                        r = -errno;
+                        free(upload->tmp_name);
+                        upload->tmp_name = NULL;
+                        return r;
+                }
+        }
+
+        if (renameat(upload->dir_fd, upload->tmp_name, upload->dir_fd, upload->filename) < 0)
+                return -errno;
+
+        free(upload->tmp_name);
+        upload->tmp_name = NULL;
+        return 0;
+}
+
+const char * upload_get_filename(Upload *upload) {
+        return upload->filename;
+}
+
+uint64_t upload_get_size(Upload *upload) {
+        return upload->size;
+}
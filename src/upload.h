@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef struct Upload Upload;
+
+/* A file received through /filepost. It stays unnamed while it is written,
+ * using O_TMPFILE where the file system supports it, and only appears in
+ * the upload directory once upload_finish() links it there. An upload that
+ * is freed before it is finished leaves nothing behind. */
+
+// filename must be a plain name without slashes, otherwise -EINVAL
+int upload_new(Upload **uploadp, int dir_fd, const char *filename);
+Upload * upload_free(Upload *upload);
+void upload_freep(Upload **uploadp);
+
+int upload_write(Upload *upload, const void *data, size_t size);
+// replaces an earlier file of the same name
+int upload_finish(Upload *upload);
+
+const char * upload_get_filename(Upload *upload);
+uint64_t upload_get_size(Upload *upload);
@@ -0,0 +1,579 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <systemd/sd-event.h>
+
+#include "watch.h"
+#include "dbus-http.h"
+#include "json.h"
+#include "json-writer.h"
+#include "log.h"
+#include "environment.h"
+
+#define _cleanup_(fn) __attribute__((__cleanup__(fn)))
+
+#define USEC_PER_SEC 1000000ULL
+
+#define WATCH_DEFAULT_TIMEOUT_SEC 30
+#define WATCH_MAX_TIMEOUT_SEC 300
+// keeps the property state around between two polls of a client
+#define WATCH_IDLE_SEC 60
+
+typedef struct PropertyWatch PropertyWatch;
+
+struct WatchRegistry {
+        sd_bus *bus;
+        SignalRegistry *signals;
+        PropertyWatch **watches;
+        size_t n_watches;
+        size_t n_alloced_watches;
+};
+
+typedef struct {
+        char *name;
+        JsonValue *value;
+        uint64_t generation;
+} WatchedProperty;
+
+// A parked long-poll request.
+typedef struct {
+        PropertyWatch *watch;
+        HttpResponse *response;
+        uint64_t epoch;
+        uint64_t since;
+        sd_event_source *timer;
+} WatchWaiter;
+
+/* Last known properties of one interface of an object, kept current by
+ * PropertiesChanged.
+ * Every change bumps the generation, clients present "<epoch>-<generation>"
+ * to receive only the properties changed since. The epoch identifies the
+ * watch instance, generations of an expired watch are meaningless. */
+struct PropertyWatch {
+        WatchRegistry *registry;
+        char *destination;
+        char *object;
+        char *interface;
+        SignalSubscriber subscriber;
+        sd_bus_slot *get_all_slot;
+        bool loaded;
+        uint64_t epoch;
+        uint64_t generation;
+        WatchedProperty **properties;
+        size_t n_properties;
+        size_t n_alloced_properties;
+        WatchWaiter **waiters;
+        size_t n_waiters;
+        size_t n_alloced_waiters;
+        sd_event_source *idle_timer;
+        sd_event_source *flush_event;   // answers waiters after a signal
+};
+
+static inline void freep(void *p) {
+        free(*(void **)p);
+}
+
+static void * grow_pointer_array(void *array, size_t *allocedp) {
+        if (*allocedp == 0)
+                *allocedp = 8;
+        else
+                *allocedp *= 2;
+
+        return realloc(array, *allocedp * sizeof(void *));
+}
+
+static uint64_t now_usec(sd_bus *bus) {
+        uint64_t usec = 0;
+
+        sd_event_now(sd_bus_get_event(bus), CLOCK_MONOTONIC, &usec);
+        return usec;
+}
+
+static void property_watch_set_etag(PropertyWatch *watch, HttpResponse *response) {
+        char etag[64];
+
+        snprintf(etag, sizeof(etag), "\"%" PRIu64 "-%" PRIu64 "\"", watch->epoch, watch->generation);
+        http_response_add_header(response, "ETag", etag);
+}
+
+/* Replies with all properties changed after generation since, or with the
+ * full state if the client's tag stems from another watch or is ahead of
+ * this one. */
+static void property_watch_reply(PropertyWatch *watch, HttpResponse *response, uint64_t epoch, uint64_t since) {
+        JsonWriter writer;
+
+        if (epoch != watch->epoch || since > watch->generation)
+                since = 0;
+
+        property_watch_set_etag(watch, response);
+
+        json_writer_init(&writer, http_response_get_buffer(response, "application/json"));
+        json_writer_begin_object(&writer);
+        for (size_t i = 0; i < watch->n_properties; i++) {
+                WatchedProperty *property = watch->properties[i];
+
+                if (property->generation > since) {
+                        json_writer_key(&writer, property->name);
+                        json_writer_value(&writer, property->value);
+                }
+        }
+        json_writer_end_object(&writer);
+
+        http_response_end(response, 200);
+}
+
+static void property_watch_remove_waiter(PropertyWatch *watch, WatchWaiter *waiter) {
+        for (size_t i = 0; i < watch->n_waiters; i++) {
+                if (watch->waiters[i] == waiter) {
+                        watch->waiters[i] = watch->waiters[watch->n_waiters - 1];
+                        watch->n_waiters -= 1;
+                        break;
+                }
+        }
+
+        if (waiter->timer)
+                sd_event_source_unref(waiter->timer);
+        free(waiter);
+}
+
+static void property_watch_update_idle(PropertyWatch *watch);
+
+static void property_watch_flush(PropertyWatch *watch) {
+        for (size_t i = watch->n_waiters; i > 0; i--) {
+                WatchWaiter *waiter = watch->waiters[i - 1];
+
+                if (waiter->epoch == watch->epoch && waiter->since == watch->generation)
+                        continue;
+
+                property_watch_reply(watch, waiter->response, waiter->epoch, waiter->since);
+                property_watch_remove_waiter(watch, waiter);
+        }
+
+        property_watch_update_idle(watch);
+}
+
+static void property_watch_set(PropertyWatch *watch, const char *name, JsonValue *value) {
+        WatchedProperty *property = NULL;
+
+        for (size_t i = 0; i < watch->n_properties; i++) {
+                if (strcmp(watch->properties[i]->name, name) == 0) {
+                        property = watch->properties[i];
+                        break;
+                }
+        }
+
+        if (!property) {
+                property = calloc(1, sizeof(WatchedProperty));
+                property->name = strdup(name);
+
+                if (watch->n_properties == watch->n_alloced_properties)
+                        watch->properties = grow_pointer_array(watch->properties, &watch->n_alloced_properties);
+                watch->properties[watch->n_properties] = property;
+                watch->n_properties += 1;
+        }
+
+        if (property->value)
+                json_value_free(property->value);
+        property->value = value;
+        property->generation = watch->generation;
+}
+
+static void property_watch_free(PropertyWatch *watch) {
+        WatchRegistry *registry = watch->registry;
+
+        for (size_t i = 0; i < registry->n_watches; i++) {
+                if (registry->watches[i] == watch) {
+                        registry->watches[i] = registry->watches[registry->n_watches - 1];
+                        registry->n_watches -= 1;
+                        break;
+                }
+        }
+
+        signal_registry_unsubscribe(&watch->subscriber);
+
+        if (watch->get_all_slot)
+                sd_bus_slot_unref(watch->get_all_slot);
+        if (watch->idle_timer)
+                sd_event_source_unref(watch->idle_timer);
+        if (watch->flush_event)
+                sd_event_source_unref(watch->flush_event);
+
+        // only reached with parked requests on shutdown, when their connections are gone
+        while (watch->n_waiters > 0)
+                property_watch_remove_waiter(watch, watch->waiters[0]);
+
+        for (size_t i = 0; i < watch->n_properties; i++) {
+                free(watch->properties[i]->name);
+                json_value_free(watch->properties[i]->value);
+                free(watch->properties[i]);
+        }
+
+        free(watch->properties);
+        free(watch->waiters);
+        free(watch->destination);
+        free(watch->object);
+        free(watch->interface);
+        free(watch);
+}
+
+static int property_watch_idle_handler(sd_event_source *source, uint64_t usec, void *userdata) {
+        PropertyWatch *watch = userdata;
+
+        log_debug("Property watch on %s %s %s expired", watch->destination, watch->object, watch->interface);
+        property_watch_free(watch);
+        return 0;
+}
+
+static void property_watch_update_idle(PropertyWatch *watch) {
+        uint64_t usec;
+
+        if (watch->n_waiters > 0 || !watch->loaded) {
+                if (watch->idle_timer)
+                        sd_event_source_set_enabled(watch->idle_timer, SD_EVENT_OFF);
+                return;
+        }
+
+        usec = now_usec(watch->registry->bus) + WATCH_IDLE_SEC * USEC_PER_SEC;
+
+        if (!watch->idle_timer) {
+                sd_event_add_time(sd_bus_get_event(watch->registry->bus), &watch->idle_timer, CLOCK_MONOTONIC,
+                                  usec, USEC_PER_SEC, property_watch_idle_handler, watch);
+                return;
+        }
+
+        sd_event_source_set_time(watch->idle_timer, usec);
+        sd_event_source_set_enabled(watch->idle_timer, SD_EVENT_ONESHOT);
+}
+
+static int property_watch_flush_handler(sd_event_source *source, void *userdata) {
+        property_watch_flush(userdata);
+        return 0;
+}
+
+/* Replying runs MHD, which may end event streams of the same signal match,
+ * so waiters are not answered before its subscribers have all been served. */
+static void property_watch_flush_later(PropertyWatch *watch) {
+        if (watch->flush_event) {
+                sd_event_source_set_enabled(watch->flush_event, SD_EVENT_ONESHOT);
+                return;
+        }
+
+        if (sd_event_add_defer(sd_bus_get_event(watch->registry->bus), &watch->flush_event,
+                               property_watch_flush_handler, watch) < 0)
+                log_err("Cannot answer the waiters of %s %s", watch->destination, watch->object);
+}
+
+static void property_watch_deliver(SignalSubscriber *subscriber, SignalBuffer *buffer) {
+        PropertyWatch *watch = subscriber->userdata;
+        _cleanup_(json_value_freep) JsonValue *json = NULL;
+        JsonValue *arguments;
+        JsonValue *changed;
+        JsonValue *invalidated;
+        JsonObjectEntry *entry;
+        _cleanup_(json_object_iterator_freep) JsonObjectIterator *iter = NULL;
+
+        // the GetAll reply in flight is newer than anything received before it
+        if (!watch->loaded)
+                return;
+
+        // the match covers all interfaces of the object
+        if (!buffer->changed_interface || strcmp(buffer->changed_interface, watch->interface) != 0)
+                return;
+
+        if (json_parse(buffer->data, &json, JSON_TYPE_OBJECT) < 0 ||
+            !json_object_lookup(json, "arguments", &arguments, JSON_TYPE_ARRAY) ||
+            !json_array_get(arguments, 1, &changed, JSON_TYPE_OBJECT) ||
+            !json_array_get(arguments, 2, &invalidated, JSON_TYPE_ARRAY)) {
+                log_err("Invalid PropertiesChanged signal for %s", watch->object);
+                return;
+        }
+
+        watch->generation += 1;
+
+        iter = json_object_iterator_new(changed);
+        while ((entry = json_object_iterator_next(iter)))
+                property_watch_set(watch, json_object_entry_key(entry), json_value_copy(json_object_entry_value(entry)));
+
+        for (size_t i = 0; i < json_array_get_length(invalidated); i++) {
+                JsonValue *name;
+
+                if (json_array_get(invalidated, i, &name, JSON_TYPE_STRING))
+                        property_watch_set(watch, json_value_get_string(name), json_null_new());
+        }
+
+        property_watch_flush_later(watch);
+}
+
+static int property_watch_get_all_finished(sd_bus_message *message, void *userdata, sd_bus_error *ret_error) {
+        PropertyWatch *watch = userdata;
+        const sd_bus_error *error;
+        _cleanup_(json_value_freep) JsonValue *properties = NULL;
+        _cleanup_(json_object_iterator_freep) JsonObjectIterator *iter = NULL;
+        JsonObjectEntry *entry;
+        int r;
+
+        watch->get_all_slot = sd_bus_slot_unref(watch->get_all_slot);
+
+        error = sd_bus_message_get_error(message);
+        if (error) {
+                while (watch->n_waiters > 0) {
+                        WatchWaiter *waiter = watch->waiters[0];
+
+                        http_response_end_dbus_error(waiter->response, error);
+                        property_watch_remove_waiter(watch, waiter);
+                }
+                property_watch_free(watch);
+                return 0;
+        }
+
+        r = bus_message_element_to_json(message, &properties);
+        if (r < 0 || !properties || json_value_get_type(properties) != JSON_TYPE_OBJECT) {
+                log_err("Reading properties of %s %s failed", watch->destination, watch->object);
+                while (watch->n_waiters > 0) {
+                        WatchWaiter *waiter = watch->waiters[0];
+
+                        http_response_end(waiter->response, 500);
+                        property_watch_remove_waiter(watch, waiter);
+                }
+                property_watch_free(watch);
+                return 0;
+        }
+
+        watch->generation = 1;
+        watch->loaded = true;
+
+        iter = json_object_iterator_new(properties);
+        while ((entry = json_object_iterator_next(iter)))
+                property_watch_set(watch, json_object_entry_key(entry), json_value_copy(json_object_entry_value(entry)));
+
+        property_watch_flush(watch);
+        return 0;
+}
+
+static int property_watch_new(PropertyWatch **watchp, WatchRegistry *registry,
+                              const char *destination, const char *object, const char *interface) {
+        _cleanup_(freep) char *rule = NULL;
+        PropertyWatch *watch;
+        struct timespec ts;
+        int r;
+
+        r = signal_match_rule_new(&rule, destination, object, "org.freedesktop.DBus.Properties", "PropertiesChanged");
+        if (r < 0)
+                return r;
+
+        watch = calloc(1, sizeof(PropertyWatch));
+        watch->registry = registry;
+        watch->destination = strdup(destination);
+        watch->object = strdup(object);
+        watch->interface = strdup(interface);
+        watch->subscriber.deliver = property_watch_deliver;
+        watch->subscriber.userdata = watch;
+
+        // wall clock based, so that tags do not repeat across restarts
+        clock_gettime(CLOCK_REALTIME, &ts);
+        watch->epoch = (uint64_t)ts.tv_sec * USEC_PER_SEC + ts.tv_nsec / 1000;
+
+        if (registry->n_watches == registry->n_alloced_watches)
+                registry->watches = grow_pointer_array(registry->watches, &registry->n_alloced_watches);
+        registry->watches[registry->n_watches] = watch;
+        registry->n_watches += 1;
+
+        r = signal_registry_subscribe(registry->signals, rule, &watch->subscriber);
+        if (r < 0) {
+                property_watch_free(watch);
+                return r;
+        }
+
+        r = sd_bus_call_method_async(registry->bus, &watch->get_all_slot, destination, object,
+                                     "org.freedesktop.DBus.Properties", "GetAll",
+                                     property_watch_get_all_finished, watch, "s", interface);
+        if (r < 0) {
+                property_watch_free(watch);
+                return r;
+        }
+
+        *watchp = watch;
+        return 0;
+}
+
+static PropertyWatch * watch_registry_find(WatchRegistry *registry, const char *destination, const char *object,
+                                           const char *interface) {
+        for (size_t i = 0; i < registry->n_watches; i++) {
+                PropertyWatch *watch = registry->watches[i];
+
+                if (strcmp(watch->destination, destination) == 0 && strcmp(watch->object, object) == 0 &&
+                    strcmp(watch->interface, interface) == 0)
+                        return watch;
+        }
+
+        return NULL;
+}
+
+int watch_registry_new(WatchRegistry **registryp, sd_bus *bus, SignalRegistry *signals) {
+        WatchRegistry *registry;
+
+        registry = calloc(1, sizeof(WatchRegistry));
+        if (!registry)
+                return -ENOMEM;
+
+        registry->bus = bus;
+        registry->signals = signals;
+
+        *registryp = registry;
+        return 0;
+}
+
+WatchRegistry * watch_registry_free(WatchRegistry *registry) {
+        while (registry->n_watches > 0)
+                property_watch_free(registry->watches[0]);
+
+        free(registry->watches);
+        free(registry);
+
+        return NULL;
+}
+
+static int waiter_timeout_handler(sd_event_source *source, uint64_t usec, void *userdata) {
+        WatchWaiter *waiter = userdata;
+        PropertyWatch *watch = waiter->watch;
+
+        property_watch_set_etag(watch, waiter->response);
+        http_response_end(waiter->response, 304);
+        property_watch_remove_waiter(watch, waiter);
+        property_watch_update_idle(watch);
+
+        return 0;
+}
+
+/* Accepts the tag as ?since=<epoch>-<generation> or as If-None-Match,
+ * with or without the quotes of the ETag. */
+static void parse_since(HttpResponse *response, uint64_t *epochp, uint64_t *sincep) {
+        const char *tag;
+
+        tag = http_response_get_argument(response, "since");
+        if (!tag)
+                tag = http_response_get_header(response, "If-None-Match");
+        if (!tag)
+                return;
+
+        if (strncmp(tag, "W/", 2) == 0)
+                tag += 2;
+        if (*tag == '"')
+                tag += 1;
+
+        if (sscanf(tag, "%" SCNu64 "-%" SCNu64, epochp, sincep) != 2) {
+                *epochp = 0;
+                *sincep = 0;
+        }
+}
+
+static unsigned parse_timeout(HttpResponse *response) {
+        const char *arg;
+        char *end;
+        unsigned long timeout;
+
+        arg = http_response_get_argument(response, "timeout");
+        if (!arg)
+                return WATCH_DEFAULT_TIMEOUT_SEC;
+
+        timeout = strtoul(arg, &end, 10);
+        if (*end != '\0' || timeout == 0)
+                return WATCH_DEFAULT_TIMEOUT_SEC;
+
+        return timeout > WATCH_MAX_TIMEOUT_SEC ? WATCH_MAX_TIMEOUT_SEC : timeout;
+}
+
+/* Splits "<destination>[/<object path>]" */
+static int parse_watch_url(const char *url, char **destinationp, char **objectp) {
+        const char *p;
+
+        if (*url == '\0' || *url == '/')
+                return -EINVAL;
+
+        p = strchr(url, '/');
+        if (p) {
+                *destinationp = strndup(url, p - url);
+                *objectp = strdup(p);
+        } else {
+                *destinationp = strdup(url);
+                *objectp = strdup("/");
+        }
+
+        return 0;
+}
+
+HttpServerHandlerStatus handle_get_watch(const char *path, HttpResponse *response, void *userdata) {
+        Environment *env = userdata;
+
+        _cleanup_(freep) char *destination = NULL;
+        _cleanup_(freep) char *object = NULL;
+        const char *interface;
+        PropertyWatch *watch;
+        WatchWaiter *waiter;
+        uint64_t epoch = 0;
+        uint64_t since = 0;
+        int r;
+
+        r = parse_watch_url(*path ? path + 1 : path, &destination, &object);
+        if (r < 0) {
+                log_err("Invalid watch URL %s", path);
+                http_response_end(response, 400);
+                return HTTP_SERVER_HANDLED_ERROR;
+        }
+
+        // properties of different interfaces may share names
+        interface = http_response_get_argument(response, "interface");
+        if (!interface || *interface == '\0') {
+                log_err("Watch of %s without interface", path);
+                http_response_end(response, 400);
+                return HTTP_SERVER_HANDLED_ERROR;
+        }
+
+        parse_since(response, &epoch, &since);
+
+        watch = watch_registry_find(env->watches, destination, object, interface);
+        if (!watch) {
+                r = property_watch_new(&watch, env->watches, destination, object, interface);
+                if (r < 0) {
+                        log_err("Watching %s %s %s failed: %s", destination, object, interface, strerror(-r));
+                        http_response_end(response, r == -EINVAL ? 400 : 500);
+                        return HTTP_SERVER_HANDLED_ERROR;
+                }
+        }
+
+        // anything to report right away?
+        if (watch->loaded && (epoch != watch->epoch || since != watch->generation)) {
+                property_watch_reply(watch, response, epoch, since);
+                property_watch_update_idle(watch);
+                return HTTP_SERVER_HANDLED_SUCCESS;
+        }
+
+        waiter = calloc(1, sizeof(WatchWaiter));
+        waiter->watch = watch;
+        waiter->response = response;
+        waiter->epoch = epoch;
+        waiter->since = since;
+
+        r = sd_event_add_time(sd_bus_get_event(env->bus), &waiter->timer, CLOCK_MONOTONIC,
+                              now_usec(env->bus) + parse_timeout(response) * USEC_PER_SEC, USEC_PER_SEC,
+                              waiter_timeout_handler, waiter);
+        if (r < 0) {
+                free(waiter);
+                http_response_end(response, 500);
+                return HTTP_SERVER_HANDLED_ERROR;
+        }
+
+        if (watch->n_waiters == watch->n_alloced_waiters)
+                watch->waiters = grow_pointer_array(watch->waiters, &watch->n_alloced_waiters);
+        watch->waiters[watch->n_waiters] = waiter;
+        watch->n_waiters += 1;
+
+        property_watch_update_idle(watch);
+        http_suspend_connection(response);
+
+        log_info("handle_get_watch parked request for %s %s %s", destination, object, interface);
+        return HTTP_SERVER_HANDLED_SUCCESS;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <systemd/sd-bus.h>
+
+#include "http-server.h"
+#include "signals.h"
+
+typedef struct WatchRegistry WatchRegistry;
+
+int watch_registry_new(WatchRegistry **registryp, sd_bus *bus, SignalRegistry *signals);
+WatchRegistry * watch_registry_free(WatchRegistry *registry);
+
+HttpGetHandler handle_get_watch;
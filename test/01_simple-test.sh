@@ -10,9 +10,18 @@ DBUS_PATH="dbus/"
 dbus_http_testd_pid=0
 dbus_http_pid=0
 
+# static files served with -w
+WWW_DIR=$(mktemp -d)
+echo '<html>index</html>' > ${WWW_DIR}/index.html
+mkdir ${WWW_DIR}/js
+echo 'app();' > ${WWW_DIR}/js/app.3f2a9c1b.js
+echo 'app();' | gzip > ${WWW_DIR}/js/app.3f2a9c1b.js.gz
+echo 'bundle();' > ${WWW_DIR}/js/bundle-20241018.js
+
 exit_handler(){
     [ ${dbus_http_pid} -ne 0 ] && { echo "Stopping ${dbus_http_pid}"; kill ${dbus_http_pid} &> /dev/null; }
     [ ${dbus_http_testd_pid} -ne 0 ] && { echo "Stopping ${dbus_http_testd_pid}"; kill ${dbus_http_testd_pid} &> /dev/null; }
+    rm -rf ${WWW_DIR}
 }
 trap exit_handler EXIT
 
@@ -64,7 +73,7 @@ echo ""
 
 
 if [ $START_DBUS_HTTP -eq 1 ]; then
-	${VALGRIND} ./dbus-http -s -p ${PORT} ${DBUS_HTTP_ARGS} &
+	${VALGRIND} ./dbus-http -s -p ${PORT} -w ${WWW_DIR} -Z 16 -b 65536 ${DBUS_HTTP_ARGS} &
 	dbus_http_pid=$!
 	echo "Started dbus-http (${dbus_http_pid})"
 	sleep 1
@@ -76,46 +85,99 @@ failed_tests=0
 printf "\n--Get Properties GET\n"
 result=$(curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.Calculator/dbus/http/Calculator)
 echo "$result"
-[ "$result" == '{ "ZeroDivisionCounter": 1 }' ] || { ((failed_tests++)); echo "failed"; }
+[ "$result" == '{"ZeroDivisionCounter":1}' ] || { ((failed_tests++)); echo "failed"; }
 
 printf "\n\n--Get Properties POST\n"
 result=$(curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.Calculator/dbus/http/Calculator --data '{"interface":"org.freedesktop.DBus.Properties", "method":"GetAll", "arguments":[""]}')
 echo "$result"
-[ "$result" == '{ "properties": { "ZeroDivisionCounter": 1 } }' ] || { ((failed_tests++)); echo "failed"; }
+[ "$result" == '{"properties":{"ZeroDivisionCounter":1}}' ] || { ((failed_tests++)); echo "failed"; }
 
 printf "\n\n--Multiply\n"
 result=$(curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.Calculator/dbus/http/Calculator --data '{"interface":"dbus.http.Calculator", "method":"Multiply", "arguments":[3,4]}')
 echo "$result"
-[ "$result" == "{ \"arg0\": 12 }" ] || { ((failed_tests++)); echo "failed"; }
+[ "$result" == "{\"arg0\":12}" ] || { ((failed_tests++)); echo "failed"; }
+
+printf "\n\n--Multiply beyond 2^53\n"
+result=$(curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.Calculator/dbus/http/Calculator --data '{"interface":"dbus.http.Calculator", "method":"Multiply", "arguments":[9007199254740993,1]}')
+echo "$result"
+[ "$result" == "{\"arg0\":9007199254740993}" ] || { ((failed_tests++)); echo "failed"; }
+
+printf "\n\n--Multiply with a fraction\n"
+result=$(curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.Calculator/dbus/http/Calculator --data '{"interface":"dbus.http.Calculator", "method":"Multiply", "arguments":[1.5,2]}')
+echo "$result"
+[ "$result" == '{"error":"Invalid request"}' ] || { ((failed_tests++)); echo "failed"; }
+
+printf "\n\n--Multiply in CBOR\n"
+# {"interface":"dbus.http.Calculator","method":"Multiply","arguments":[3,4]}
+result=$(printf '\xa3\x69interface\x74dbus.http.Calculator\x66method\x68Multiply\x69arguments\x82\x03\x04' | \
+  curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.Calculator/dbus/http/Calculator \
+  -H 'Content-Type: application/cbor' -H 'Accept: application/cbor' --data-binary @- | od -An -tx1 | tr -d ' \n')
+echo "$result"
+# {"arg0":12}
+[ "$result" == 'bf64617267300cff' ] || { ((failed_tests++)); echo "failed"; }
+
+printf "\n\n--Multiply refusing CBOR\n"
+headers=$(mktemp)
+result=$(curl -s -D $headers http://localhost:${PORT}/${DBUS_PATH}dbus.http.Calculator/dbus/http/Calculator \
+  -H 'Accept: application/cbor;q=0, application/json' --data '{"interface":"dbus.http.Calculator", "method":"Multiply", "arguments":[3,4]}')
+echo "$result"
+[ "$result" == '{"arg0":12}' ] || { ((failed_tests++)); echo "failed"; }
+grep -qi '^Vary: Accept\r$' $headers || { ((failed_tests++)); echo "failed"; }
+rm -f $headers
 
 printf "\n\n--Divide\n"
 result=$(curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.Calculator/dbus/http/Calculator --data '{"interface":"dbus.http.Calculator", "method":"Divide", "arguments":[12,3]}')
 echo "$result"
-[ "$result" == "{ \"arg0\": 4 }" ] ||  { ((failed_tests++)); echo "failed"; }
+[ "$result" == "{\"arg0\":4}" ] ||  { ((failed_tests++)); echo "failed"; }
 
 printf "\n\n--Divide by Zero\n"
 result=$(curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.Calculator/dbus/http/Calculator --data '{"interface":"dbus.http.Calculator", "method":"Divide", "arguments":[1,0]}')
 echo "$result"
-[ "$result" == "{ \"error\": \"dbus.http.DivisionByZero\", \"message\": \"Sorry, can't allow division by zero.\" }" ] ||  { ((failed_tests++)); echo "failed"; }
+[ "$result" == "{\"error\":\"dbus.http.DivisionByZero\",\"message\":\"Sorry, can't allow division by zero.\"}" ] ||  { ((failed_tests++)); echo "failed"; }
 
 printf "\n\n--Get Properties GET\n"
 result=$(curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.Calculator/dbus/http/Calculator)
 echo "$result"
-[ "$result" == '{ "ZeroDivisionCounter": 2 }' ] || { ((failed_tests++)); echo "failed"; }
+[ "$result" == '{"ZeroDivisionCounter":2}' ] || { ((failed_tests++)); echo "failed"; }
 
 printf "\n\n--GetArray\n"
 result=$(curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.Calculator/dbus/http/Calculator --data '{"interface":"dbus.http.Calculator", "method":"GetArray", "arguments":[]}')
 echo "$result"
-[ "$result" == '{ "arg0": [ 0, 2147483647, -2147483648 ] }' ] ||  { ((failed_tests++)); echo "failed"; }
+[ "$result" == '{"arg0":[0,2147483647,-2147483648]}' ] ||  { ((failed_tests++)); echo "failed"; }
 
 printf "\n\n--SetArray\n"
 result=$(curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.Calculator/dbus/http/Calculator --data '{"interface":"dbus.http.Calculator", "method":"SetArray", "arguments":[[7,8,9]]}')
 echo "$result"
 
+printf "\n\n--SetArray type mismatch\n"
+result=$(curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.Calculator/dbus/http/Calculator --data '{"interface":"dbus.http.Calculator", "method":"SetArray", "arguments":[[7,"8",9]]}')
+echo "$result"
+[ "$result" == '{"error":"Invalid request"}' ] ||  { ((failed_tests++)); echo "failed"; }
+
+printf "\n\n--SetArray out of range\n"
+result=$(curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.Calculator/dbus/http/Calculator --data '{"interface":"dbus.http.Calculator", "method":"SetArray", "arguments":[[7,2147483648]]}')
+echo "$result"
+[ "$result" == '{"error":"Invalid request"}' ] ||  { ((failed_tests++)); echo "failed"; }
+
+printf "\n\n--EchoBytes list\n"
+result=$(curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.Calculator/dbus/http/Calculator --data '{"interface":"dbus.http.Calculator", "method":"EchoBytes", "arguments":[[0,255,97]]}')
+echo "$result"
+[ "$result" == '{"arg0":[0,255,97]}' ] ||  { ((failed_tests++)); echo "failed"; }
+
+printf "\n\n--EchoBytes\n"
+result=$(curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.Calculator/dbus/http/Calculator --data '{"interface":"dbus.http.Calculator", "method":"EchoBytes", "arguments":["AP9h"]}')
+echo "$result"
+[ "$result" == '{"arg0":[0,255,97]}' ] ||  { ((failed_tests++)); echo "failed"; }
+
+printf "\n\n--EchoBytes as base64\n"
+result=$(curl -s "http://localhost:${PORT}/${DBUS_PATH}dbus.http.Calculator/dbus/http/Calculator?bytes=base64" --data '{"interface":"dbus.http.Calculator", "method":"EchoBytes", "arguments":[[0,255,97]]}')
+echo "$result"
+[ "$result" == '{"arg0":"AP9h"}' ] ||  { ((failed_tests++)); echo "failed"; }
+
 printf "\n\n--GetDict\n"
 result=$(curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.Calculator/dbus/http/Calculator --data '{"interface":"dbus.http.Calculator", "method":"GetDict", "arguments":[]}')
 echo "$result"
-[ "$result" == '{ "arg0": { "key1": 17, "key2": "test-string" } }' ] ||  { ((failed_tests++)); echo "failed"; }
+[ "$result" == '{"arg0":{"key1":17,"key2":"test-string"}}' ] ||  { ((failed_tests++)); echo "failed"; }
 
 printf "\n\n--SetDict\n"
 result=$(curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.Calculator/dbus/http/Calculator --data '{"interface":"dbus.http.Calculator", "method":"SetDict", "arguments":[{"key1": { "dbus_variant_sign": "i", "data":18 }, "key2": { "dbus_variant_sign": "s", "data":"test-string-new" } }]}')
@@ -124,14 +186,23 @@ echo "$result"
 printf "\n\n--GetDict\n"
 result=$(curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.Calculator/dbus/http/Calculator --data '{"interface":"dbus.http.Calculator", "method":"GetDict", "arguments":[]}')
 echo "$result"
-[ "$result" == '{ "arg0": { "key1": 18, "key2": "test-string-new" } }' ] ||  { ((failed_tests++)); echo "failed"; }
+[ "$result" == '{"arg0":{"key1":18,"key2":"test-string-new"}}' ] ||  { ((failed_tests++)); echo "failed"; }
+
+printf "\n\n--SetDict arguments and variant data first\n"
+result=$(curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.Calculator/dbus/http/Calculator --data '{"arguments":[{"key1": { "data":19, "dbus_variant_sign": "i" }, "key2": "test-string-new" }], "interface":"dbus.http.Calculator", "method":"SetDict"}')
+echo "$result"
+
+printf "\n\n--GetDict\n"
+result=$(curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.Calculator/dbus/http/Calculator --data '{"interface":"dbus.http.Calculator", "method":"GetDict", "arguments":[]}')
+echo "$result"
+[ "$result" == '{"arg0":{"key1":19,"key2":"test-string-new"}}' ] ||  { ((failed_tests++)); echo "failed"; }
 
 
 
 printf "\n\n--GetStruct\n"
 result=$(curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.Calculator/dbus/http/Calculator --data '{"interface":"dbus.http.Calculator", "method":"GetStruct", "arguments":[]}')
 echo "$result"
-[ "$result" == '{ "arg0": [ 123, "foo bar" ] }' ] ||  { ((failed_tests++)); echo "failed"; }
+[ "$result" == '{"arg0":[123,"foo bar"]}' ] ||  { ((failed_tests++)); echo "failed"; }
 
 printf "\n\n--SetStruct\n"
 result=$(curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.Calculator/dbus/http/Calculator --data '{"interface":"dbus.http.Calculator", "method":"SetStruct", "arguments":[ [124, "only foo"] ]}')
@@ -140,14 +211,14 @@ echo "$result"
 printf "\n\n--GetStruct\n"
 result=$(curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.Calculator/dbus/http/Calculator --data '{"interface":"dbus.http.Calculator", "method":"GetStruct", "arguments":[]}')
 echo "$result"
-[ "$result" == '{ "arg0": [ 124, "only foo" ] }' ] ||  { ((failed_tests++)); echo "failed"; }
+[ "$result" == '{"arg0":[124,"only foo"]}' ] ||  { ((failed_tests++)); echo "failed"; }
 
 
 
 printf "\n\n--GetNested1\n"
 result=$(curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.Calculator/dbus/http/Calculator --data '{"interface":"dbus.http.Calculator", "method":"GetNested1", "arguments":[]}')
 echo "$result"
-[ "$result" == '{ "arg0": [ [ 1212, "bar1" ], [ 1313, "bar2" ] ], "arg1": 123, "arg2": [ 1, 2, 3 ] }' ] ||  { ((failed_tests++)); echo "failed"; }
+[ "$result" == '{"arg0":[[1212,"bar1"],[1313,"bar2"]],"arg1":123,"arg2":[1,2,3]}' ] ||  { ((failed_tests++)); echo "failed"; }
 
 printf "\n\n--SetNested1\n"
 result=$(curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.Calculator/dbus/http/Calculator --data '{"interface":"dbus.http.Calculator", "method":"SetNested1", "arguments":[ [ [ 1414, "bar2" ], [ 1515, "bar3" ] ], { "dbus_variant_sign": "u", "data":124 }, [ 1, 2, 4 ] ]}')
@@ -156,7 +227,111 @@ echo "$result"
 printf "\n\n--GetNested1\n"
 result=$(curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.Calculator/dbus/http/Calculator --data '{"interface":"dbus.http.Calculator", "method":"GetNested1", "arguments":[]}')
 echo "$result"
-[ "$result" == '{ "arg0": [ [ 1414, "bar2" ], [ 1515, "bar3" ] ], "arg1": 124, "arg2": [ 1, 2, 4 ] }' ] ||  { ((failed_tests++)); echo "failed"; }
+[ "$result" == '{"arg0":[[1414,"bar2"],[1515,"bar3"]],"arg1":124,"arg2":[1,2,4]}' ] ||  { ((failed_tests++)); echo "failed"; }
+
+
+printf "\n\n--Signal stream (two subscribers sharing one match)\n"
+EVENTS_URL="http://localhost:${PORT}/events/dbus.http.Calculator/dbus/http/Calculator?interface=org.freedesktop.DBus.Properties&member=PropertiesChanged"
+events1=$(mktemp) events2=$(mktemp)
+curl -sN --max-time 3 "$EVENTS_URL" > $events1 &
+events1_pid=$!
+curl -sN --max-time 3 "$EVENTS_URL" > $events2 &
+events2_pid=$!
+sleep 1
+curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.Calculator/dbus/http/Calculator --data '{"interface":"dbus.http.Calculator", "method":"Divide", "arguments":[1,0]}' > /dev/null
+wait $events1_pid $events2_pid
+cat $events1
+grep -q '^data: .*"ZeroDivisionCounter":3' $events1 && grep -q '^data: .*"ZeroDivisionCounter":3' $events2 || { ((failed_tests++)); echo "failed"; }
+last_event_id=$(sed -n 's/^id: //p' $events1 | tail -1)
+rm -f $events1 $events2
+
+printf "\n\n--Long-poll property watch\n"
+WATCH_URL="http://localhost:${PORT}/watch/dbus.http.Calculator/dbus/http/Calculator?interface=dbus.http.Calculator"
+etag=$(curl -s -D - -o /dev/null "$WATCH_URL" | sed -n 's/^ETag: *"\([^"]*\)".*/\1/p')
+echo "etag: $etag"
+watch_result=$(mktemp)
+curl -s "${WATCH_URL}&since=${etag}&timeout=5" > $watch_result &
+watch_pid=$!
+sleep 1
+curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.Calculator/dbus/http/Calculator --data '{"interface":"dbus.http.Calculator", "method":"Divide", "arguments":[1,0]}' > /dev/null
+wait $watch_pid
+result=$(cat $watch_result)
+echo "$result"
+[ "$result" == '{"ZeroDivisionCounter":4}' ] || { ((failed_tests++)); echo "failed"; }
+rm -f $watch_result
+
+printf "\n\n--Property watch with a tag ahead of the server\n"
+result=$(curl -s --max-time 3 "${WATCH_URL}&since=${etag%-*}-1000000&timeout=1")
+echo "$result"
+[ "$result" == '{"ZeroDivisionCounter":4}' ] || { ((failed_tests++)); echo "failed"; }
+
+printf "\n\n--Property watch without interface\n"
+result=$(curl -s -o /dev/null -w '%{http_code}' "http://localhost:${PORT}/watch/dbus.http.Calculator/dbus/http/Calculator")
+echo "$result"
+[ "$result" == '400' ] || { ((failed_tests++)); echo "failed"; }
+
+printf "\n\n--Signal stream resume with Last-Event-ID\n"
+result=$(curl -sN --max-time 2 -H "Last-Event-ID: ${last_event_id}" "$EVENTS_URL")
+echo "$result"
+echo "$result" | grep -q '^data: .*"ZeroDivisionCounter":4' || { ((failed_tests++)); echo "failed"; }
+
+printf "\n\n--Signal stream queue statistics\n"
+result=$(curl -s http://localhost:${PORT}/events/)
+echo "$result"
+echo "$result" | grep -q '"policy":"drop-oldest"' && echo "$result" | grep -q '"streams":\[' || { ((failed_tests++)); echo "failed"; }
+
+printf "\n\n--Compressed reply\n"
+NESTED='{"interface":"dbus.http.Calculator", "method":"GetNested1", "arguments":[]}'
+expected=$(curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.Calculator/dbus/http/Calculator --data "$NESTED")
+headers=$(mktemp)
+result=$(curl -s --compressed -D $headers http://localhost:${PORT}/${DBUS_PATH}dbus.http.Calculator/dbus/http/Calculator --data "$NESTED")
+echo "$result"
+grep -qi '^Content-Encoding: gzip' $headers && [ "$result" == "$expected" ] || { ((failed_tests++)); echo "failed"; }
+rm -f $headers
 
+printf "\n\n--Request body too large\n"
+body=$(mktemp)
+head -c 100000 /dev/zero | tr '\0' ' ' > $body
+result=$(curl -s -o /dev/null -w '%{http_code}' http://localhost:${PORT}/${DBUS_PATH}dbus.http.Calculator/dbus/http/Calculator --data-binary @$body)
+echo "$result"
+[ "$result" == '413' ] || { ((failed_tests++)); echo "failed"; }
+result=$(curl -s -o /dev/null -w '%{http_code}' -H "Transfer-Encoding: chunked" http://localhost:${PORT}/${DBUS_PATH}dbus.http.Calculator/dbus/http/Calculator --data-binary @$body)
+echo "$result"
+[ "$result" == '413' ] || { ((failed_tests++)); echo "failed"; }
+rm -f $body
+
+printf "\n\n--Static index.html\n"
+result=$(curl -s http://localhost:${PORT}/)
+echo "$result"
+[ "$result" == '<html>index</html>' ] || { ((failed_tests++)); echo "failed"; }
+
+printf "\n\n--Static precompressed and hashed asset\n"
+result=$(curl -s -D - -o /dev/null -H "Accept-Encoding: gzip" http://localhost:${PORT}/js/app.3f2a9c1b.js | tr -d '\r')
+echo "$result"
+echo "$result" | grep -q '^Content-Encoding: gzip' && echo "$result" | grep -q '^Cache-Control: .*immutable' || { ((failed_tests++)); echo "failed"; }
+result=$(curl -s http://localhost:${PORT}/js/app.3f2a9c1b.js)
+[ "$result" == 'app();' ] || { ((failed_tests++)); echo "failed"; }
+# a date is no content hash, such a file may change in place
+result=$(curl -s -D - -o /dev/null http://localhost:${PORT}/js/bundle-20241018.js | tr -d '\r')
+echo "$result" | grep -q '^Cache-Control: .*immutable' && { ((failed_tests++)); echo "failed"; }
+
+printf "\n\n--Static range request\n"
+result=$(curl -s -r 6-10 http://localhost:${PORT}/index.html)
+echo "$result"
+[ "$result" == 'index' ] || { ((failed_tests++)); echo "failed"; }
+
+printf "\n\n--Static conditional request\n"
+etag=$(curl -s -D - -o /dev/null http://localhost:${PORT}/index.html | sed -n 's/^ETag: *\("[^"]*"\).*/\1/p')
+echo "etag: $etag"
+result=$(curl -s -o /dev/null -w '%{http_code}' -H "If-None-Match: ${etag}" http://localhost:${PORT}/index.html)
+echo "$result"
+[ "$result" == '304' ] || { ((failed_tests++)); echo "failed"; }
+
+printf "\n\n--Static file added while running\n"
+echo 'body {}' > ${WWW_DIR}/added.css
+sleep 1
+result=$(curl -s http://localhost:${PORT}/added.css)
+echo "$result"
+[ "$result" == 'body {}' ] || { ((failed_tests++)); echo "failed"; }
 
 printf "\nEnd of test suite. $failed_tests tests failed.\n"
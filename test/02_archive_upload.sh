@@ -3,34 +3,61 @@
 PORT=8080
 DBUS_PATH="dbus/"
 
+# sizes in MiB of the files uploaded by the benchmark, and how often each is sent
+UPLOAD_SIZES=${UPLOAD_SIZES:-"1 16 128"}
+UPLOAD_ROUNDS=${UPLOAD_ROUNDS:-3}
+
 dbus_http_pid=0
+failed_tests=0
 
 
+UPLOAD_DIR=$(mktemp -d) || { echo "Failed to create upload directory"; exit 1; }
 RANDOM_FILE=$(mktemp test-upload.XXXXXXXXXX) || { echo "Failed to create temp file"; exit 1; }
 head -c 1024 </dev/urandom >> $RANDOM_FILE
 
 exit_handler(){
     [ ${dbus_http_pid} -ne 0 ] && { echo "Stopping ${dbus_http_pid}"; kill ${dbus_http_pid} &> /dev/null; }
     rm -f $RANDOM_FILE
-    rm -f /tmp/$RANDOM_FILE
+    rm -rf $UPLOAD_DIR
 }
 trap exit_handler EXIT
 
 
 
-# Start dbus-http
+# Start dbus-http, uploads are limited to 256 MiB
 # DBUS_HTTP_ARGS="-v DEBUG"
-./dbus-http -s -p ${PORT} ${DBUS_HTTP_ARGS} &
+./dbus-http -s -p ${PORT} -u ${UPLOAD_DIR} -U 268435456 ${DBUS_HTTP_ARGS} &
 dbus_http_pid=$!
 echo "Started dbus-http (${dbus_http_pid})"
 sleep 1
 
 # Run tests
-curl -F profile=@$RANDOM_FILE http://localhost:${PORT}/filepost
-
-diff /tmp/$RANDOM_FILE $RANDOM_FILE
-if [ $? -eq 0 ]; then
-    echo "File uploaded and compared successfully"
-else 
-    echo "File upload failed"
-fi
\ No newline at end of file
+printf "\n\n--Upload\n"
+curl -s -F profile=@$RANDOM_FILE http://localhost:${PORT}/filepost
+echo ""
+cmp -s ${UPLOAD_DIR}/$RANDOM_FILE $RANDOM_FILE || { ((failed_tests++)); echo "failed"; }
+
+printf "\n\n--Upload above the limit\n"
+head -c 300M </dev/zero > $RANDOM_FILE
+result=$(curl -s -o /dev/null -w '%{http_code}' -F profile=@$RANDOM_FILE http://localhost:${PORT}/filepost)
+echo "$result"
+[ "$result" == '413' ] || { ((failed_tests++)); echo "failed"; }
+# the earlier upload of the same name is left alone
+[ $(stat -c %s ${UPLOAD_DIR}/$RANDOM_FILE) -eq 1024 ] || { ((failed_tests++)); echo "failed"; }
+
+printf "\n\n--Upload throughput\n"
+printf "%8s %16s %16s\n" "MiB" "client MiB/s" "server MiB/s"
+for size in $UPLOAD_SIZES; do
+    head -c ${size}M </dev/urandom > $RANDOM_FILE
+    for round in $(seq $UPLOAD_ROUNDS); do
+        reply=$(mktemp)
+        client=$(curl -s -o $reply -w '%{speed_upload}' -F profile=@$RANDOM_FILE http://localhost:${PORT}/filepost)
+        server=$(sed -n 's/.*"bytes_per_second":\([0-9]*\).*/\1/p' $reply)
+        rm -f $reply
+        [ -n "$server" ] && cmp -s ${UPLOAD_DIR}/$RANDOM_FILE $RANDOM_FILE || { ((failed_tests++)); echo "failed"; continue; }
+        awk -v size=$size -v client=$client -v server=$server \
+            'BEGIN { printf "%8d %16.1f %16.1f\n", size, client / 1048576, server / 1048576 }'
+    done
+done
+
+printf "\nEnd of upload tests. $failed_tests tests failed.\n"
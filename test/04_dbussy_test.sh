@@ -72,7 +72,7 @@ failed_tests=0
 printf "\n\n--get_string\n"
 result=$(curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.dbussyTest/TestIf1 --data '{"interface":"dbus.http.dbussyTest", "method":"get_string", "arguments":[]}')
 echo "$result"
-[ "$result" == "{ \"arg0\": \"test1\" }" ] || { ((failed_tests++)); echo "failed"; }
+[ "$result" == "{\"arg0\":\"test1\"}" ] || { ((failed_tests++)); echo "failed"; }
 
 printf "\n\n--set_string\n"
 curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.dbussyTest/TestIf1 --data '{"interface":"dbus.http.dbussyTest", "method":"set_string", "arguments":["a new string with äöü"]}'
@@ -80,13 +80,13 @@ curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.dbussyTest/TestIf1 --data
 printf "\n\n--get_string\n"
 result=$(curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.dbussyTest/TestIf1 --data '{"interface":"dbus.http.dbussyTest", "method":"get_string", "arguments":[]}')
 echo "$result"
-[ "$result" == "{ \"arg0\": \"a new string with äöü\" }" ] || { ((failed_tests++)); echo "failed"; }
+[ "$result" == "{\"arg0\":\"a new string with äöü\"}" ] || { ((failed_tests++)); echo "failed"; }
 
 
 printf "\n\n--get_array_struct_ss\n"
 result=$(curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.dbussyTest/TestIf1 --data '{"interface":"dbus.http.dbussyTest", "method":"get_array_struct_ss", "arguments":[]}')
 echo "$result"
-reference="{ \"arg0\": [ [ \"bla\", \"bla\" ], [ \"ble\", \"ble\" ], [ \"blu\", \"blu\" ] ] }"
+reference="{\"arg0\":[[\"bla\",\"bla\"],[\"ble\",\"ble\"],[\"blu\",\"blu\"]]}"
 echo $reference
 [ "$result" == "$reference" ] || { ((failed_tests++)); echo "failed"; }
 
@@ -96,7 +96,7 @@ curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.dbussyTest/TestIf1 --data
 printf "\n\n--get_array_struct_ss\n"
 result=$(curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.dbussyTest/TestIf1 --data '{"interface":"dbus.http.dbussyTest", "method":"get_array_struct_ss", "arguments":[]}')
 echo "$result"
-reference="{ \"arg0\": [ [ \"foo\", \"bar\" ] ] }"
+reference="{\"arg0\":[[\"foo\",\"bar\"]]}"
 echo $reference
 [ "$result" == "$reference" ] || { ((failed_tests++)); echo "failed"; }
 
@@ -104,7 +104,7 @@ echo $reference
 printf "\n\n--get_array_struct_svs\n"
 result=$(curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.dbussyTest/TestIf1 --data '{"interface":"dbus.http.dbussyTest", "method":"get_array_struct_svs", "arguments":[]}')
 echo "$result"
-reference="{ \"arg0\": [ [ \"unsigned\", 123, \"updated bar1\" ] ] }"
+reference="{\"arg0\":[[\"unsigned\",123,\"updated bar1\"]]}"
 echo $reference
 [ "$result" == "$reference" ] || { ((failed_tests++)); echo "failed"; }
 
@@ -114,7 +114,7 @@ curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.dbussyTest/TestIf1 --data
 printf "\n\n--get_array_struct_svs\n"
 result=$(curl -s http://localhost:${PORT}/${DBUS_PATH}dbus.http.dbussyTest/TestIf1 --data '{"interface":"dbus.http.dbussyTest", "method":"get_array_struct_svs", "arguments":[]}')
 echo "$result"
-reference="{ \"arg0\": [ [ \"foo\", -124, \"bar\" ] ] }"
+reference="{\"arg0\":[[\"foo\",-124,\"bar\"]]}"
 echo $reference
 [ "$result" == "$reference" ] || { ((failed_tests++)); echo "failed"; }
 
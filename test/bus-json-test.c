@@ -0,0 +1,238 @@
+/* Checks that D-Bus messages transcoded straight into the JSON writer come
+ * out byte for byte like the JsonValue tree written afterwards, for every
+ * basic type, fixed and nested arrays, dicts with every supported key type,
+ * structs and variants.
+ *
+ * Messages are only built and read locally, but sd-bus creates them on a
+ * connected bus. Without a user or system bus the test is skipped.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <systemd/sd-bus.h>
+
+#include "systemd-compat.h"
+#include "buffer.h"
+#include "dbus-http.h"
+#include "json.h"
+#include "json-writer.h"
+
+#define _cleanup_(fn) __attribute__((__cleanup__(fn)))
+
+#define EXIT_TEST_SKIP 77
+
+typedef struct {
+        const char *name;
+        int (*build)(sd_bus_message *message);
+} TestCase;
+
+static int build_basic(sd_bus_message *message) {
+        return sd_bus_message_append(message, "ybnqiuxtdsog",
+                                     255, true, INT16_MIN, UINT16_MAX, INT32_MIN, UINT32_MAX,
+                                     (int64_t)INT64_MIN, (uint64_t)UINT64_MAX, -1.5,
+                                     "quote \" backslash \\ newline \n tab \t \xc3\xa9 \x01 end",
+                                     "/org/example/Object", "a{sv}");
+}
+
+static int build_numbers(sd_bus_message *message) {
+        return sd_bus_message_append(message, "yniuxtdddd",
+                                     0, 0, -1, 0, (int64_t)-1, (uint64_t)0,
+                                     0.0, 0.1, 1e300, -2.5e-300);
+}
+
+static int build_fixed_arrays(sd_bus_message *message) {
+        const uint8_t bytes[] = { 0, 1, 127, 128, 255 };
+        const int16_t int16s[] = { INT16_MIN, -1, 0, INT16_MAX };
+        const uint16_t uint16s[] = { 0, 1, UINT16_MAX };
+        const int32_t int32s[] = { INT32_MIN, -1, 0, INT32_MAX };
+        const uint32_t uint32s[] = { 0, 1, UINT32_MAX };
+        const int64_t int64s[] = { INT64_MIN, -1, 0, INT64_MAX };
+        const uint64_t uint64s[] = { 0, 1, UINT64_MAX };
+        const double doubles[] = { -0.5, 0, 3.25, 1e-10 };
+        int r;
+
+        if ((r = sd_bus_message_append_array(message, 'y', bytes, sizeof(bytes))) < 0 ||
+            (r = sd_bus_message_append_array(message, 'n', int16s, sizeof(int16s))) < 0 ||
+            (r = sd_bus_message_append_array(message, 'q', uint16s, sizeof(uint16s))) < 0 ||
+            (r = sd_bus_message_append_array(message, 'i', int32s, sizeof(int32s))) < 0 ||
+            (r = sd_bus_message_append_array(message, 'u', uint32s, sizeof(uint32s))) < 0 ||
+            (r = sd_bus_message_append_array(message, 'x', int64s, sizeof(int64s))) < 0 ||
+            (r = sd_bus_message_append_array(message, 't', uint64s, sizeof(uint64s))) < 0 ||
+            (r = sd_bus_message_append_array(message, 'd', doubles, sizeof(doubles))) < 0)
+                return r;
+
+        // sd-bus does not append booleans as a fixed array
+        r = sd_bus_message_append(message, "ab", 3, true, false, true);
+        if (r < 0)
+                return r;
+
+        // empty ones
+        if ((r = sd_bus_message_append_array(message, 'y', NULL, 0)) < 0 ||
+            (r = sd_bus_message_append_array(message, 'i', NULL, 0)) < 0 ||
+            (r = sd_bus_message_append_array(message, 'd', NULL, 0)) < 0)
+                return r;
+
+        return 0;
+}
+
+static int build_string_arrays(sd_bus_message *message) {
+        return sd_bus_message_append(message, "asaoagas",
+                                     3, "one", "", "three \"quoted\"",
+                                     2, "/", "/org/example",
+                                     2, "a{sv}", "(ii)",
+                                     0);
+}
+
+static int build_nested(sd_bus_message *message) {
+        return sd_bus_message_append(message, "a(isa{si})aaiaas((ii)s)",
+                                     2,
+                                     1, "one", 1, "key", 11,
+                                     2, "two", 0,
+                                     3, 2, 1, 2, 0, 1, 3,
+                                     2, 1, "x", 0,
+                                     4, 5, "struct");
+}
+
+static int build_dicts(sd_bus_message *message) {
+        return sd_bus_message_append(message, "a{ys}a{ni}a{qi}a{ui}a{xs}a{ts}a{ds}a{os}a{gs}a{sa{sv}}",
+                                     2, 1, "one", 255, "max",
+                                     1, -7, 7,
+                                     1, 7, 7,
+                                     1, UINT32_MAX, 7,
+                                     1, (int64_t)INT64_MIN, "min",
+                                     1, (uint64_t)UINT64_MAX, "max",
+                                     2, 2.5, "two and a half", -0.125, "negative",
+                                     1, "/org/example", "object",
+                                     1, "a{sv}", "signature",
+                                     1, "outer", 2, "int", "i", 1, "strings", "as", 2, "a", "b");
+}
+
+static int build_variants(sd_bus_message *message) {
+        return sd_bus_message_append(message, "vvvvvv",
+                                     "i", 42,
+                                     "as", 2, "a", "b",
+                                     "v", "s", "inner",
+                                     "(ib)", 1, true,
+                                     "a{sv}", 0,
+                                     "ay", 2, 1, 2);
+}
+
+static int build_properties(sd_bus_message *message) {
+        return sd_bus_message_append(message, "sa{sv}as",
+                                     "org.example.Interface",
+                                     4,
+                                     "Name", "s", "example",
+                                     "Count", "u", 3,
+                                     "Ratio", "d", 0.75,
+                                     "Items", "a(sv)", 1, "nested", "x", (int64_t)-3,
+                                     1, "Invalidated");
+}
+
+static const TestCase test_cases[] = {
+        { "basic types", build_basic },
+        { "numbers", build_numbers },
+        { "fixed arrays", build_fixed_arrays },
+        { "string arrays", build_string_arrays },
+        { "nested containers", build_nested },
+        { "dicts", build_dicts },
+        { "variants", build_variants },
+        { "properties", build_properties },
+};
+
+static int write_tree(sd_bus_message *message, Buffer *buffer) {
+        JsonWriter writer;
+        int r;
+
+        json_writer_init(&writer, buffer);
+        json_writer_begin_array(&writer);
+        while (!sd_bus_message_at_end(message, false)) {
+                JsonValue *value;
+
+                r = bus_message_element_to_json(message, &value);
+                if (r < 0)
+                        return r;
+
+                json_writer_value(&writer, value);
+                json_value_free(value);
+        }
+        json_writer_end_array(&writer);
+
+        return 0;
+}
+
+static int write_direct(sd_bus_message *message, Buffer *buffer) {
+        JsonWriter writer;
+        int r;
+
+        json_writer_init(&writer, buffer);
+        json_writer_begin_array(&writer);
+        while (!sd_bus_message_at_end(message, false)) {
+                r = bus_message_element_write_json(message, &writer, 0);
+                if (r < 0)
+                        return r;
+        }
+        json_writer_end_array(&writer);
+
+        return 0;
+}
+
+static bool run_test_case(sd_bus *bus, const TestCase *test_case) {
+        _cleanup_(sd_bus_message_unrefp) sd_bus_message *message = NULL;
+        _cleanup_(buffer_clear) Buffer tree = {};
+        _cleanup_(buffer_clear) Buffer direct = {};
+        int r;
+
+        r = sd_bus_message_new_method_call(bus, &message, "org.example", "/org/example", "org.example", "Test");
+        if (r >= 0)
+                r = test_case->build(message);
+        if (r >= 0)
+                r = sd_bus_message_seal(message, 1, 0);
+        if (r < 0) {
+                fprintf(stderr, "%s: building the message failed: %s\n", test_case->name, strerror(-r));
+                return false;
+        }
+
+        r = sd_bus_message_rewind(message, true);
+        if (r >= 0)
+                r = write_tree(message, &tree);
+        if (r < 0) {
+                fprintf(stderr, "%s: tree path failed: %s\n", test_case->name, strerror(-r));
+                return false;
+        }
+
+        r = sd_bus_message_rewind(message, true);
+        if (r >= 0)
+                r = write_direct(message, &direct);
+        if (r < 0) {
+                fprintf(stderr, "%s: writer path failed: %s\n", test_case->name, strerror(-r));
+                return false;
+        }
+
+        if (tree.size != direct.size || memcmp(tree.data, direct.data, tree.size) != 0) {
+                fprintf(stderr, "%s: outputs differ\n  tree:   %s\n  writer: %s\n", test_case->name, tree.data, direct.data);
+                return false;
+        }
+
+        printf("%s: %s\n", test_case->name, direct.data);
+        return true;
+}
+
+int main(int argc, char **argv) {
+        _cleanup_(sd_bus_unrefp) sd_bus *bus = NULL;
+        unsigned failed = 0;
+
+        if (sd_bus_open_user(&bus) < 0 && sd_bus_open_system(&bus) < 0) {
+                puts("no bus to create messages on, skipped");
+                return EXIT_TEST_SKIP;
+        }
+
+        for (size_t i = 0; i < sizeof(test_cases) / sizeof(test_cases[0]); i++)
+                if (!run_test_case(bus, &test_cases[i]))
+                        failed += 1;
+
+        printf("%u of %zu cases failed\n", failed, sizeof(test_cases) / sizeof(test_cases[0]));
+        return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
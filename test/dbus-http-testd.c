@@ -73,6 +73,8 @@ static int method_divide(sd_bus_message *m, void *userdata, sd_bus_error *ret_er
         if (y == 0) {
                 zdiv_counter++;
                 fprintf(stderr, "Division by Zero! (%"PRId64" / %"PRId64")\n", x, y);
+                sd_bus_emit_properties_changed(sd_bus_message_get_bus(m), "/dbus/http/Calculator",
+                                               "dbus.http.Calculator", "ZeroDivisionCounter", NULL);
                 sd_bus_error_set_const(ret_error, "dbus.http.DivisionByZero", "Sorry, can't allow division by zero.");
                 return -EINVAL;
         }
@@ -141,6 +143,27 @@ static int method_set_array(sd_bus_message *m, void *userdata, sd_bus_error *ret
 }
 
 
+static int method_echo_bytes(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        _cleanup_(sd_bus_message_unrefp) sd_bus_message *reply = NULL;
+        const void *a;
+        size_t sz;
+        int r;
+
+        r = sd_bus_message_read_array(m, 'y', &a, &sz);
+        if (r < 0)
+                return r;
+
+        r = sd_bus_message_new_method_return(m, &reply);
+        if (r < 0)
+                return r;
+
+        r = sd_bus_message_append_array(reply, 'y', a, sz);
+        if (r < 0)
+                return r;
+
+        return sd_bus_send(NULL, reply, NULL);
+}
+
 
 static char get_set_dict_key1[20] = "key1";
 static int get_set_dict_i1 = 17;
@@ -349,13 +372,14 @@ static const sd_bus_vtable calculator_vtable[] = {
         SD_BUS_METHOD("Divide", "xx", "x", method_divide,   SD_BUS_VTABLE_UNPRIVILEGED),
         SD_BUS_METHOD("GetArray", NULL, "ai", method_get_array, SD_BUS_VTABLE_UNPRIVILEGED),
         SD_BUS_METHOD("SetArray", "ai", NULL, method_set_array, SD_BUS_VTABLE_UNPRIVILEGED),
+        SD_BUS_METHOD("EchoBytes", "ay", "ay", method_echo_bytes, SD_BUS_VTABLE_UNPRIVILEGED),
         SD_BUS_METHOD("GetDict", NULL, "a{sv}", method_get_dict, SD_BUS_VTABLE_UNPRIVILEGED),
         SD_BUS_METHOD("SetDict", "a{sv}", NULL, method_set_dict, SD_BUS_VTABLE_UNPRIVILEGED),
         SD_BUS_METHOD("GetStruct", NULL, "(is)", method_get_struct, SD_BUS_VTABLE_UNPRIVILEGED),
         SD_BUS_METHOD("SetStruct", "(is)", NULL, method_set_struct, SD_BUS_VTABLE_UNPRIVILEGED),
         SD_BUS_METHOD("GetNested1", NULL, "a(is)vai", method_get_nested1, SD_BUS_VTABLE_UNPRIVILEGED),
         SD_BUS_METHOD("SetNested1", "a(is)vai", NULL, method_set_nested1, SD_BUS_VTABLE_UNPRIVILEGED),
-        SD_BUS_PROPERTY("ZeroDivisionCounter", "u", get_zdiv_counter, 0, 0),
+        SD_BUS_PROPERTY("ZeroDivisionCounter", "u", get_zdiv_counter, 0, SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
         SD_BUS_VTABLE_END
 };
 
@@ -0,0 +1,294 @@
+/* Measures JSON parser throughput on a synthetic method call body
+ * shaped like the large "arguments" arrays clients POST to /dbus/.
+ *
+ * Usage: json-bench [elements] [iterations] [padding]
+ *
+ * padding appends that many bytes to every plain string, to mimic long
+ * values such as journal messages.
+ *
+ * The tree-walk row visits every value of the parsed tree, build-array
+ * fills an array with one string or integer per element.
+ *
+ * The dict rows build, write and search an object with one key per element,
+ * shaped like a large a{sv} reply.
+ *
+ * Set DBUS_HTTP_JSON_SCAN=scalar or sse2 to compare the scanning kernels.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "json.h"
+#include "json-writer.h"
+
+#define _cleanup_(fn) __attribute__((__cleanup__(fn)))
+
+static void freep(void *p) {
+        free(*(void **)p);
+}
+
+static double now(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char * make_body(size_t n_elements, size_t padding, size_t *lengthp) {
+        char *body;
+        size_t size;
+        FILE *f;
+
+        f = open_memstream(&body, &size);
+        fputs("{ \"interface\": \"org.freedesktop.systemd1.Manager\", \"method\": \"SetUnitProperties\", \"arguments\": [ ", f);
+        for (size_t i = 0; i < n_elements; i++) {
+                if (i > 0)
+                        fputs(", ", f);
+
+                // mostly plain strings, some with escapes, some numbers and nested containers
+                switch (i % 4) {
+                case 0:
+                        fprintf(f, "\"/org/freedesktop/systemd1/unit/dev_2dsda%zu_2edevice%*s\"", i, (int)padding, "");
+                        break;
+                case 1:
+                        fprintf(f, "\"Description=\\\"Unit %zu\\\"\\nWants=network-online.target\\t\\u00e9\"", i);
+                        break;
+                case 2:
+                        fprintf(f, "%zu.5", i);
+                        break;
+                case 3:
+                        fprintf(f, "{ \"dbus_variant_sign\": \"a(sv)\", \"data\": [ [ \"Nice\", %zu ], [ \"CPUQuota\", true ] ] }", i % 20);
+                        break;
+                }
+        }
+        fputs(" ] }", f);
+        fclose(f);
+
+        *lengthp = size;
+        return body;
+}
+
+// visits every value the way the D-Bus marshaller does, without a tree
+static bool walk(JsonReader *reader) {
+        const char *string;
+        JsonNumber number;
+        bool b;
+        int r;
+
+        switch (json_reader_peek(reader)) {
+        case JSON_TYPE_STRING:
+                return json_reader_read_string(reader, &string);
+        case JSON_TYPE_NUMBER:
+                return json_reader_read_number(reader, &number);
+        case JSON_TYPE_TRUE:
+        case JSON_TYPE_FALSE:
+                return json_reader_read_boolean(reader, &b);
+        case JSON_TYPE_OBJECT:
+                json_reader_begin_object(reader);
+                while ((r = json_reader_next_key(reader, &string)) > 0)
+                        if (!walk(reader))
+                                return false;
+                return r == 0;
+        case JSON_TYPE_ARRAY:
+                json_reader_begin_array(reader);
+                while ((r = json_reader_next_element(reader)) > 0)
+                        if (!walk(reader))
+                                return false;
+                return r == 0;
+        default:
+                return json_reader_skip(reader);
+        }
+}
+
+// visits every value of a parsed tree, returns the total length of its strings
+static size_t walk_tree(JsonValue *value) {
+        _cleanup_(json_object_iterator_freep) JsonObjectIterator *iter = NULL;
+        JsonObjectEntry *entry;
+        JsonValue *element;
+        size_t sum = 0;
+
+        switch (json_value_get_type(value)) {
+        case JSON_TYPE_STRING:
+                return strlen(json_value_get_string(value));
+        case JSON_TYPE_NUMBER:
+                return json_value_get_number(value) > 0;
+        case JSON_TYPE_OBJECT:
+                iter = json_object_iterator_new(value);
+                while ((entry = json_object_iterator_next(iter)))
+                        sum += walk_tree(json_object_entry_value(entry));
+                return sum;
+        case JSON_TYPE_ARRAY:
+                for (size_t i = 0; json_array_get(value, i, &element, 0); i++)
+                        sum += walk_tree(element);
+                return sum;
+        default:
+                return 0;
+        }
+}
+
+static void report(const char *name, size_t length, size_t iterations, double seconds) {
+        printf("%-12s %8.1f MB/s  %8.3f ms/parse\n", name,
+               length * iterations / seconds / (1024 * 1024), seconds * 1000 / iterations);
+}
+
+static void report_keys(const char *name, size_t n_keys, size_t iterations, double seconds) {
+        printf("%-12s %8.1f ns/key   %8.3f ms/dict\n", name,
+               seconds * 1e9 / (n_keys * iterations), seconds * 1000 / iterations);
+}
+
+static void bench_build(size_t n_elements, size_t iterations) {
+        _cleanup_(freep) char *strings = NULL;
+        double start, seconds;
+
+        strings = malloc(n_elements * 32);
+        for (size_t k = 0; k < n_elements; k++)
+                snprintf(strings + k * 32, 32, k % 4 ? "Unit%zu" : "/org/freedesktop/systemd1/unit/%zu", k);
+
+        start = now();
+        for (size_t i = 0; i < iterations; i++) {
+                _cleanup_(json_value_freep) JsonValue *array = NULL;
+
+                array = json_array_new();
+                for (size_t k = 0; k < n_elements; k++)
+                        json_array_append(array, k % 2 ? json_integer_new(k) : json_string_new(strings + k * 32));
+        }
+        seconds = now() - start;
+
+        printf("%-12s %8.1f ns/elem  %8.3f ms/array\n", "build-array",
+               seconds * 1e9 / (n_elements * iterations), seconds * 1000 / iterations);
+}
+
+static void bench_dict(size_t n_keys, size_t iterations) {
+        _cleanup_(json_value_freep) JsonValue *dict = NULL;
+        _cleanup_(freep) char *keys = NULL;
+        double start;
+
+        keys = malloc(n_keys * 32);
+        for (size_t k = 0; k < n_keys; k++)
+                snprintf(keys + k * 32, 32, "Property%zu", k);
+
+        start = now();
+        for (size_t i = 0; i < iterations; i++) {
+                _cleanup_(buffer_clear) Buffer buffer = {};
+                JsonWriter writer;
+
+                if (dict)
+                        json_value_free(dict);
+                dict = json_object_new();
+                for (size_t k = 0; k < n_keys; k++)
+                        json_object_insert(dict, keys + k * 32, json_integer_new(k));
+
+                json_writer_init(&writer, &buffer);
+                json_writer_value(&writer, dict);
+        }
+        report_keys("dict-write", n_keys, iterations, now() - start);
+
+        start = now();
+        for (size_t i = 0; i < iterations; i++) {
+                for (size_t k = 0; k < n_keys; k++) {
+                        if (!json_object_lookup(dict, keys + (k * 7919) % n_keys * 32, NULL, JSON_TYPE_NUMBER)) {
+                                fputs("json_object_lookup failed\n", stderr);
+                                exit(EXIT_FAILURE);
+                        }
+                }
+        }
+        report_keys("dict-lookup", n_keys, iterations, now() - start);
+}
+
+int main(int argc, char **argv) {
+        _cleanup_(freep) char *body = NULL;
+        _cleanup_(freep) char *scratch = NULL;
+        size_t n_elements = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+        size_t iterations = argc > 2 ? strtoul(argv[2], NULL, 10) : 20;
+        size_t padding = argc > 3 ? strtoul(argv[3], NULL, 10) : 0;
+        size_t length;
+        double start;
+
+        body = make_body(n_elements, padding, &length);
+        scratch = malloc(length + 1);
+        printf("%zu elements, %zu bytes\n", n_elements, length);
+
+        start = now();
+        for (size_t i = 0; i < iterations; i++) {
+                JsonValue *value;
+
+                if (json_parse(body, &value, JSON_TYPE_OBJECT) < 0) {
+                        fputs("json_parse failed\n", stderr);
+                        return EXIT_FAILURE;
+                }
+                json_value_free(value);
+        }
+        report("copy", length, iterations, now() - start);
+
+        // the copy stands in for the request body, which the daemon already owns
+        start = now();
+        for (size_t i = 0; i < iterations; i++) {
+                JsonValue *value;
+
+                memcpy(scratch, body, length + 1);
+                if (json_parse_in_place(scratch, length, &value, JSON_TYPE_OBJECT) < 0) {
+                        fputs("json_parse_in_place failed\n", stderr);
+                        return EXIT_FAILURE;
+                }
+                json_value_free(value);
+        }
+        report("in-place", length, iterations, now() - start);
+
+        start = now();
+        for (size_t i = 0; i < iterations; i++) {
+                JsonReader reader;
+
+                memcpy(scratch, body, length + 1);
+                json_reader_init(&reader, scratch, length);
+                if (!walk(&reader)) {
+                        fputs("json_reader failed\n", stderr);
+                        return EXIT_FAILURE;
+                }
+        }
+        report("reader", length, iterations, now() - start);
+
+        {
+                _cleanup_(json_value_freep) JsonValue *value = NULL;
+
+                json_parse(body, &value, JSON_TYPE_OBJECT);
+
+                // replies used to be printed into a memstream
+                start = now();
+                for (size_t i = 0; i < iterations; i++) {
+                        _cleanup_(freep) char *out = NULL;
+                        size_t size;
+                        FILE *f;
+
+                        f = open_memstream(&out, &size);
+                        json_print(value, f);
+                        fclose(f);
+                }
+                report("print", length, iterations, now() - start);
+
+                start = now();
+                for (size_t i = 0; i < iterations; i++) {
+                        _cleanup_(buffer_clear) Buffer buffer = {};
+                        JsonWriter writer;
+
+                        json_writer_init(&writer, &buffer);
+                        json_writer_value(&writer, value);
+                }
+                report("writer", length, iterations, now() - start);
+
+                start = now();
+                for (size_t i = 0; i < iterations; i++) {
+                        if (walk_tree(value) == 0) {
+                                fputs("walk_tree failed\n", stderr);
+                                return EXIT_FAILURE;
+                        }
+                }
+                report("tree-walk", length, iterations, now() - start);
+        }
+
+        bench_build(n_elements, iterations);
+        bench_dict(n_elements, iterations);
+
+        return EXIT_SUCCESS;
+}
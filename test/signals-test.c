@@ -0,0 +1,153 @@
+/* Checks that a signal match without subscribers is removed once its linger
+ * time is over, even while its signal keeps firing. Each signal used to
+ * restart the linger timer, so a chatty match was never removed.
+ *
+ * The test sends signals to itself on the user or system bus. Without one
+ * it is skipped.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <systemd/sd-bus.h>
+#include <systemd/sd-event.h>
+
+#include "systemd-compat.h"
+#include "signals.h"
+
+#define _cleanup_(fn) __attribute__((__cleanup__(fn)))
+
+#define EXIT_TEST_SKIP 77
+
+#define USEC_PER_MSEC 1000ULL
+
+#define TEST_PATH "/org/example/SignalsTest"
+#define TEST_INTERFACE "org.example.SignalsTest"
+#define TEST_MEMBER "Tick"
+
+// signals are sent much more often than the match lingers
+#define TICK_USEC (20 * USEC_PER_MSEC)
+#define LINGER_USEC (200 * USEC_PER_MSEC)
+// the linger timer may fire up to a second late
+#define TEST_USEC (2500 * USEC_PER_MSEC)
+
+static void freep(void *p) {
+        free(*(void **)p);
+}
+
+typedef struct {
+        sd_bus *bus;
+        SignalSubscriber subscriber;
+        unsigned n_delivered;
+        unsigned n_sent;
+} Test;
+
+static void test_deliver(SignalSubscriber *subscriber, SignalBuffer *buffer) {
+        Test *test = subscriber->userdata;
+
+        test->n_delivered += 1;
+
+        // leaves from within the dispatch, as a disconnecting client would
+        signal_registry_unsubscribe(subscriber);
+}
+
+static int test_tick(sd_event_source *source, uint64_t usec, void *userdata) {
+        Test *test = userdata;
+        int r;
+
+        r = sd_bus_emit_signal(test->bus, TEST_PATH, TEST_INTERFACE, TEST_MEMBER, "u", test->n_sent);
+        if (r < 0) {
+                fprintf(stderr, "Emitting the signal failed: %s\n", strerror(-r));
+                return sd_event_exit(sd_bus_get_event(test->bus), r);
+        }
+        test->n_sent += 1;
+
+        sd_event_source_set_time(source, usec + TICK_USEC);
+        return sd_event_source_set_enabled(source, SD_EVENT_ONESHOT);
+}
+
+static int test_done(sd_event_source *source, uint64_t usec, void *userdata) {
+        Test *test = userdata;
+
+        return sd_event_exit(sd_bus_get_event(test->bus), 0);
+}
+
+int main(int argc, char **argv) {
+        _cleanup_(sd_event_unrefp) sd_event *loop = NULL;
+        _cleanup_(sd_bus_unrefp) sd_bus *bus = NULL;
+        _cleanup_(signal_registry_freep) SignalRegistry *registry = NULL;
+        _cleanup_(freep) char *rule = NULL;
+        sd_event_source *tick = NULL;
+        sd_event_source *done = NULL;
+        Test test = {};
+        const char *unique_name;
+        uint64_t now;
+        int r;
+
+        if (sd_bus_open_user(&bus) < 0 && sd_bus_open_system(&bus) < 0) {
+                puts("no bus to send signals on, skipped");
+                return EXIT_TEST_SKIP;
+        }
+
+        r = sd_event_default(&loop);
+        if (r >= 0)
+                r = sd_bus_attach_event(bus, loop, 0);
+        if (r >= 0)
+                r = sd_bus_get_unique_name(bus, &unique_name);
+        if (r >= 0)
+                r = signal_registry_new(&registry, bus);
+        if (r >= 0)
+                r = signal_match_rule_new(&rule, unique_name, TEST_PATH, TEST_INTERFACE, TEST_MEMBER);
+        if (r < 0) {
+                fprintf(stderr, "Setting up failed: %s\n", strerror(-r));
+                return EXIT_FAILURE;
+        }
+
+        signal_registry_set_linger_time(registry, LINGER_USEC);
+
+        test.bus = bus;
+        test.subscriber.deliver = test_deliver;
+        test.subscriber.userdata = &test;
+
+        r = signal_registry_subscribe(registry, rule, &test.subscriber);
+        if (r < 0) {
+                fprintf(stderr, "Subscribing failed: %s\n", strerror(-r));
+                return EXIT_FAILURE;
+        }
+
+        sd_event_now(loop, CLOCK_MONOTONIC, &now);
+        r = sd_event_add_time(loop, &tick, CLOCK_MONOTONIC, now, 1, test_tick, &test);
+        if (r >= 0)
+                r = sd_event_add_time(loop, &done, CLOCK_MONOTONIC, now + TEST_USEC, 1, test_done, &test);
+        if (r < 0) {
+                fprintf(stderr, "Adding timers failed: %s\n", strerror(-r));
+                return EXIT_FAILURE;
+        }
+
+        r = sd_event_loop(loop);
+
+        sd_event_source_unref(tick);
+        sd_event_source_unref(done);
+
+        if (r < 0)
+                return EXIT_FAILURE;
+
+        printf("%u signals sent, %u delivered, %zu matches left\n",
+               test.n_sent, test.n_delivered, signal_registry_get_n_matches(registry));
+
+        if (test.n_delivered != 1) {
+                fprintf(stderr, "The subscriber should have received exactly one signal\n");
+                return EXIT_FAILURE;
+        }
+
+        if (signal_registry_get_n_matches(registry) != 0) {
+                fprintf(stderr, "The match outlived its linger time\n");
+                return EXIT_FAILURE;
+        }
+
+        return EXIT_SUCCESS;
+}